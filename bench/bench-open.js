@@ -0,0 +1,358 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Open throughput and latency, for a configuration under test against the
+ * baseline of one fork()ed child per open:
+ *
+ *     node bench/bench-open.js -z zone[,zone...] [-n opens] [-c concurrency]
+ *         [-m r,w,a] [-s sizes] [-S] [-C config]
+ *
+ * -s takes a comma separated list of file sizes in bytes; a scratch file of
+ * each size is written into every zone first and the opens are spread over
+ * them.  -S reads every file to the end through createZoneFileStream rather
+ * than just opening it.  -C is a JSON object handed to zfile.configure()
+ * for the second run, e.g. -C '{"agents": true}'.
+ *
+ * Besides opens/s and latency percentiles each run reports how much RSS
+ * grew and how many fds and process contracts were left behind; anything
+ * but 0 in the last two is a leak.  How many opens reused a pooled request
+ * rather than allocating one is reported with the phase times.
+ */
+
+var exec = require('child_process').exec;
+var fs = require('fs');
+var vasync = require('vasync');
+var zfile = require('../lib/zfile');
+
+var BASELINE = { agents: false, spawn: 'fork' };
+var SCRATCH = '/var/tmp/zfile-bench';
+
+function usage(msg) {
+    if (msg) {
+        console.error(msg);
+    }
+    console.error('usage: bench-open.js -z zone[,zone...] [-n opens] ' +
+        '[-c concurrency] [-m modes] [-s sizes] [-S] [-C config]');
+    process.exit(2);
+}
+
+function parseArgs(argv) {
+    var opts = {
+        zones: null,
+        count: 1000,
+        concurrency: 1,
+        modes: ['r'],
+        sizes: null,
+        stream: false,
+        config: null
+    };
+
+    for (var i = 0; i < argv.length; i++) {
+        var val = argv[i + 1];
+        switch (argv[i]) {
+        case '-z':
+            opts.zones = val.split(',');
+            break;
+        case '-n':
+            opts.count = parseInt(val, 10);
+            break;
+        case '-c':
+            opts.concurrency = parseInt(val, 10);
+            break;
+        case '-m':
+            opts.modes = val.split(',');
+            break;
+        case '-s':
+            opts.sizes = val.split(',').map(function (s) {
+                return (parseInt(s, 10));
+            });
+            break;
+        case '-S':
+            opts.stream = true;
+            i--;
+            break;
+        case '-C':
+            try {
+                opts.config = JSON.parse(val);
+            } catch (e) {
+                usage('-C: ' + e.message);
+            }
+            break;
+        default:
+            usage('unknown option: ' + argv[i]);
+        }
+        i++;
+    }
+
+    if (!opts.zones) {
+        usage('-z is required');
+    }
+    if (isNaN(opts.count) || opts.count <= 0 ||
+        isNaN(opts.concurrency) || opts.concurrency <= 0) {
+        usage();
+    }
+    opts.modes.forEach(function (m) {
+        if (m !== 'r' && m !== 'w' && m !== 'a') {
+            usage('bad mode: ' + m);
+        }
+    });
+    if (opts.sizes && opts.sizes.some(isNaN)) {
+        usage('bad size list');
+    }
+
+    return (opts);
+}
+
+function percentile(sorted, p) {
+    return (sorted[Math.min(sorted.length - 1,
+        Math.floor(sorted.length * p))]);
+}
+
+function countFds() {
+    return (fs.readdirSync('/proc/self/fd').length);
+}
+
+/*
+ * Process contracts held by this process, per ctstat(1).
+ */
+function countContracts(callback) {
+    exec('ctstat -t process -a', function (err, stdout) {
+        if (err) {
+            return (callback(null, -1));
+        }
+        var n = 0;
+        stdout.split('\n').forEach(function (line) {
+            var f = line.trim().split(/\s+/);
+            if (f[4] === String(process.pid)) {
+                n++;
+            }
+        });
+        return (callback(null, n));
+    });
+}
+
+/*
+ * The files each run opens, round robin: one per zone per size when -s is
+ * given, otherwise /etc/passwd in each zone.
+ */
+function targets(opts) {
+    var t = [];
+    opts.zones.forEach(function (zone) {
+        if (!opts.sizes) {
+            t.push({ zone: zone, path: '/etc/passwd', size: 0 });
+            return;
+        }
+        opts.sizes.forEach(function (size) {
+            t.push({ zone: zone, path: SCRATCH + '-' + size, size: size });
+        });
+    });
+    return (t);
+}
+
+function writeScratch(t, callback) {
+    zfile.getZoneFileDescriptor({ zone: t.zone, path: t.path, mode: 'w' },
+        function (err, fd) {
+            if (err) {
+                return (callback(err));
+            }
+            var buf = new Buffer(65536);
+            var left = t.size;
+            buf.fill(0x61);
+            while (left > 0) {
+                var n = Math.min(left, buf.length);
+                fs.writeSync(fd, buf, 0, n, null);
+                left -= n;
+            }
+            fs.closeSync(fd);
+            return (callback());
+        });
+}
+
+/*
+ * Writes only ever go to the scratch files; with no -s a 'w' or 'a' run
+ * falls back to reading so as not to clobber /etc/passwd.
+ */
+function openOne(opts, t, mode, callback) {
+    if (!opts.sizes) {
+        mode = 'r';
+    }
+
+    if (!opts.stream) {
+        zfile.getZoneFileDescriptor({ zone: t.zone, path: t.path, mode: mode },
+            function (err, fd) {
+                if (!err) {
+                    fs.closeSync(fd);
+                }
+                callback(err);
+            });
+        return;
+    }
+
+    zfile.createZoneFileStream({ zone: t.zone, path: t.path, mode: mode },
+        function (err, stream) {
+            if (err) {
+                return (callback(err));
+            }
+            if (mode !== 'r') {
+                stream.on('close', function () { callback(); });
+                stream.end('x');
+                return (undefined);
+            }
+            stream.on('end', function () { callback(); });
+            stream.on('error', callback);
+            stream.resume();
+            return (undefined);
+        });
+}
+
+function run(opts, config, callback) {
+    var list = targets(opts);
+    var samples = [];
+    var errors = 0;
+    var issued = 0;
+    var fds = countFds();
+    var rss = process.memoryUsage().rss;
+    var start = null;
+
+    zfile.configure(config);
+    zfile.resetStats();
+
+    countContracts(function (_, contracts) {
+        start = process.hrtime();
+        var workers = [];
+        for (var i = 0; i < opts.concurrency; i++) {
+            workers.push(i);
+        }
+        vasync.forEachParallel({ inputs: workers, func: worker },
+            function (err) {
+                if (err) {
+                    return (callback(err));
+                }
+                return (finish(contracts));
+            });
+    });
+
+    function worker(_, next) {
+        if (issued === opts.count) {
+            return (next());
+        }
+        var n = issued++;
+        var t = list[n % list.length];
+        var mode = opts.modes[n % opts.modes.length];
+        var t0 = process.hrtime();
+        openOne(opts, t, mode, function (err) {
+            var dt = process.hrtime(t0);
+            if (err) {
+                errors++;
+            }
+            samples.push(dt[0] * 1e3 + dt[1] / 1e6);
+            worker(_, next);
+        });
+        return (undefined);
+    }
+
+    function finish(contracts) {
+        var elapsed = process.hrtime(start);
+        var secs = elapsed[0] + elapsed[1] / 1e9;
+        countContracts(function (__, after) {
+            samples.sort(function (a, b) { return (a - b); });
+            callback(null, {
+                rate: samples.length / secs,
+                p50: percentile(samples, 0.5),
+                p99: percentile(samples, 0.99),
+                p999: percentile(samples, 0.999),
+                errors: errors,
+                rss: (process.memoryUsage().rss - rss) / 1048576,
+                fds: countFds() - fds,
+                contracts: contracts < 0 || after < 0 ? NaN :
+                    after - contracts,
+                stats: zfile.getStats()
+            });
+        });
+    }
+}
+
+function main() {
+    var opts = parseArgs(process.argv.slice(2));
+    var runs = [ { name: 'baseline', config: BASELINE } ];
+    var results = [];
+
+    if (opts.config) {
+        var config = {};
+        Object.keys(BASELINE).forEach(function (k) {
+            config[k] = BASELINE[k];
+        });
+        Object.keys(opts.config).forEach(function (k) {
+            config[k] = opts.config[k];
+        });
+        runs.push({ name: JSON.stringify(opts.config), config: config });
+    }
+
+    console.log('%d opens over %d zone(s), concurrency %d, modes %s%s',
+        opts.count, opts.zones.length, opts.concurrency,
+        opts.modes.join(','), opts.stream ? ', streamed' : '');
+
+    zfile.configure(BASELINE);
+    vasync.forEachPipeline({
+        inputs: opts.sizes ? targets(opts) : [],
+        func: writeScratch
+    }, function (err) {
+        if (err) {
+            console.error('writing scratch files: %s', err.message);
+            process.exit(1);
+        }
+        vasync.forEachPipeline({
+            inputs: runs,
+            func: function (r, next) {
+                run(opts, r.config, function (err2, res) {
+                    if (!err2) {
+                        res.name = r.name;
+                        results.push(res);
+                    }
+                    next(err2);
+                });
+            }
+        }, function (err2) {
+            if (err2) {
+                console.error(err2.message);
+                process.exit(1);
+            }
+            report(results);
+        });
+    });
+}
+
+function report(results) {
+    var base = results[0].rate;
+
+    console.log('%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s', 'run', 'opens/s',
+        'p50', 'p99', 'p999', 'errors', 'rss', 'fds', 'contracts', 'vs base');
+    results.forEach(function (r) {
+        console.log('%s\t%s\t%sms\t%sms\t%sms\t%d\t%sMB\t%d\t%s\t%sx', r.name,
+            r.rate.toFixed(1), r.p50.toFixed(3), r.p99.toFixed(3),
+            r.p999.toFixed(3), r.errors, r.rss.toFixed(1), r.fds,
+            isNaN(r.contracts) ? '?' : r.contracts,
+            (r.rate / base).toFixed(2));
+    });
+
+    results.forEach(function (r) {
+        console.log('\n%s phases (us):', r.name);
+        Object.keys(r.stats.phases).forEach(function (p) {
+            var h = r.stats.phases[p];
+            if (h.count === 0) {
+                return;
+            }
+            console.log('  %s\tp50 %s\tp99 %s\tp999 %s', p,
+                (h.p50 / 1e3).toFixed(1), (h.p99 / 1e3).toFixed(1),
+                (h.p999 / 1e3).toFixed(1));
+        });
+        var b = r.stats.batonPool;
+        console.log('  batons\t%d reused\t%d allocated', b.hits, b.misses);
+    });
+}
+
+main();
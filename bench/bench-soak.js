@@ -0,0 +1,260 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Long-running leak check.  Keeps opens that succeed, opens of a missing
+ * file and opens that time out (of a FIFO nobody writes) going against
+ * each zone for a while, printing the leak counters as it goes:
+ *
+ *     node bench/bench-soak.js -z zone[,zone...] [-d seconds] [-c concurrency]
+ *         [-i interval] [-C config]
+ *
+ * -C is a JSON object handed to zfile.configure(), e.g. -C '{"agents": true}'.
+ * Once the run is over and everything in flight has finished it exits 1 if
+ * any fd handed out is still open, a contract was not abandoned, a child was
+ * neither reaped nor waiting to be, or the process holds more fds or
+ * contracts than it did after the first interval.
+ */
+
+var exec = require('child_process').exec;
+var fs = require('fs');
+var zfile = require('../lib/zfile');
+
+var FIFO = '/var/tmp/zfile-soak-fifo';
+var MISSING = '/var/tmp/zfile-soak-missing';
+
+function usage(msg) {
+    if (msg) {
+        console.error(msg);
+    }
+    console.error('usage: bench-soak.js -z zone[,zone...] [-d seconds] ' +
+        '[-c concurrency] [-i interval] [-C config]');
+    process.exit(2);
+}
+
+function parseArgs(argv) {
+    var opts = {
+        zones: null,
+        duration: 600,
+        concurrency: 8,
+        interval: 10,
+        config: {}
+    };
+
+    for (var i = 0; i < argv.length; i += 2) {
+        var val = argv[i + 1];
+        switch (argv[i]) {
+        case '-z':
+            opts.zones = val.split(',');
+            break;
+        case '-d':
+            opts.duration = parseInt(val, 10);
+            break;
+        case '-c':
+            opts.concurrency = parseInt(val, 10);
+            break;
+        case '-i':
+            opts.interval = parseInt(val, 10);
+            break;
+        case '-C':
+            try {
+                opts.config = JSON.parse(val);
+            } catch (e) {
+                usage('-C: ' + e.message);
+            }
+            break;
+        default:
+            usage('unknown option: ' + argv[i]);
+        }
+    }
+
+    if (!opts.zones) {
+        usage('-z is required');
+    }
+    if (isNaN(opts.duration) || opts.duration <= 0 ||
+        isNaN(opts.concurrency) || opts.concurrency <= 0 ||
+        isNaN(opts.interval) || opts.interval <= 0) {
+        usage();
+    }
+    if (opts.duration <= opts.interval) {
+        usage('-d must be longer than -i');
+    }
+
+    return (opts);
+}
+
+function countFds() {
+    return (fs.readdirSync('/proc/self/fd').length);
+}
+
+/*
+ * Process contracts held by this process, per ctstat(1).
+ */
+function countContracts(callback) {
+    exec('ctstat -t process -a', function (err, stdout) {
+        if (err) {
+            return (callback(null, -1));
+        }
+        var n = 0;
+        stdout.split('\n').forEach(function (line) {
+            var f = line.trim().split(/\s+/);
+            if (f[4] === String(process.pid)) {
+                n++;
+            }
+        });
+        return (callback(null, n));
+    });
+}
+
+function inZones(zones, cmd, callback) {
+    var left = zones.length;
+    zones.forEach(function (z) {
+        exec('zlogin ' + z + ' "' + cmd + '"', function (err) {
+            if (err) {
+                console.error('%s: %s', z, err.message);
+                process.exit(1);
+            }
+            if (--left === 0) {
+                callback();
+            }
+        });
+    });
+}
+
+/*
+ * One request of the mix: mostly opens that succeed, with a missing file
+ * every tenth and a timeout every twentieth.
+ */
+function request(n, zone, counts, callback) {
+    var kind = n % 20 === 19 ? 'timeout' : n % 10 === 9 ? 'missing' : 'open';
+    var opts = { zone: zone, path: '/etc/passwd', mode: 'r' };
+
+    if (kind === 'missing') {
+        opts.path = MISSING;
+    } else if (kind === 'timeout') {
+        opts.path = FIFO;
+        opts.timeout = 100;
+    }
+
+    zfile.getZoneFileDescriptor(opts, function (err, fd) {
+        if (!err) {
+            counts.opened++;
+            zfile.closeZoneFileDescriptor(fd, function () { callback(); });
+            return;
+        }
+        if ((kind === 'missing' && err.code === 'ENOENT') ||
+            (kind === 'timeout' && err.code === 'ETIMEDOUT')) {
+            counts[kind]++;
+        } else {
+            counts.unexpected++;
+        }
+        callback();
+    });
+}
+
+function leaks(s) {
+    return ({
+        fdsOpen: s.fds.open,
+        contractsLeaked: s.contracts.leaked,
+        contractsUnreaped: s.contracts.created -
+            s.children.reaped - s.children.orphaned - s.children.lost,
+        childrenLost: s.children.lost
+    });
+}
+
+function main() {
+    var opts = parseArgs(process.argv.slice(2));
+    var counts = { opened: 0, missing: 0, timeout: 0, unexpected: 0 };
+    var issued = 0;
+    var running = 0;
+    var stopping = false;
+    var baseline = null;
+    var start = Date.now();
+
+    zfile.configure(opts.config);
+
+    function worker() {
+        if (stopping) {
+            if (--running === 0) {
+                setTimeout(finish, 1000);
+            }
+            return;
+        }
+        var n = issued++;
+        request(n, opts.zones[n % opts.zones.length], counts, worker);
+    }
+
+    function sample() {
+        var s = zfile.getStats();
+        var l = leaks(s);
+        countContracts(function (_, contracts) {
+            var fds = countFds();
+            if (!baseline) {
+                baseline = { fds: fds, contracts: contracts };
+            }
+            console.log('%ds\topened %d\tmissing %d\ttimeout %d\t' +
+                'unexpected %d\tfds %d (+%d)\tcontracts %d\t' +
+                'fds out %d\tunreaped %d\torphaned %d',
+                Math.round((Date.now() - start) / 1000), counts.opened,
+                counts.missing, counts.timeout, counts.unexpected, fds,
+                fds - baseline.fds, contracts, l.fdsOpen,
+                l.contractsUnreaped, s.children.orphaned);
+        });
+    }
+
+    function finish() {
+        var s = zfile.getStats();
+        var l = leaks(s);
+        clearInterval(timer);
+        countContracts(function (_, contracts) {
+            var failures = [];
+            var fds = countFds();
+            // An agent per zone may have come or gone since the baseline
+            var slack = opts.config.agents ? opts.zones.length : 0;
+
+            Object.keys(l).forEach(function (k) {
+                if (l[k] !== 0) {
+                    failures.push(k + ' ' + l[k]);
+                }
+            });
+            if (counts.unexpected > 0) {
+                failures.push('unexpected errors ' + counts.unexpected);
+            }
+            if (fds - baseline.fds > slack) {
+                failures.push('fds grew by ' + (fds - baseline.fds));
+            }
+            if (contracts >= 0 && baseline.contracts >= 0 &&
+                contracts > baseline.contracts) {
+                failures.push('contracts grew by ' +
+                    (contracts - baseline.contracts));
+            }
+
+            inZones(opts.zones, 'rm -f ' + FIFO, function () {
+                if (failures.length > 0) {
+                    console.error('LEAKED: %s', failures.join(', '));
+                    process.exit(1);
+                }
+                console.log('no leaks after %d requests', issued);
+                process.exit(0);
+            });
+        });
+    }
+
+    var timer = null;
+    inZones(opts.zones, 'rm -f ' + FIFO + ' ' + MISSING + '; mkfifo ' + FIFO,
+        function () {
+            timer = setInterval(sample, opts.interval * 1000);
+            setTimeout(function () {
+                stopping = true;
+            }, opts.duration * 1000);
+            for (var i = 0; i < opts.concurrency; i++) {
+                running++;
+                worker();
+            }
+        });
+}
+
+main();
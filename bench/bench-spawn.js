@@ -0,0 +1,149 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright (c) 2014, Joyent, Inc.
+ */
+
+/*
+ * Compare per-open latency of the fork, forkx and vfork child creation
+ * paths.  Since the cost of fork() grows with the size of the address space,
+ * -H inflates the JS heap first to approximate a long running agent:
+ *
+ *     node bench/bench-spawn.js -z <zone> [-n opens] [-H heap MB] [-p path]
+ */
+
+var fs = require('fs');
+var zfile = require('../lib/zfile');
+
+function usage(msg) {
+    if (msg) {
+        console.error(msg);
+    }
+    console.error('usage: bench-spawn.js -z zone [-n opens] [-H heapMB] ' +
+        '[-p path]');
+    process.exit(2);
+}
+
+function parseArgs(argv) {
+    var opts = { zone: null, count: 1000, heap: 0, path: '/etc/passwd' };
+
+    for (var i = 0; i < argv.length; i++) {
+        var val = argv[i + 1];
+        switch (argv[i]) {
+        case '-z':
+            opts.zone = val;
+            break;
+        case '-n':
+            opts.count = parseInt(val, 10);
+            break;
+        case '-H':
+            opts.heap = parseInt(val, 10);
+            break;
+        case '-p':
+            opts.path = val;
+            break;
+        default:
+            usage('unknown option: ' + argv[i]);
+        }
+        i++;
+    }
+
+    if (!opts.zone) {
+        usage('-z is required');
+    }
+    if (isNaN(opts.count) || opts.count <= 0 || isNaN(opts.heap)) {
+        usage();
+    }
+
+    return (opts);
+}
+
+function percentile(sorted, p) {
+    return (sorted[Math.min(sorted.length - 1,
+        Math.floor(sorted.length * p))]);
+}
+
+function runMode(opts, mode, callback) {
+    var samples = [];
+    var n = 0;
+
+    zfile.configure({ agents: false, spawn: mode });
+
+    function next() {
+        if (n++ === opts.count) {
+            return (callback(null, samples));
+        }
+
+        var start = process.hrtime();
+        zfile.getZoneFileDescriptor(
+            { zone: opts.zone, path: opts.path, mode: 'r' },
+            function (err, fd) {
+                if (err) {
+                    return (callback(err));
+                }
+                var t = process.hrtime(start);
+                samples.push(t[0] * 1e3 + t[1] / 1e6);
+                fs.closeSync(fd);
+                return (next());
+            });
+    }
+
+    next();
+}
+
+function main() {
+    var opts = parseArgs(process.argv.slice(2));
+    var modes = ['fork', 'forkx', 'vfork'];
+    var ballast = [];
+    var results = {};
+
+    while (ballast.length < opts.heap) {
+        var mb = [];
+        for (var j = 0; j < 1024 * 16; j++) {
+            mb.push({ a: j, b: 'x' + j });
+        }
+        ballast.push(mb);
+    }
+
+    console.log('zone %s, %d opens per mode, rss %d MB', opts.zone,
+        opts.count, Math.round(process.memoryUsage().rss / 1048576));
+
+    (function nextMode() {
+        var mode = modes.shift();
+        if (mode === undefined) {
+            return (report());
+        }
+
+        runMode(opts, mode, function (err, samples) {
+            if (err) {
+                console.error('%s: %s', mode, err.message);
+                process.exit(1);
+            }
+            results[mode] = samples.sort(function (a, b) { return (a - b); });
+            nextMode();
+        });
+    })();
+
+    function report() {
+        var base = null;
+        console.log('%s\t%s\t%s\t%s\t%s', 'mode', 'mean', 'p50', 'p99',
+            'vs fork');
+        Object.keys(results).forEach(function (mode) {
+            var s = results[mode];
+            var mean = s.reduce(function (a, b) { return (a + b); }, 0) /
+                s.length;
+            if (base === null) {
+                base = mean;
+            }
+            console.log('%s\t%sms\t%sms\t%sms\t%sx', mode, mean.toFixed(3),
+                percentile(s, 0.5).toFixed(3), percentile(s, 0.99).toFixed(3),
+                (base / mean).toFixed(2));
+        });
+    }
+}
+
+main();
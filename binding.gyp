@@ -2,8 +2,68 @@
   "targets": [
     {
       "target_name": "zfile",
-      "sources": [ "src/zfile.cc" ],
-      "libraries": ["-lpthread", "-lcontract", "-lnsl", "-lsocket"]
+      "conditions": [
+        ["OS=='solaris'", {
+          # zfile.o is built by zfile_objs and linked here alongside the
+          # USDT provider object `dtrace -G` generates from it.
+          "type": "loadable_module",
+          "dependencies": ["zfile_dtrace_provider"],
+          "sources": [],
+          "libraries": [
+            "<(PRODUCT_DIR)/obj.target/zfile_objs/src/zfile.o",
+            "<(SHARED_INTERMEDIATE_DIR)/zfile_provider.o"
+          ]
+        }, {
+          "sources": [ "src/zfile.cc" ]
+        }]
+      ],
+      "libraries": ["-lpthread", "-lcontract", "-lmd", "-lnsl", "-lnvpair",
+                    "-lsendfile", "-lsocket", "-lsysevent"]
     }
+  ],
+  "conditions": [
+    ["OS=='solaris'", {
+      "targets": [
+        {
+          "target_name": "zfile_dtrace_header",
+          "type": "none",
+          "actions": [
+            {
+              "action_name": "zfile_dtrace_header",
+              "inputs": [ "src/zfile_provider.d" ],
+              "outputs": [ "<(SHARED_INTERMEDIATE_DIR)/zfile_provider.h" ],
+              "action": [ "dtrace", "-h", "-xnolibs", "-s", "<@(_inputs)",
+                          "-o", "<@(_outputs)" ]
+            }
+          ]
+        },
+        {
+          "target_name": "zfile_objs",
+          "type": "static_library",
+          "dependencies": ["zfile_dtrace_header"],
+          "sources": [ "src/zfile.cc" ],
+          "cflags": [ "-fPIC" ],
+          "defines": [ "HAVE_DTRACE=1" ],
+          "include_dirs": [ "<(SHARED_INTERMEDIATE_DIR)" ]
+        },
+        {
+          "target_name": "zfile_dtrace_provider",
+          "type": "none",
+          "dependencies": ["zfile_objs"],
+          "actions": [
+            {
+              "action_name": "zfile_dtrace_provider",
+              "inputs": [
+                "src/zfile_provider.d",
+                "<(PRODUCT_DIR)/obj.target/zfile_objs/src/zfile.o"
+              ],
+              "outputs": [ "<(SHARED_INTERMEDIATE_DIR)/zfile_provider.o" ],
+              "action": [ "dtrace", "-G", "-xnolibs", "-s", "<@(_inputs)",
+                          "-o", "<@(_outputs)" ]
+            }
+          ]
+        }
+      ]
+    }]
   ]
 }
@@ -9,32 +9,1098 @@
  */
 
 var bindings = require('../build/Release/zfile');
+var EventEmitter = require('events').EventEmitter;
 var fs = require('fs');
+var stream = require('stream');
+var util = require('util');
 
 var MODES = { 'r': 0, 'w': 1, 'a': 2 };
+var READ_MAX_SIZE = 1024 * 1024;
+var SCAN_MAX_MATCHES = 10000;
+var WRITE_FSYNC = 0x1;
+var COPY_ATOMIC = 0x1;
+var COPY_FSYNC = 0x2;
+var SPAWN_MODES = { 'fork': 0, 'forkx': 1, 'vfork': 2 };
+var QUERY_STAT = 3;
+var QUERY_READDIR = 4;
+var WATCH_MODIFIED = 0x1;
+var WATCH_TRUNC = 0x2;
+var WATCH_GONE = 0x4;
+var FOLLOW_READ_SIZE = 65536;
+var READ_AHEAD_CHUNK = 1024 * 1024;
+var HASHES = { 'sha256': 0, 'xxh64': 1 };
+var ADVICE = { 'normal': 0, 'sequential': 1, 'random': 2, 'willneed': 3 };
+var C = bindings.constants;
+var HINTS = {
+    'sequential': C.HINT_SEQUENTIAL,
+    'willneed': C.HINT_WILLNEED,
+    'directio': C.HINT_DIRECTIO
+};
 
-function getZoneFileDescriptor(opts, callback) {
+var config = {
+    agents: false,
+    agentIdleTimeout: 30000,
+    spawn: 'fork',
+    poolSize: 4,
+    maxQueue: 1024,
+    fdCacheSize: 0,
+    fdCacheTTL: 5000,
+    timeout: 0
+};
+
+/*
+ * Descriptors closed through closeZoneFileDescriptor() or by a stream from
+ * createZoneFileStream(), for getStats()
+ */
+var fdsClosed = 0;
+
+/* Emits zone state changes once watchZones() has been called */
+var zoneEvents = null;
+var zoneWatching = false;
+/* Why configure() last failed to start following zones, for getStats() */
+var zoneWatchError = null;
+
+
+/*
+ * Tune how opens are performed.  With `agents` set, a helper process is kept
+ * running inside each zone (after the first open there) and serves later
+ * opens without forking node again; an agent exits after `agentIdleTimeout`
+ * milliseconds without requests and is transparently respawned on demand.
+ *
+ * `spawn` selects how the per-open child is created when agents are not in
+ * use: 'fork' (the default), 'forkx' (no SIGCHLD is delivered to node and
+ * only an explicit waitpid reaps the child) or 'vfork', which additionally
+ * avoids copying node's address space mappings for single-file opens.
+ *
+ * Opens run on a threadpool of their own, `poolSize` threads wide, taking
+ * turns between zones.  Once `maxQueue` requests are waiting for a thread
+ * (0 for no limit) further requests fail with EAGAIN rather than queueing.
+ *
+ * With `fdCacheSize` above 0, up to that many fds from read-only opens are
+ * kept, least recently used going first, and later reads of the same path
+ * in the same zone are served from them without a fork for `fdCacheTTL`
+ * milliseconds, so long as the file under that path has the same inode,
+ * size and mtime when checked from the global zone.  Paths reached through
+ * a symlink are never cached.
+ *
+ * `timeout`, when not 0, is how many milliseconds a request may take once
+ * it has a thread before it fails with ETIMEDOUT; a child or agent still
+ * working on it in the zone is killed.  Any request can set its own with
+ * `opts.timeout`.
+ *
+ * With agents or the fd cache in use zone state changes are followed, as by
+ * watchZones(), so that neither outlives the zone it was for.
+ *
+ * `trace` (on unless ZFILE_TRACE=0 is in the environment) records forks,
+ * agent starts and exits and zone changes in per-thread rings, for
+ * dumpTrace() to read back.
+ */
+function configure(opts) {
+    if (!opts) throw new TypeError('opts required');
+    if (!(opts instanceof Object)) {
+        throw new TypeError('opts must be an Object');
+    }
+
+    if (opts.agents !== undefined && typeof (opts.agents) !== 'boolean') {
+        throw new TypeError('opts.agents must be a boolean');
+    }
+    if (opts.agentIdleTimeout !== undefined &&
+        (typeof (opts.agentIdleTimeout) !== 'number' ||
+        opts.agentIdleTimeout < 0)) {
+        throw new TypeError('opts.agentIdleTimeout must be a number >= 0');
+    }
+    if (opts.spawn !== undefined &&
+        Object.keys(SPAWN_MODES).indexOf(opts.spawn) === -1) {
+        throw new TypeError('opts.spawn must be "fork", "forkx" or "vfork"');
+    }
+    if (opts.poolSize !== undefined &&
+        (typeof (opts.poolSize) !== 'number' || opts.poolSize < 1)) {
+        throw new TypeError('opts.poolSize must be a number >= 1');
+    }
+    if (opts.maxQueue !== undefined &&
+        (typeof (opts.maxQueue) !== 'number' || opts.maxQueue < 0)) {
+        throw new TypeError('opts.maxQueue must be a number >= 0');
+    }
+    if (opts.fdCacheSize !== undefined &&
+        (typeof (opts.fdCacheSize) !== 'number' || opts.fdCacheSize < 0)) {
+        throw new TypeError('opts.fdCacheSize must be a number >= 0');
+    }
+    if (opts.fdCacheTTL !== undefined &&
+        (typeof (opts.fdCacheTTL) !== 'number' || opts.fdCacheTTL < 0)) {
+        throw new TypeError('opts.fdCacheTTL must be a number >= 0');
+    }
+    if (opts.timeout !== undefined &&
+        (typeof (opts.timeout) !== 'number' || opts.timeout < 0 ||
+        opts.timeout > 0x7fffffff)) {
+        throw new TypeError('opts.timeout must be a number from 0 to 2^31-1');
+    }
+    if (opts.trace !== undefined && typeof (opts.trace) !== 'boolean') {
+        throw new TypeError('opts.trace must be a boolean');
+    }
+
+    Object.keys(opts).forEach(function (k) {
+        if (config.hasOwnProperty(k) && opts[k] !== undefined) {
+            config[k] = opts[k];
+        }
+    });
+
+    bindings.setAgentOptions(config.agents ? 1 : 0, config.agentIdleTimeout);
+    bindings.setSpawnMode(SPAWN_MODES[config.spawn]);
+    bindings.setPoolOptions(config.poolSize, config.maxQueue);
+    bindings.setFdCacheOptions(config.fdCacheSize, config.fdCacheTTL);
+    // The binding has the default, from ZFILE_TRACE, until told otherwise
+    if (opts.trace !== undefined) {
+        bindings.setTraceOptions(opts.trace);
+    }
+    if (config.agents || config.fdCacheSize > 0) {
+        // Stale state is still caught without it, just later, on the next
+        // open, so this needn't fail the whole configure().
+        try {
+            startZoneWatch();
+        } catch (e) {
+            zoneWatchError = e;
+        }
+    }
+}
+
+
+function startZoneWatch() {
+    if (zoneWatching) {
+        return;
+    }
+    bindings.zfileZoneWatch(function (zone, zoneid, state, previous) {
+        if (zoneEvents !== null) {
+            zoneEvents.emit('change', {
+                zone: zone,
+                zoneid: zoneid,
+                state: state,
+                previous: previous
+            });
+        }
+    });
+    zoneWatching = true;
+    zoneWatchError = null;
+}
+
+
+/*
+ * Follow zones booting and halting.  Returns an EventEmitter that emits
+ * 'change' with {zone, zoneid, state, previous} as each zone moves between
+ * states ("ready", "running", "shutting_down", "down" and so on).  A zone
+ * that leaves "running" has its cached zone id, agent and cached fds
+ * dropped right away; one that arrives there has its id cached and, with
+ * agents enabled, an agent started ahead of its first open.  Following
+ * zones does not keep node running.
+ */
+function watchZones() {
+    startZoneWatch();
+    if (zoneEvents === null) {
+        zoneEvents = new EventEmitter();
+    }
+    return (zoneEvents);
+}
+
+
+/*
+ * The bindings return an error, rather than calling back, when a request
+ * could not be queued; deliver it asynchronously like any other.  Those
+ * that can be cancelled return a ticket for zfileCancel() instead, which is
+ * passed back (0 otherwise).
+ */
+function queued(ret, callback) {
+    if (ret instanceof Error) {
+        process.nextTick(function () {
+            callback(ret);
+        });
+        return (0);
+    }
+    return (typeof (ret) === 'number' ? ret : 0);
+}
+
+
+/*
+ * The timeout, in ms, for a request: opts.timeout or the configured one.
+ */
+function timeoutOf(opts) {
+    if (opts.timeout === undefined) {
+        return (config.timeout);
+    }
+    if (typeof (opts.timeout) !== 'number' || opts.timeout < 0 ||
+        opts.timeout > 0x7fffffff) {
+        throw new TypeError('opts.timeout must be a number from 0 to 2^31-1');
+    }
+    return (opts.timeout);
+}
+
+
+/*
+ * The mode ('r', 'w' or 'a') that open(2) flags amount to.
+ */
+function flagsMode(flags) {
+    if ((flags & (C.O_WRONLY | C.O_RDWR)) === 0) {
+        return ('r');
+    }
+    return ((flags & C.O_APPEND) ? 'a' : 'w');
+}
+
+
+/*
+ * Check the options of a single open, returning the native mode, flags,
+ * perms and hints for them.
+ */
+function openOptions(opts) {
     if (!opts) throw new TypeError('opts required');
     if (!(opts instanceof Object)) {
         throw new TypeError('opts must be an Object');
     }
     if (!opts.zone) throw new TypeError('opts.zone required');
     if (!opts.path) throw new TypeError('opts.path required');
+
+    var flags = -1;
+    var mode = opts.mode;
+    if (opts.flags !== undefined) {
+        if (typeof (opts.flags) !== 'number' || opts.flags < 0) {
+            throw new TypeError('opts.flags must be a number');
+        }
+        flags = opts.flags;
+        mode = mode || flagsMode(flags);
+    }
+    if (Object.keys(MODES).indexOf(mode) === -1) {
+        throw new TypeError('mode must be "r", "w", or "a"');
+    }
+
+    var perms = opts.perms === undefined ? 438 : opts.perms;
+    if (typeof (perms) !== 'number' || perms < 0 || perms > 4095) {
+        throw new TypeError('opts.perms must be a number from 0 to 07777');
+    }
+
+    var hints = 0;
+    [].concat(opts.hints || []).forEach(function (h) {
+        if (!HINTS.hasOwnProperty(h)) {
+            throw new TypeError('opts.hints must be some of: ' +
+                Object.keys(HINTS).join(', '));
+        }
+        hints |= HINTS[h];
+    });
+
+    return ({ mode: MODES[mode], flags: flags, perms: perms, hints: hints });
+}
+
+/*
+ * Open a file in a zone.  `opts.mode` is 'r', 'w' or 'a'; or, for full
+ * control, `opts.flags` gives open(2) flags outright, built from
+ * zfile.constants (O_RDWR, O_EXCL, O_DSYNC, O_NOFOLLOW and so on).  A file
+ * that is created gets `opts.perms` (default 0666, less the umask).
+ * `opts.hints`, any of "sequential", "willneed" (both posix_fadvise(3C))
+ * and "directio" (directio(3C)), are applied to the file in the zone before
+ * the fd comes back; they are advice, and ignored where not supported.
+ */
+function getZoneFileDescriptor(opts, callback) {
+    var o = openOptions(opts);
     if (!callback) throw new TypeError('callback required');
     if (!(callback instanceof Function)) {
         throw new TypeError('callback must be a Function');
     }
 
-    if (Object.keys(MODES).indexOf(opts.mode) === -1) {
+    return (queued(bindings.zfile(opts.zone, opts.path, o.mode, callback,
+        timeoutOf(opts), o.flags, o.perms, o.hints), callback));
+}
+
+/*
+ * getZoneFileDescriptor(), but done on the calling thread, returning the fd
+ * or throwing.  This blocks the event loop for the whole open (a fork, when
+ * agents are off), so it is for reading configuration at startup, before
+ * there is anything else for the loop to do.
+ */
+function getZoneFileDescriptorSync(opts) {
+    var o = openOptions(opts);
+
+    return (bindings.zfileSync(opts.zone, opts.path, o.mode,
+        timeoutOf(opts), o.flags, o.perms, o.hints));
+}
+
+
+/*
+ * Open several files in one zone with a single zone entry.  `opts.files` is
+ * an array of `{path, mode}` (mode defaults to 'r').  The callback gets an
+ * error only if the zone itself could not be entered; otherwise it gets an
+ * array, in the same order as `opts.files`, of `{path, mode, fd}` for files
+ * that opened and `{path, mode, error}` for those that did not.
+ */
+function getZoneFileDescriptors(opts, callback) {
+    if (!opts) throw new TypeError('opts required');
+    if (!(opts instanceof Object)) {
+        throw new TypeError('opts must be an Object');
+    }
+    if (!opts.zone) throw new TypeError('opts.zone required');
+    if (!Array.isArray(opts.files)) {
+        throw new TypeError('opts.files must be an Array');
+    }
+    if (!callback) throw new TypeError('callback required');
+    if (!(callback instanceof Function)) {
+        throw new TypeError('callback must be a Function');
+    }
+
+    var files = opts.files.map(function (f) {
+        if (!f || !f.path) throw new TypeError('files[].path required');
+        var mode = f.mode || 'r';
+        if (Object.keys(MODES).indexOf(mode) === -1) {
+            throw new TypeError('mode must be "r", "w", or "a"');
+        }
+        return ({ path: f.path, mode: mode });
+    });
+
+    if (files.length === 0) {
+        process.nextTick(function () {
+            callback(null, []);
+        });
+        return;
+    }
+
+    var native = files.map(function (f) {
+        return ({ path: f.path, mode: MODES[f.mode] });
+    });
+
+    queued(bindings.zfileMany(opts.zone, native, onResults,
+        timeoutOf(opts)), callback);
+
+    function onResults(err, results) {
+        if (err) {
+            return callback(err);
+        }
+
+        return callback(null, results.map(function (r, i) {
+            var res = { path: files[i].path, mode: files[i].mode };
+            if (typeof (r) === 'number') {
+                res.fd = r;
+            } else {
+                res.error = r;
+            }
+            return (res);
+        }));
+    }
+}
+
+
+/*
+ * Open the same file in many zones.  `opts.zones` is an array of zone names,
+ * opened at most `opts.parallelism` (default 16) at a time; agents are used
+ * for zones that have one when they are enabled.  If `opts.onZone` is given
+ * it is called as onZone(err, {zone, fd}) as each zone finishes.  The
+ * callback gets, in the order of `opts.zones`, `{zone, fd}` for zones where
+ * the file opened and `{zone, error}` for the rest.  Every fd returned is
+ * the caller's to close.
+ */
+function getZoneFileDescriptorAcross(opts, callback) {
+    if (!opts) throw new TypeError('opts required');
+    if (!(opts instanceof Object)) {
+        throw new TypeError('opts must be an Object');
+    }
+    if (!Array.isArray(opts.zones)) {
+        throw new TypeError('opts.zones must be an Array');
+    }
+    if (!opts.path) throw new TypeError('opts.path required');
+    if (!callback) throw new TypeError('callback required');
+    if (!(callback instanceof Function)) {
+        throw new TypeError('callback must be a Function');
+    }
+    if (opts.onZone !== undefined && !(opts.onZone instanceof Function)) {
+        throw new TypeError('opts.onZone must be a Function');
+    }
+    var mode = opts.mode || 'r';
+    if (Object.keys(MODES).indexOf(mode) === -1) {
         throw new TypeError('mode must be "r", "w", or "a"');
     }
+    var parallelism = opts.parallelism === undefined ? 16 : opts.parallelism;
+    if (typeof (parallelism) !== 'number' || parallelism < 1) {
+        throw new TypeError('opts.parallelism must be a number >= 1');
+    }
+
+    var zones = opts.zones.slice();
+    zones.forEach(function (z) {
+        if (typeof (z) !== 'string' || !z) {
+            throw new TypeError('opts.zones must be zone names');
+        }
+    });
+
+    if (zones.length === 0) {
+        process.nextTick(function () {
+            callback(null, []);
+        });
+        return;
+    }
+
+    function result(i, r) {
+        if (typeof (r) === 'number') {
+            return ({ zone: zones[i], fd: r });
+        }
+        return ({ zone: zones[i], error: r });
+    }
+
+    var each = null;
+    if (opts.onZone) {
+        each = function (i, err, fd) {
+            opts.onZone(err || null, result(i, err || fd));
+        };
+    }
+
+    queued(bindings.zfileAcross(zones, opts.path, MODES[mode], parallelism,
+        each, function (err, results) {
+            if (err) {
+                return callback(err);
+            }
+            return callback(null, results.map(function (r, i) {
+                return (result(i, r));
+            }));
+        }, timeoutOf(opts)), callback);
+}
+
+
+/*
+ * Read the whole of a file in a zone into a Buffer.  The open, read and
+ * close all happen in one trip to the threadpool, which for small files is
+ * much cheaper than a stream.  Files over `opts.maxSize` bytes (default
+ * 1MB) fail with EFBIG.
+ */
+function readZoneFile(opts, callback) {
+    if (!opts) throw new TypeError('opts required');
+    if (!(opts instanceof Object)) {
+        throw new TypeError('opts must be an Object');
+    }
+    if (!opts.zone) throw new TypeError('opts.zone required');
+    if (!opts.path) throw new TypeError('opts.path required');
+    if (!callback) throw new TypeError('callback required');
+    if (!(callback instanceof Function)) {
+        throw new TypeError('callback must be a Function');
+    }
+    var max = opts.maxSize === undefined ? READ_MAX_SIZE : opts.maxSize;
+    if (typeof (max) !== 'number' || max < 0 || max > 0x7fffffff) {
+        throw new TypeError('opts.maxSize must be a number from 0 to 2^31-1');
+    }
+
+    return (queued(bindings.zfileRead(opts.zone, opts.path, max, callback,
+        timeoutOf(opts)), callback));
+}
+
+/*
+ * readZoneFile(), but on the calling thread, returning the Buffer or
+ * throwing.  For startup only, like getZoneFileDescriptorSync().
+ */
+function readZoneFileSync(opts) {
+    if (!opts) throw new TypeError('opts required');
+    if (!(opts instanceof Object)) {
+        throw new TypeError('opts must be an Object');
+    }
+    if (!opts.zone) throw new TypeError('opts.zone required');
+    if (!opts.path) throw new TypeError('opts.path required');
+    var max = opts.maxSize === undefined ? READ_MAX_SIZE : opts.maxSize;
+    if (typeof (max) !== 'number' || max < 0 || max > 0x7fffffff) {
+        throw new TypeError('opts.maxSize must be a number from 0 to 2^31-1');
+    }
+
+    return (bindings.zfileReadSync(opts.zone, opts.path, max,
+        timeoutOf(opts)));
+}
+
+
+/*
+ * Run an in-zone query for statZoneFile() or readZoneDir(), passing a
+ * successful result through map, if given, on its way to callback.
+ */
+function queryZone(op, opts, callback, map) {
+    if (!opts) throw new TypeError('opts required');
+    if (!(opts instanceof Object)) {
+        throw new TypeError('opts must be an Object');
+    }
+    if (!opts.zone) throw new TypeError('opts.zone required');
+    if (!opts.path) throw new TypeError('opts.path required');
+    if (!callback) throw new TypeError('callback required');
+    if (!(callback instanceof Function)) {
+        throw new TypeError('callback must be a Function');
+    }
+
+    var done = !map ? callback : function (err, res) {
+        if (err) {
+            return (callback(err));
+        }
+        return (callback(null, map(res)));
+    };
+
+    return (queued(bindings.zfileQuery(opts.zone, opts.path, op, done,
+        timeoutOf(opts)), callback));
+}
+
+
+/*
+ * lstat(2) a path in a zone, without opening it.  The path is resolved in
+ * the zone, exactly as for an open, and a final symlink is reported rather
+ * than followed.  The callback gets an fs.Stats.
+ */
+function statZoneFile(opts, callback) {
+    return (queryZone(QUERY_STAT, opts, callback, function (st) {
+        var stats = Object.create(fs.Stats.prototype);
+        Object.keys(st).forEach(function (k) {
+            stats[k] = st[k];
+        });
+        return (stats);
+    }));
+}
+
+
+/*
+ * List the names in a directory in a zone (without "." and ".."), as
+ * fs.readdir() would.
+ */
+function readZoneDir(opts, callback) {
+    return (queryZone(QUERY_READDIR, opts, callback));
+}
+
+
+/*
+ * Map a regular file in a zone read-only, and call back with a Buffer over
+ * the mapping that is unmapped when the Buffer is collected.  Nothing is
+ * copied, so this suits large files that are read in place; `opts.advice`
+ * ("normal", "sequential", "random" or "willneed") is passed on to
+ * madvise(3C).  The mapping is shared with the file, so a file that is
+ * truncated while mapped will fault with SIGBUS when the lost pages are
+ * touched: only map files that are replaced, not rewritten, in place.
+ */
+function mmapZoneFile(opts, callback) {
+    if (!opts) throw new TypeError('opts required');
+    if (!(opts instanceof Object)) {
+        throw new TypeError('opts must be an Object');
+    }
+    if (!opts.zone) throw new TypeError('opts.zone required');
+    if (!opts.path) throw new TypeError('opts.path required');
+    if (!callback) throw new TypeError('callback required');
+    if (!(callback instanceof Function)) {
+        throw new TypeError('callback must be a Function');
+    }
+    var advice = opts.advice || 'normal';
+    if (!ADVICE.hasOwnProperty(advice)) {
+        throw new TypeError('opts.advice must be one of: ' +
+            Object.keys(ADVICE).join(', '));
+    }
+
+    queued(bindings.zfileMmap(opts.zone, opts.path, ADVICE[advice],
+        callback, timeoutOf(opts)), callback);
+}
+
+
+/*
+ * Hash the contents of a file in a zone on the threadpool, with `algo`
+ * either "sha256" or the much cheaper, but not cryptographic, "xxh64".  The
+ * callback gets {digest, size, mtime}: the digest in hex, the number of
+ * bytes hashed and the file's mtime as a Date.  Only a regular file can be
+ * hashed, and `opts.timeout` covers the reading as well as the open.
+ */
+function hashZoneFile(opts, algo, callback) {
+    if (!opts) throw new TypeError('opts required');
+    if (!(opts instanceof Object)) {
+        throw new TypeError('opts must be an Object');
+    }
+    if (!opts.zone) throw new TypeError('opts.zone required');
+    if (!opts.path) throw new TypeError('opts.path required');
+    if (!HASHES.hasOwnProperty(algo)) {
+        throw new TypeError('algo must be one of: ' +
+            Object.keys(HASHES).join(', '));
+    }
+    if (!callback) throw new TypeError('callback required');
+    if (!(callback instanceof Function)) {
+        throw new TypeError('callback must be a Function');
+    }
+
+    queued(bindings.zfileHash(opts.zone, opts.path, HASHES[algo], callback,
+        timeoutOf(opts)), callback);
+}
+
+
+/*
+ * Find the lines of a file in a zone that contain any of `needles`, an
+ * array of up to 64 fixed strings (not patterns).  The file is read and
+ * searched on the threadpool, so only the matching lines reach JS: the
+ * callback gets an array of {offset, line} objects in file order, or with
+ * `opts.offsets` just the byte offsets at which the lines start.  At most
+ * `opts.maxMatches` (default 10000) lines are returned, and the third
+ * argument to the callback is true if the search stopped there.  Lines
+ * over 1MB are searched in 1MB pieces.  Only a regular file can be searched,
+ * and `opts.timeout` covers the search as well as the open.
+ */
+function scanZoneFile(opts, needles, callback) {
+    if (!opts) throw new TypeError('opts required');
+    if (!(opts instanceof Object)) {
+        throw new TypeError('opts must be an Object');
+    }
+    if (!opts.zone) throw new TypeError('opts.zone required');
+    if (!opts.path) throw new TypeError('opts.path required');
+    if (typeof (needles) === 'string') {
+        needles = [needles];
+    }
+    if (!Array.isArray(needles) || needles.length === 0 ||
+        needles.length > 64) {
+        throw new TypeError('needles must be an array of 1 to 64 strings');
+    }
+    needles.forEach(function (n) {
+        if (typeof (n) !== 'string' || n.length === 0 ||
+            n.indexOf('\n') !== -1) {
+            throw new TypeError('needles must be non-empty strings ' +
+                'without newlines');
+        }
+    });
+    if (!callback) throw new TypeError('callback required');
+    if (!(callback instanceof Function)) {
+        throw new TypeError('callback must be a Function');
+    }
+    var max = opts.maxMatches === undefined ? SCAN_MAX_MATCHES :
+        opts.maxMatches;
+    if (typeof (max) !== 'number' || max < 1 || max > 0x7fffffff) {
+        throw new TypeError('opts.maxMatches must be a number from 1 to ' +
+            '2^31-1');
+    }
+
+    queued(bindings.zfileScan(opts.zone, opts.path, needles, max,
+        opts.offsets ? 0 : 1, callback, timeoutOf(opts)), callback);
+}
+
+
+/*
+ * Replace a file in a zone with `data` (a Buffer or string) so that readers
+ * only ever see the old or the new contents: the data is written to a
+ * temporary file next to `opts.path` that is then renamed over it, all in
+ * one request to the zone.  An existing file's owner and mode are kept.
+ * With `opts.fsync` the data and the rename are on disk before the callback
+ * is called.
+ */
+function writeZoneFileAtomic(opts, data, callback) {
+    if (!opts) throw new TypeError('opts required');
+    if (!(opts instanceof Object)) {
+        throw new TypeError('opts must be an Object');
+    }
+    if (!opts.zone) throw new TypeError('opts.zone required');
+    if (!opts.path) throw new TypeError('opts.path required');
+    if (typeof (data) === 'string') {
+        data = new Buffer(data);
+    }
+    if (!Buffer.isBuffer(data)) {
+        throw new TypeError('data must be a Buffer or string');
+    }
+    if (!callback) throw new TypeError('callback required');
+    if (!(callback instanceof Function)) {
+        throw new TypeError('callback must be a Function');
+    }
+
+    queued(bindings.zfileWrite(opts.zone, opts.path, data,
+        opts.fsync ? WRITE_FSYNC : 0, callback, timeoutOf(opts)), callback);
+}
+
+
+/*
+ * Copy a file to another, with either end in a zone or, when its `zone` is
+ * left out, in the global zone: `opts.from` and `opts.to` are each {zone,
+ * path}.  Both files are opened natively and the data moved on the
+ * threadpool with sendfile(3EXT), never passing through JS.  The target
+ * takes the source's permissions, less setuid, setgid and sticky, if it's
+ * created, and keeps its own owner and permissions otherwise.  With
+ * `opts.atomic` the data goes to a temporary file next to the target that
+ * is then renamed over it, and with `opts.fsync` it is on disk before the
+ * callback, which gets {bytes}.  `opts.timeout` applies to each trip into a
+ * zone, and again to the copy itself.  The source must be a regular file.
+ */
+function copyZoneFile(opts, callback) {
+    if (!opts) throw new TypeError('opts required');
+    if (!(opts instanceof Object)) {
+        throw new TypeError('opts must be an Object');
+    }
+    ['from', 'to'].forEach(function (k) {
+        if (!(opts[k] instanceof Object)) {
+            throw new TypeError('opts.' + k + ' must be an Object');
+        }
+        if (!opts[k].path) throw new TypeError('opts.' + k + '.path required');
+        if (opts[k].zone !== undefined && typeof (opts[k].zone) !== 'string') {
+            throw new TypeError('opts.' + k + '.zone must be a string');
+        }
+    });
+    if (!callback) throw new TypeError('callback required');
+    if (!(callback instanceof Function)) {
+        throw new TypeError('callback must be a Function');
+    }
+
+    var flags = (opts.atomic ? COPY_ATOMIC : 0) | (opts.fsync ? COPY_FSYNC : 0);
+
+    queued(bindings.zfileCopy(opts.from.zone || '', opts.from.path,
+        opts.to.zone || '', opts.to.path, flags, callback, timeoutOf(opts)),
+        callback);
+}
+
+
+/*
+ * Emits 'data' with each Buffer appended to a file in a zone, see
+ * followZoneFile().
+ */
+function ZoneFileFollower(opts) {
+    EventEmitter.call(this);
+
+    this.zone = opts.zone;
+    this.path = opts.path;
+    this.fd = -1;
+    this.offset = 0;
+    this.closed = false;
+
+    this._watch = null;
+    this._timer = null;
+    this._reading = false;
+    this._again = false;
+    this._gone = false;
+    this._reopenInterval = opts.reopenInterval || 1000;
+
+    this._open(!opts.fromStart);
+}
+util.inherits(ZoneFileFollower, EventEmitter);
+
+/*
+ * Open the file through the zone and start watching the fd.  When the file
+ * has been rotated away, the new one may not exist yet, so ENOENT is
+ * retried every reopenInterval ms.
+ */
+ZoneFileFollower.prototype._open = function _open(atEnd, rotated) {
+    var self = this;
+
+    getZoneFileDescriptor({ zone: self.zone, path: self.path, mode: 'r' },
+        function (err, fd) {
+            if (self.closed) {
+                if (!err) {
+                    closeZoneFileDescriptor(fd);
+                }
+                return;
+            }
+            if (err) {
+                if (rotated && err.code === 'ENOENT') {
+                    self._timer = setTimeout(function () {
+                        self._timer = null;
+                        self._open(false, true);
+                    }, self._reopenInterval);
+                    return;
+                }
+                self.emit('error', err);
+                return;
+            }
+
+            var st;
+            try {
+                st = fs.fstatSync(fd);
+                self._watch = bindings.zfileWatch(fd, function (events) {
+                    self._onEvents(events);
+                });
+            } catch (e) {
+                closeZoneFileDescriptor(fd);
+                self.emit('error', e);
+                return;
+            }
+
+            self.fd = fd;
+            self.offset = atEnd ? st.size : 0;
+            self._gone = false;
+            self.emit(rotated ? 'rotate' : 'open', fd);
+            self._read();
+        });
+};
+
+ZoneFileFollower.prototype._onEvents = function _onEvents(events) {
+    if (events & WATCH_GONE) {
+        this._gone = true;
+    }
+    if (events & (WATCH_MODIFIED | WATCH_TRUNC | WATCH_GONE)) {
+        this._read();
+    }
+};
+
+/*
+ * Read from the last offset to EOF, emitting what was appended.  Events
+ * that arrive mid-read just cause another pass once this one is done.  A
+ * file now shorter than the offset was truncated, and is read from the
+ * start again.  Once the file is gone from its name, what's left of it is
+ * drained and the path opened afresh.
+ */
+ZoneFileFollower.prototype._read = function _read() {
+    var self = this;
+
+    if (self._reading) {
+        self._again = true;
+        return;
+    }
+    self._reading = true;
+    self._again = false;
+
+    try {
+        if (fs.fstatSync(self.fd).size < self.offset) {
+            self.offset = 0;
+            self.emit('truncate');
+        }
+    } catch (e) {
+        self._reading = false;
+        self.emit('error', e);
+        return;
+    }
+
+    (function next() {
+        var buf = new Buffer(FOLLOW_READ_SIZE);
+        fs.read(self.fd, buf, 0, buf.length, self.offset, function (err, n) {
+            if (self.closed) {
+                return;
+            }
+            if (err) {
+                self._reading = false;
+                self.emit('error', err);
+                return;
+            }
+            if (n > 0) {
+                self.offset += n;
+                self.emit('data', buf.slice(0, n));
+                next();
+                return;
+            }
+
+            self._reading = false;
+            if (self._gone) {
+                self._close();
+                self._open(false, true);
+            } else if (self._again) {
+                self._read();
+            }
+        });
+    })();
+};
+
+ZoneFileFollower.prototype._close = function _close() {
+    if (this._watch !== null) {
+        bindings.zfileUnwatch(this._watch);
+        this._watch = null;
+    }
+    if (this.fd >= 0) {
+        closeZoneFileDescriptor(this.fd);
+        this.fd = -1;
+    }
+};
+
+/*
+ * Stop following, and close the file.
+ */
+ZoneFileFollower.prototype.close = function close() {
+    if (this.closed) {
+        return;
+    }
+    this.closed = true;
+    if (this._timer !== null) {
+        clearTimeout(this._timer);
+        this._timer = null;
+    }
+    this._close();
+    this.emit('close');
+};
+
+
+/*
+ * Follow a file in a zone as it's appended to, like tail -F.  The file is
+ * opened once through the zone and its fd watched with an event port, so
+ * new data is emitted as 'data' Buffers within moments of being written,
+ * without polling or forking again.  Reading starts at the end of the file
+ * unless `opts.fromStart` is set.  When the file is renamed or removed (as
+ * by log rotation) the rest of it is read, then the path is opened again,
+ * retrying every `opts.reopenInterval` ms (default 1000) until it exists,
+ * and 'rotate' emitted.  'truncate' is emitted when the file shrinks, after
+ * which it is read from the start.  Call close() to stop.
+ */
+function followZoneFile(opts) {
+    if (!opts) throw new TypeError('opts required');
+    if (!(opts instanceof Object)) {
+        throw new TypeError('opts must be an Object');
+    }
+    if (!opts.zone) throw new TypeError('opts.zone required');
+    if (!opts.path) throw new TypeError('opts.path required');
+    if (opts.reopenInterval !== undefined &&
+        (typeof (opts.reopenInterval) !== 'number' ||
+        opts.reopenInterval <= 0)) {
+        throw new TypeError('opts.reopenInterval must be a positive number');
+    }
 
-    bindings.zfile(opts.zone, opts.path, MODES[opts.mode], callback);
+    return (new ZoneFileFollower(opts));
 }
 
 
+/*
+ * A Readable over fd, an open zone file, that keeps `opts.readAhead`
+ * (default 4) preads of `opts.chunkSize` bytes (default 1MB) in flight on
+ * the zfile pool, queued with `opts.zone`'s requests.  Chunks are pushed in
+ * file order.  No more reads are issued while the consumer is behind, so at
+ * most readAhead chunks are held beyond the stream's own buffer.  Chunks are
+ * slices of a Buffer allocated once per readAhead chunks; they are never
+ * reused, as a consumer may keep them.  Reads go from `opts.start` (default
+ * 0) to `opts.end` inclusive (default the end of file), and fd is closed at
+ * the end unless `opts.autoClose` is false.
+ */
+function ZoneFileReadStream(fd, opts) {
+    opts = opts || {};
+    var window = opts.readAhead === undefined ? 4 : opts.readAhead;
+    var chunk = opts.chunkSize === undefined ? READ_AHEAD_CHUNK :
+        opts.chunkSize;
+    if (typeof (window) !== 'number' || window < 1) {
+        throw new TypeError('opts.readAhead must be a number >= 1');
+    }
+    if (typeof (chunk) !== 'number' || chunk < 1 || chunk > 0x3fffffff) {
+        throw new TypeError('opts.chunkSize must be a number from 1 to ' +
+            '2^30-1');
+    }
+
+    stream.Readable.call(this, { highWaterMark: chunk });
+
+    this.fd = fd;
+    this.zone = opts.zone || '';
+    this.autoClose = opts.autoClose !== false;
+    this._window = window;
+    this._chunk = chunk;
+    this._pos = opts.start || 0;
+    this._end = opts.end === undefined ? Infinity : opts.end + 1;
+    this._issued = 0;
+    this._pushed = 0;
+    this._results = {};
+    this._inflight = 0;
+    this._wanted = false;
+    this._ended = false;
+    this._closed = false;
+    this._slab = null;
+    this._slabUsed = 0;
+}
+util.inherits(ZoneFileReadStream, stream.Readable);
+
+ZoneFileReadStream.prototype._read = function _read() {
+    this._wanted = true;
+    this._fill();
+};
+
+/*
+ * The next len bytes of the current slab, starting a new one when it's
+ * used up.
+ */
+ZoneFileReadStream.prototype._take = function _take(len) {
+    if (this._slab === null || this._slabUsed + len > this._slab.length) {
+        this._slab = new Buffer(this._chunk * this._window);
+        this._slabUsed = 0;
+    }
+    var buf = this._slab.slice(this._slabUsed, this._slabUsed + len);
+    this._slabUsed += len;
+    return (buf);
+};
+
+ZoneFileReadStream.prototype._fill = function _fill() {
+    var self = this;
+
+    while (this._wanted && !this._ended && this._pos < this._end &&
+        this._inflight < this._window) {
+        var seq = this._issued++;
+        var len = Math.min(this._chunk, this._end - this._pos);
+        var buf = this._take(len);
+        var done = onread.bind(null, seq, buf, len);
+        var err = bindings.zfilePread(this.zone, this.fd, buf, len,
+            this._pos, done);
+
+        this._pos += len;
+        this._inflight++;
+        if (err) {
+            process.nextTick(done.bind(null, err));
+        }
+    }
+
+    function onread(seq, buf, len, err, n) {
+        self._inflight--;
+        self._results[seq] = { err: err, buf: buf, len: len, n: n };
+        self._deliver();
+        self._fill();
+    }
+};
+
+/*
+ * Push what's come back, in order, stopping at an error or end of file.
+ */
+ZoneFileReadStream.prototype._deliver = function _deliver() {
+    while (this._results.hasOwnProperty(this._pushed)) {
+        var r = this._results[this._pushed];
+        delete this._results[this._pushed];
+        this._pushed++;
+        if (this._ended) {
+            continue;
+        }
+        if (r.err) {
+            this._ended = true;
+            this.emit('error', r.err);
+            continue;
+        }
+        if (r.n > 0 && !this.push(r.buf.slice(0, r.n))) {
+            this._wanted = false;
+        }
+        if (r.n < r.len) {
+            this._ended = true;
+            this.push(null);
+        }
+    }
+
+    if (!this._ended && this._pos >= this._end &&
+        this._pushed === this._issued) {
+        this._ended = true;
+        this.push(null);
+    }
+    if (this._ended) {
+        this._close();
+    }
+};
+
+/*
+ * Close fd once nothing is still reading from it.
+ */
+ZoneFileReadStream.prototype._close = function _close() {
+    var self = this;
+
+    if (this._closed || this._inflight > 0 || !this.autoClose) {
+        return;
+    }
+    this._closed = true;
+    closeZoneFileDescriptor(this.fd, function (err) {
+        if (err) {
+            self.emit('error', err);
+            return;
+        }
+        self.emit('close');
+    });
+};
+
+/*
+ * Stop reading, and close fd as soon as outstanding reads finish.
+ */
+ZoneFileReadStream.prototype.destroy = function destroy() {
+    this._ended = true;
+    this._close();
+};
+
+
+/*
+ * An fs stream closes its fd through fs, so count it as closed by hand
+ * once the stream reports having done that.
+ */
+function countClose(s) {
+    s.once('close', function () {
+        fdsClosed++;
+    });
+    return (s);
+}
+
+
+/*
+ * Open a file in a zone as a stream.  With a mode of 'r' and
+ * `opts.readAhead` set the stream is a ZoneFileReadStream, otherwise a
+ * plain fs stream over the fd.
+ */
 function createZoneFileStream(opts, callback) {
-    var mode = opts.mode || 'r';
+    var mode = opts.mode ||
+        (opts.flags !== undefined ? flagsMode(opts.flags) : 'r');
     if (Object.keys(MODES).indexOf(mode) === -1) {
         throw new TypeError('mode must be "r", "w", or "a"');
     }
@@ -46,19 +1112,206 @@ function createZoneFileStream(opts, callback) {
             return callback(err);
         }
 
-        var stream;
+        var s;
 
-        if (mode === 'r') {
-            stream = fs.createReadStream(null, { fd: fd });
+        if (mode === 'r' && opts.readAhead !== undefined) {
+            try {
+                s = new ZoneFileReadStream(fd, opts);
+            } catch (e) {
+                closeZoneFileDescriptor(fd);
+                return callback(e);
+            }
+        } else if (mode === 'r') {
+            s = countClose(fs.createReadStream(null, { fd: fd }));
         } else if (mode === 'w' || mode === 'a') {
-            stream = fs.createWriteStream(null, { fd: fd });
+            s = countClose(fs.createWriteStream(null, { fd: fd }));
+        }
+
+        return callback(null, s);
+    });
+}
+
+/*
+ * Close an fd zfile handed out, counting it towards getStats().fds.closed,
+ * so that fds.open is how many are still out.
+ */
+function closeZoneFileDescriptor(fd, callback) {
+    if (typeof (fd) !== 'number') {
+        throw new TypeError('fd must be a number');
+    }
+    fs.close(fd, function (err) {
+        if (!err) {
+            fdsClosed++;
+        }
+        if (callback) {
+            callback(err);
+        }
+    });
+}
+
+/*
+ * Counters describing the opens performed by this process: how many ran,
+ * failures by the syscall that failed, and latency percentiles (in
+ * nanoseconds) for each phase of an open.  The contracts, children and fds
+ * counts are since load, for spotting leaks.  zoneWatch says whether zone
+ * state changes are being followed, and if configure() failed to start
+ * following them, why.
+ */
+function getStats() {
+    var stats = bindings.getStats();
+
+    stats.fds.closed = fdsClosed;
+    stats.fds.open = stats.fds.handedOut - fdsClosed;
+    stats.zoneWatch = {
+        active: zoneWatching,
+        error: zoneWatchError !== null ? zoneWatchError.message : null
+    };
+    return (stats);
+}
+
+/*
+ * Start the counters returned by getStats() over.
+ */
+function resetStats() {
+    bindings.resetStats();
+}
+
+/*
+ * The most recent trace records of every thread, oldest first: objects of
+ * { time, thread, event, zoneid, pid, errno, arg }, with -1 for anything
+ * an event doesn't have.
+ */
+function dumpTrace() {
+    return (bindings.zfileTrace());
+}
+
+/*
+ * Promise-returning forms of the single-file calls, for where there is a
+ * Promise to return: node 0.10 has none, so set promises.Promise to that of
+ * a library there.  Each takes opts.signal, an AbortSignal or anything with
+ * an `aborted` flag that emits 'abort' through addEventListener() or on().
+ *
+ * Aborting rejects the promise with an AbortError straight away.  A request
+ * still queued is dropped without running; one already under way finishes,
+ * and the fd or data it produced is released natively rather than handed
+ * back to JS.
+ */
+var promises = {
+    Promise: global.Promise
+};
+
+function abortError() {
+    var err = new Error('The operation was aborted');
+    err.name = 'AbortError';
+    err.code = 'ABORT_ERR';
+    return (err);
+}
+
+function listenAbort(signal, fn, listen) {
+    if (!signal) {
+        return;
+    }
+    if (typeof (signal.addEventListener) === 'function') {
+        if (listen) {
+            signal.addEventListener('abort', fn);
+        } else {
+            signal.removeEventListener('abort', fn);
+        }
+    } else if (typeof (signal.on) === 'function') {
+        if (listen) {
+            signal.on('abort', fn);
+        } else {
+            signal.removeListener('abort', fn);
+        }
+    }
+}
+
+function abortable(fn) {
+    return (function (opts) {
+        var P = promises.Promise;
+        if (typeof (P) !== 'function') {
+            throw new Error('no Promise: set zfile.promises.Promise');
         }
+        var signal = opts ? opts.signal : undefined;
+        if (signal !== undefined && signal !== null &&
+            (typeof (signal) !== 'object' ||
+            typeof (signal.aborted) !== 'boolean')) {
+            throw new TypeError('opts.signal must be an AbortSignal');
+        }
+
+        return (new P(function (resolve, reject) {
+            var settled = false;
+            var ticket = 0;
 
-        return callback(null, stream);
+            if (signal && signal.aborted) {
+                reject(abortError());
+                return;
+            }
+
+            function onabort() {
+                if (settled) {
+                    return;
+                }
+                settled = true;
+                listenAbort(signal, onabort, false);
+                if (ticket !== 0) {
+                    bindings.zfileCancel(ticket);
+                }
+                reject(abortError());
+            }
+
+            ticket = fn(opts, function (err, res) {
+                /*
+                 * An abort that came too late for zfileCancel() to catch
+                 * the request still leaves us holding its fd.
+                 */
+                if (settled) {
+                    if (!err && typeof (res) === 'number') {
+                        closeZoneFileDescriptor(res);
+                    }
+                    return;
+                }
+                settled = true;
+                listenAbort(signal, onabort, false);
+                if (err) {
+                    reject(err);
+                } else {
+                    resolve(res);
+                }
+            });
+            listenAbort(signal, onabort, true);
+        }));
     });
 }
 
+promises.getZoneFileDescriptor = abortable(getZoneFileDescriptor);
+promises.readZoneFile = abortable(readZoneFile);
+promises.readZoneDir = abortable(readZoneDir);
+promises.statZoneFile = abortable(statZoneFile);
+
 module.exports = {
+    closeZoneFileDescriptor: closeZoneFileDescriptor,
+    configure: configure,
+    copyZoneFile: copyZoneFile,
+    dumpTrace: dumpTrace,
+    getStats: getStats,
+    resetStats: resetStats,
     createZoneFileStream: createZoneFileStream,
-    getZoneFileDescriptor: getZoneFileDescriptor
+    getZoneFileDescriptor: getZoneFileDescriptor,
+    getZoneFileDescriptors: getZoneFileDescriptors,
+    getZoneFileDescriptorAcross: getZoneFileDescriptorAcross,
+    getZoneFileDescriptorSync: getZoneFileDescriptorSync,
+    followZoneFile: followZoneFile,
+    hashZoneFile: hashZoneFile,
+    mmapZoneFile: mmapZoneFile,
+    readZoneDir: readZoneDir,
+    readZoneFile: readZoneFile,
+    readZoneFileSync: readZoneFileSync,
+    scanZoneFile: scanZoneFile,
+    statZoneFile: statZoneFile,
+    watchZones: watchZones,
+    writeZoneFileAtomic: writeZoneFileAtomic,
+    ZoneFileReadStream: ZoneFileReadStream,
+    constants: C,
+    promises: promises
 };
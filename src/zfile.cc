@@ -8,20 +8,33 @@
  * Copyright (c) 2014, Joyent, Inc.
  */
 
-#include <alloca.h>
+#include <atomic.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <libcontract.h>
+#include <libnvpair.h>
+#include <libsysevent.h>
 #include <libzonecfg.h>
+#include <poll.h>
+#include <port.h>
 #include <pthread.h>
+#include <signal.h>
+#include <sha2.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/contract/process.h>
 #include <sys/ctfs.h>
 #include <sys/fork.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
@@ -30,15 +43,610 @@
 #include <exception>
 
 #include <node.h>
+#include <node_buffer.h>
 #include <v8.h>
 
+/*
+ * USDT probes (see zfile_provider.d).  Arguments are only evaluated once the
+ * corresponding *_ENABLED() check passes, so disabled probes cost a branch.
+ */
+#ifdef HAVE_DTRACE
+#include "zfile_provider.h"
+#else
+#define ZFILE_REQUEST_QUEUED(zone, path, mode)
+#define ZFILE_REQUEST_QUEUED_ENABLED() (0)
+#define ZFILE_REQUEST_START(zone, path, mode)
+#define ZFILE_REQUEST_START_ENABLED() (0)
+#define ZFILE_LOCK_ACQUIRED(zoneid, pid)
+#define ZFILE_LOCK_ACQUIRED_ENABLED() (0)
+#define ZFILE_FORK_DONE(zoneid, pid, err)
+#define ZFILE_FORK_DONE_ENABLED() (0)
+#define ZFILE_ZONE_ENTER_DONE(zoneid, pid, err)
+#define ZFILE_ZONE_ENTER_DONE_ENABLED() (0)
+#define ZFILE_CHILD_OPEN_DONE(path, mode, pid, err)
+#define ZFILE_CHILD_OPEN_DONE_ENABLED() (0)
+#define ZFILE_FD_RECEIVED(path, fd, err)
+#define ZFILE_FD_RECEIVED_ENABLED() (0)
+#define ZFILE_CALLBACK_FIRED(zone, path, fd, err)
+#define ZFILE_CALLBACK_FIRED_ENABLED() (0)
+#endif
+
+/* dtrace -h declares string arguments as plain char * */
+#define PROBE_STR(s) const_cast<char *>((s) != NULL ? (s) : "")
+
 #define MODE_R 0
 #define MODE_W 1
 #define MODE_A 2
 
-static const int BUF_SZ = 27;
-static const char *PREFIX = "%s GMT T(%d) %s: ";
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * The open(2) flags a caller may ask for outright, the permissions a file
+ * created without any given gets, and what may be done to a freshly opened
+ * fd before it's handed back (see open_hint()).
+ */
+#define ZFILE_OPEN_FLAGS (O_ACCMODE | O_CREAT | O_EXCL | O_TRUNC | O_APPEND | \
+    O_NONBLOCK | O_DSYNC | O_SYNC | O_RSYNC | O_NOFOLLOW | O_NOCTTY)
+#define ZFILE_PERMS 0666
+#define ZFILE_HINT_SEQUENTIAL 0x1
+#define ZFILE_HINT_WILLNEED 0x2
+#define ZFILE_HINT_DIRECTIO 0x4
+#define ZFILE_HINTS 0x7
+
+/* How zfile() creates its one-shot child; agents are always fork()ed */
+#define ZFILE_SPAWN_FORK 0
+#define ZFILE_SPAWN_FORKX 1
+#define ZFILE_SPAWN_VFORK 2
+/* Highest fd a one-shot child closes when RLIMIT_NOFILE is higher still */
+#define ZFILE_CHILD_FD_MAX 65536
+
+/*
+ * The call a failure is attributed to, as the syscall of the ErrnoException
+ * handed to JS.  Indexes zfile_syscalls.
+ */
+#define ZFILE_SYS_ZFILE 0
+#define ZFILE_SYS_ZONE_ENTER 1
+#define ZFILE_SYS_OPEN 2
+#define ZFILE_SYS_SENDMSG 3
+#define ZFILE_SYS_RECVMSG 4
+#define ZFILE_SYS_FORK 5
+#define ZFILE_SYS_SOCKETPAIR 6
+#define ZFILE_SYS_TEMPLATE 7
+#define ZFILE_SYS_FSTAT 8
+#define ZFILE_SYS_READ 9
+#define ZFILE_SYS_WRITE 10
+#define ZFILE_SYS_FSYNC 11
+#define ZFILE_SYS_RENAME 12
+#define ZFILE_SYS_MMAP 13
+#define ZFILE_SYS_LSTAT 14
+#define ZFILE_SYS_READDIR 15
+#define ZFILE_SYS_POLL 16
+#define ZFILE_SYS_UNLINK 17
+#define ZFILE_SYS_SENDFILE 18
+#define ZFILE_SYS_FCHOWN 19
+#define ZFILE_SYS_FCHMOD 20
+#define ZFILE_SYS_MAX 21
+
+/* Slots in the zone name -> id cache (a power of 2) and the probe length */
+#define ZONE_CACHE_SLOTS 1024
+#define ZONE_CACHE_PROBES 16
+
+#define ZFILE_OP_OPEN 0
+#define ZFILE_OP_OPEN_MANY 1
+#define ZFILE_OP_WRITE 2
+#define ZFILE_OP_STAT 3
+#define ZFILE_OP_READDIR 4
+#define ZFILE_OP_RENAME 5
+#define ZFILE_OP_UNLINK 6
+
+/* The most a query reply (see query_run()) may carry */
+#define ZFILE_QUERY_MAX (16 * 1024 * 1024)
+
+/*
+ * A one-shot child killed on a timeout is checked on ZFILE_REAP_TRIES times,
+ * 1ms apart, before it's left on reap_list; at most ZFILE_REAP_MAX wait
+ * there to be reaped later.
+ */
+#define ZFILE_REAP_TRIES 10
+#define ZFILE_REAP_MAX 64
+
+/* Flags for atomic writes, and the most an agent will accept for one */
+#define ZFILE_WRITE_FSYNC 0x1
+#define ZFILE_WRITE_MAX (64 * 1024 * 1024)
+
+/* madvise() hints for mapped files, and the largest Buffer node allows */
+#define ZFILE_ADVISE_NORMAL 0
+#define ZFILE_ADVISE_SEQUENTIAL 1
+#define ZFILE_ADVISE_RANDOM 2
+#define ZFILE_ADVISE_WILLNEED 3
+#define ZFILE_MMAP_MAX 0x3fffffff
+
+/*
+ * scanZoneFile() reads ZFILE_SCAN_CHUNK bytes at a time at chunk aligned
+ * offsets into the page aligned second half of the worker's thread buffer;
+ * the partial line carried over from the last chunk sits just below it in
+ * the first half.  Lines longer than a chunk are split.  Matched text kept
+ * for JS is capped at ZFILE_SCAN_TEXT_MAX.
+ */
+#define ZFILE_SCAN_CHUNK (1024 * 1024)
+#define ZFILE_THREAD_BUF (2 * ZFILE_SCAN_CHUNK)
+#define ZFILE_THREAD_BUF_ALIGN 4096
+#define ZFILE_SCAN_NEEDLES 64
+#define ZFILE_SCAN_TEXT_MAX (64 * 1024 * 1024)
+
+/*
+ * Events reported to a followZoneFile() watch: the file was written to, it
+ * was truncated, or it is gone from under its name (deleted, renamed or
+ * unmounted) and the watch has stopped.
+ */
+#define ZFILE_WATCH_MODIFIED 0x1
+#define ZFILE_WATCH_TRUNC 0x2
+#define ZFILE_WATCH_GONE 0x4
+
+/*
+ * copyZoneFile() flags, and how much it asks sendfile() for at a time (so a
+ * timeout or an error is noticed between pieces).
+ */
+#define ZFILE_COPY_ATOMIC 0x1
+#define ZFILE_COPY_FSYNC 0x2
+#define ZFILE_COPY_CHUNK (8 * 1024 * 1024)
+
+/* hashZoneFile() algorithms; digests are at most ZFILE_DIGEST_MAX bytes */
+#define ZFILE_HASH_SHA256 0
+#define ZFILE_HASH_XXH64 1
+#define ZFILE_DIGEST_MAX 32
+
+/* Default size of the zfile threadpool and the most requests it queues */
+#define ZFILE_POOL_SIZE 4
+#define ZFILE_POOL_MAX_QUEUE 1024
+
+/* Finished single-open batons kept for reuse, at most */
+#define ZFILE_BATON_POOL_MAX 128
+
+/* The status a cancelled request's after callback is run with */
+#define ZFILE_CANCELLED (-ECANCELED)
+
+/* Descriptors sent per SCM_RIGHTS message, and paths per batched open */
+#define ZFILE_FDS_PER_MSG 32
+#define ZFILE_BATCH_MAX 1024
+
+/*
+ * Phases of an open that are timed into the stats histograms.  QUEUE is
+ * the wait for a threadpool thread, LOCK the wait for a busy zone agent,
+ * and ENTER/OPEN are timed by the child itself.
+ */
+#define ZFILE_PHASE_QUEUE 0
+#define ZFILE_PHASE_LOCK 1
+#define ZFILE_PHASE_FORK 2
+#define ZFILE_PHASE_ENTER 3
+#define ZFILE_PHASE_OPEN 4
+#define ZFILE_PHASE_WAIT 5
+#define ZFILE_PHASE_TOTAL 6
+#define ZFILE_PHASE_MAX 7
+
+/*
+ * Histogram buckets are log-linear: each power of 2 is split into
+ * ZFILE_HIST_SUB buckets, which bounds the error of a reported percentile
+ * to 1/ZFILE_HIST_SUB of its value.
+ */
+#define ZFILE_HIST_SUB_BITS 2
+#define ZFILE_HIST_SUB (1 << ZFILE_HIST_SUB_BITS)
+#define ZFILE_HIST_BUCKETS (64 * ZFILE_HIST_SUB)
+
+static const char *zfile_phases[ZFILE_PHASE_MAX] = {
+    "queue",
+    "lock",
+    "fork",
+    "zone_enter",
+    "open",
+    "waitpid",
+    "total"
+};
+
+static const char *zfile_syscalls[ZFILE_SYS_MAX] = {
+    "zfile",
+    "zone_enter",
+    "open",
+    "sendmsg",
+    "recvmsg",
+    "fork",
+    "socketpair",
+    "ct_tmpl_activate",
+    "fstat",
+    "pread",
+    "write",
+    "fsync",
+    "rename",
+    "mmap",
+    "lstat",
+    "readdir",
+    "poll",
+    "unlink",
+    "sendfile",
+    "fchown",
+    "fchmod"
+};
+
+/*
+ * Events recorded in the trace rings (see trace()).  FORK and its kin have
+ * the child's pid, or the fork errno; OPEN_DONE and AGENT_OPEN have the fd
+ * handed back as their arg.
+ */
+#define ZFILE_TRACE_FORK 0
+#define ZFILE_TRACE_BATCH_FORK 1
+#define ZFILE_TRACE_WRITE_FORK 2
+#define ZFILE_TRACE_QUERY_FORK 3
+#define ZFILE_TRACE_AGENT_FORK 4
+#define ZFILE_TRACE_WAIT 5
+#define ZFILE_TRACE_WEDGED 6
+#define ZFILE_TRACE_NO_REPLY 7
+#define ZFILE_TRACE_OPEN_DONE 8
+#define ZFILE_TRACE_AGENT_FAILED 9
+#define ZFILE_TRACE_AGENT_STARTED 10
+#define ZFILE_TRACE_AGENT_TIMEOUT 11
+#define ZFILE_TRACE_AGENT_GONE 12
+#define ZFILE_TRACE_AGENT_OPEN 13
+#define ZFILE_TRACE_ZONE_STALE 14
+#define ZFILE_TRACE_ZONE_RUNNING 15
+#define ZFILE_TRACE_ZONE_DOWN 16
+#define ZFILE_TRACE_PREWARM_FAILED 17
+#define ZFILE_TRACE_PORT_ERROR 18
+#define ZFILE_TRACE_CONTRACT_LEAK 19
+#define ZFILE_TRACE_CHILD_LOST 20
+#define ZFILE_TRACE_MAX 21
+
+/* Records kept per thread; the oldest are overwritten */
+#define ZFILE_TRACE_RECS 512
+
+static const char *zfile_trace_events[ZFILE_TRACE_MAX] = {
+    "fork",
+    "batch_fork",
+    "write_fork",
+    "query_fork",
+    "agent_fork",
+    "waitpid",
+    "wedged",
+    "no_reply",
+    "open_done",
+    "agent_failed",
+    "agent_started",
+    "agent_timeout",
+    "agent_gone",
+    "agent_open",
+    "zone_stale",
+    "zone_running",
+    "zone_down",
+    "prewarm_failed",
+    "port_error",
+    "contract_leak",
+    "child_lost"
+};
+
+/*
+ * How to open a single file: zo_flags for open(2), zo_perms for a file
+ * that is created, and zo_hints, some ZFILE_HINT_*.  zo_mode is the MODE_*
+ * the request named, which is what probes report.
+ */
+typedef struct zfile_open {
+    int32_t zo_mode;
+    int32_t zo_flags;
+    int32_t zo_perms;
+    int32_t zo_hints;
+} zfile_open_t;
+
+/*
+ * Requests sent to a zone agent over its socketpair.  For ZFILE_OP_OPEN
+ * zr_open says how, and the NUL terminated path (zr_len bytes, including
+ * the NUL) immediately follows the header; for ZFILE_OP_OPEN_MANY zr_count
+ * is the entry count and the zr_len bytes that follow are a packed batch
+ * (see zfile_batch_t).  For
+ * ZFILE_OP_WRITE zr_mode holds ZFILE_WRITE_* flags and the zr_len bytes are
+ * the NUL terminated path followed by the new contents.  ZFILE_OP_STAT and
+ * ZFILE_OP_READDIR are followed by a path, as for ZFILE_OP_OPEN, and are
+ * answered by a reply with zp_value bytes of result after it; so are
+ * ZFILE_OP_UNLINK and ZFILE_OP_RENAME, whose "path" is the old and new
+ * names back to back (see query_path_len()), with empty results.
+ */
+typedef struct zfile_req {
+    int32_t zr_op;
+    int32_t zr_mode;
+    uint32_t zr_len;
+    uint32_t zr_count;
+    zfile_open_t zr_open;
+} zfile_req_t;
+
+/*
+ * Replies from a zfile() child or an agent.  On failure zp_errno and
+ * zp_syscall (a ZFILE_SYS_* value) say what went wrong; on a successful
+ * open the fd rides along as SCM_RIGHTS.  The first reply from a freshly
+ * spawned agent carries its pid in zp_value.
+ */
+typedef struct zfile_resp {
+    int32_t zp_errno;
+    int32_t zp_syscall;
+    int32_t zp_value;
+    int32_t zp_pad;
+    hrtime_t zp_enter_ns;
+    hrtime_t zp_open_ns;
+} zfile_resp_t;
+
+/*
+ * The result of ZFILE_OP_STAT: an lstat() done in the zone, in a form that
+ * doesn't depend on the child's and parent's struct stat agreeing.
+ */
+typedef struct zfile_stat {
+    uint64_t zi_dev;
+    uint64_t zi_ino;
+    uint64_t zi_size;
+    uint64_t zi_blocks;
+    uint32_t zi_mode;
+    uint32_t zi_nlink;
+    uint32_t zi_uid;
+    uint32_t zi_gid;
+    int64_t zi_atime[2];
+    int64_t zi_mtime[2];
+    int64_t zi_ctime[2];
+} zfile_stat_t;
+
+/*
+ * A long-lived helper process that has already done zone_enter() and serves
+ * open requests for one zone.  za_lock serializes requests on za_sock; a
+ * za_sock of -1 means there is no running agent and one must be spawned.
+ * za_refs and za_gone are under agents_lock: an entry taken off the agents
+ * list by zone_forget() is freed by whoever drops its last reference.
+ */
+typedef struct zfile_agent {
+    zoneid_t za_zoneid;
+    pid_t za_pid;
+    int za_sock;
+    uint32_t za_refs;
+    int za_gone;
+    pthread_mutex_t za_lock;
+    struct zfile_agent *za_next;
+} zfile_agent_t;
+
+/*
+ * A batch of opens to perform with one zone_enter().  zb_buf holds zb_count
+ * int32_t modes followed by as many NUL terminated paths, back to back; the
+ * same bytes are what an agent receives.  Per-entry results land in zb_fds
+ * (-1 on failure) and zb_errs (0 on success).
+ */
+typedef struct zfile_batch {
+    const char *zb_buf;
+    size_t zb_len;
+    uint32_t zb_count;
+    int *zb_fds;
+    int *zb_errs;
+} zfile_batch_t;
+
+/*
+ * A fixed-string search of one file.  zc_needles holds zc_nneedles needles
+ * of zc_nlens bytes each; zc_next is scratch for where each next occurs in
+ * the region being scanned.  Each matching line is recorded once in
+ * zc_matches, at most zc_limit of them, as its file offset and (when
+ * zc_keep is set) its text, without the newline, in zc_text.  zc_truncated
+ * is set if the search stopped at a limit.
+ */
+typedef struct zfile_match {
+    off_t zm_off;
+    size_t zm_text;
+    size_t zm_len;
+} zfile_match_t;
+
+typedef struct zfile_scan {
+    char **zc_needles;
+    size_t *zc_nlens;
+    size_t *zc_next;
+    int zc_nneedles;
+    int zc_limit;
+    int zc_keep;
+    zfile_match_t *zc_matches;
+    int zc_nmatches;
+    int zc_cap;
+    char *zc_text;
+    size_t zc_textlen;
+    size_t zc_textcap;
+    int zc_truncated;
+} zfile_scan_t;
+
+/*
+ * Streaming XXH64 state, with a seed of 0.  xh_v are the four lane
+ * accumulators, and xh_mem holds input not yet making up a 32 byte stripe.
+ */
+typedef struct zfile_xxh64 {
+    uint64_t xh_total;
+    uint64_t xh_v[4];
+    uint8_t xh_mem[32];
+    size_t xh_memlen;
+} zfile_xxh64_t;
+
+/*
+ * Zone name -> id cache.  Lookups from the worker threads take no locks:
+ * each slot is a seqlock, zc_seq being odd while a writer (serialized by
+ * zone_cache_lock) updates it, and readers retry if it moved underneath
+ * them.  Names are never removed, so probe chains stay intact; a zoneid of
+ * -1 marks an entry that has been invalidated.
+ */
+typedef struct zone_cache_ent {
+    volatile uint32_t zc_seq;
+    zoneid_t zc_zoneid;
+    char zc_name[ZONENAME_MAX];
+} zone_cache_ent_t;
+
+static zone_cache_ent_t zone_cache[ZONE_CACHE_SLOTS];
+static pthread_mutex_t zone_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Read-only fds kept from earlier opens, most recently used first, so that
+ * files read over and over need no fork.  zd_real is the file's path as
+ * seen from the global zone (the zone's root plus zd_path); an entry is
+ * only served while lstat() of that still finds the same file with the
+ * same size and mtime, and until zd_expires.  Served fds are fresh opens
+ * of /proc/self/fd/<zd_fd>, so each has an offset of its own.  fdcache_lock
+ * guards the list.  A hit takes its entry off the list for the check and
+ * reopen, done without the lock so that a hung zone filesystem holds up
+ * only that open, so nothing can close the entry's fd underneath it.
+ * fdcache_gen moves whenever a zone's entries are forgotten, so that one
+ * taken off before then is not put back.
+ */
+typedef struct zfile_fdent {
+    zoneid_t zd_zoneid;
+    uint32_t zd_hash;
+    char *zd_path;
+    char *zd_real;
+    int zd_fd;
+    dev_t zd_dev;
+    ino_t zd_ino;
+    off_t zd_size;
+    struct timespec zd_mtime;
+    hrtime_t zd_expires;
+    struct zfile_fdent *zd_prev;
+    struct zfile_fdent *zd_next;
+} zfile_fdent_t;
+
+static pthread_mutex_t fdcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static zfile_fdent_t *fdcache_head = NULL;
+static zfile_fdent_t *fdcache_tail = NULL;
+static uint32_t fdcache_count = 0;
+static uint32_t fdcache_max = 0;
+static hrtime_t fdcache_ttl = 0;
+static uint32_t fdcache_gen = 0;
+
+static pthread_mutex_t agents_lock = PTHREAD_MUTEX_INITIALIZER;
+static zfile_agent_t *agents = NULL;
+static volatile uint32_t agents_enabled = 0;  // Set by SetAgentOptions()
+static volatile uint32_t agent_idle_ms = 30000;
+static int spawn_mode = ZFILE_SPAWN_FORK;
+
+/*
+ * zfile runs its requests on a threadpool of its own rather than libuv's,
+ * so that opens stuck in fork and waitpid cannot starve node's fs and dns
+ * work.  Queued work is kept per zone, and the zones with something queued
+ * form a ring that the workers serve one request at a time, so a zone with
+ * a deep backlog only delays the others by one request each.
+ *
+ * A request queued with a ticket can be cancelled through pool_cancel();
+ * zw_cancelled is only set under pool_lock, and read by pool_reap().
+ */
+typedef struct zpool_work {
+    uv_work_t *zw_req;
+    uv_work_cb zw_work;
+    uv_after_work_cb zw_after;
+    uint32_t zw_ticket;
+    int zw_cancelled;
+    struct zpool_work *zw_next;
+} zpool_work_t;
+
+typedef struct zpool_zone {
+    char zz_name[ZONENAME_MAX];
+    zpool_work_t *zz_head;
+    zpool_work_t *zz_tail;
+    struct zpool_zone *zz_next;
+} zpool_zone_t;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cv = PTHREAD_COND_INITIALIZER;
+static zpool_zone_t *pool_ring = NULL;
+static zpool_zone_t *pool_ring_tail = NULL;
+static zpool_work_t *pool_running = NULL;
+static zpool_work_t *pool_done = NULL;
+static uint32_t pool_queued = 0;
+static uint32_t pool_ticket = 0;
+static int pool_threads = 0;
+static int pool_size = ZFILE_POOL_SIZE;
+static uint32_t pool_max_queue = ZFILE_POOL_MAX_QUEUE;
+
+/* Only touched from the loop thread */
+static uv_async_t pool_async;
+static int pool_async_ready = 0;
+static uint32_t pool_pending = 0;
+
+/*
+ * followZoneFile() watches, all on one event port serviced by watch_thread.
+ * A watch names its file as /proc/self/fd/<fd>, so what is watched is the
+ * file already opened in the zone and not whatever a path would resolve to
+ * from the global zone.  PORT_SOURCE_FILE associations are one-shot: the
+ * thread re-arms each watch as it fires, adds the events to zv_pending and
+ * pokes the loop thread, which hands them to the watch's callback.  Events
+ * carry the watch's id rather than a pointer, as the loop thread may free
+ * a watch while its event is in flight.  watch_lock guards the list and
+ * every watch's zv_pending and zv_armed; the rest is the loop thread's.
+ */
+typedef struct zfile_watch {
+    uint32_t zv_id;
+    char zv_name[32];
+    file_obj_t zv_fobj;
+    int zv_armed;
+    int zv_pending;
+    v8::Persistent<v8::Function> zv_callback;
+    struct zfile_watch *zv_next;
+} zfile_watch_t;
+
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static zfile_watch_t *watch_list = NULL;
+static int watch_port = -1;
+
+/* Only touched from the loop thread */
+static uv_async_t watch_async;
+static int watch_async_ready = 0;
+static uint32_t watch_next_id = 1;
+static uint32_t watch_count = 0;
+
+/*
+ * Zone state changes, from the zones sysevent channel.  zone_event_handler
+ * runs on a libsysevent thread: it updates the zone id cache, and for a zone
+ * that is no longer running closes its agent and drops its cached fds, then
+ * queues the change on zone_events for the loop thread.  That pre-warms an
+ * agent for a zone that has just come up and hands the change to JS.
+ */
+typedef struct zfile_zone_event {
+    char zn_name[ZONENAME_MAX];
+    char zn_state[32];
+    char zn_prev[32];
+    zoneid_t zn_zoneid;
+    struct zfile_zone_event *zn_next;
+} zfile_zone_event_t;
+
+static pthread_mutex_t zone_events_lock = PTHREAD_MUTEX_INITIALIZER;
+static zfile_zone_event_t *zone_events = NULL;
+static evchan_t *zone_evc = NULL;
+
+/* Only touched from the loop thread */
+static uv_async_t zone_async;
+static int zone_async_ready = 0;
+static v8::Persistent<v8::Function> zone_callback;
+
+/* Opens currently in progress, and the most ever seen at once */
+static volatile uint32_t zfile_inflight = 0;
+static volatile uint32_t zfile_inflight_max = 0;
+
+typedef struct zfile_hist {
+    uint64_t zh_count;
+    uint64_t zh_sum;
+    uint64_t zh_max;
+    uint64_t zh_bucket[ZFILE_HIST_BUCKETS];
+} zfile_hist_t;
+
+/*
+ * Counters for one thread.  Only the owning thread writes them, so the
+ * hot path takes no locks; readers sum every thread's block under
+ * stats_lock, which only guards the list itself.  resetStats() bumps
+ * stats_gen rather than touching other threads' counters: a block whose
+ * zs_gen is behind is treated as empty, and zeroed by its owner the next
+ * time it records anything.
+ */
+typedef struct zfile_stats {
+    volatile uint32_t zs_gen;
+    uint64_t zs_ops;
+    uint64_t zs_cache_hits;
+    uint64_t zs_cache_misses;
+    uint64_t zs_errors[ZFILE_SYS_MAX];
+    zfile_hist_t zs_hist[ZFILE_PHASE_MAX];
+    struct zfile_stats *zs_next;
+    struct zfile_stats *zs_prev;
+} zfile_stats_t;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static zfile_stats_t *stats_list = NULL;
+static volatile uint32_t stats_gen = 0;
 
 // Node Macros require these
 using v8::Persistent;
@@ -76,6 +684,19 @@ using v8::String;
     RETURN_EXCEPTION("argument " #I " must be a function");             \
   v8::Local<v8::Function> VAR = v8::Local<v8::Function>::Cast(ARGS[I]);
 
+/*
+ * The optional timeout in ms every request takes after its callback; 0 (or
+ * anything that isn't a positive number) means none.
+ */
+static int timeout_arg(const v8::Arguments& args, int i) {
+    if (args.Length() <= i || !args[i]->IsNumber())
+        return (0);
+    int32_t ms = args[i]->Int32Value();
+    return (ms > 0 ? ms : 0);
+}
+
+class eio_across_t;
+
 class eio_baton_t {
     public:
         eio_baton_t(): _path(NULL),
@@ -83,7 +704,16 @@ class eio_baton_t {
         _zone(NULL),
         _mode(0),
         _errno(0),
-        _fd(-1) {}
+        _fd(-1),
+        _queued(0),
+        _timeout(0),
+        _across(NULL),
+        _index(0) {
+            _open.zo_mode = MODE_R;
+            _open.zo_flags = -1;
+            _open.zo_perms = ZFILE_PERMS;
+            _open.zo_hints = 0;
+        }
 
         virtual ~eio_baton_t() {
             _callback.Dispose();
@@ -114,6 +744,13 @@ class eio_baton_t {
         int _mode;
         int _errno;
         int _fd;
+        hrtime_t _queued;
+        int _timeout;
+        zfile_open_t _open;
+
+        // Set for one zone's open out of a zfileAcross() request
+        eio_across_t *_across;
+        uint32_t _index;
 
         v8::Persistent<v8::Function> _callback;
 
@@ -123,419 +760,6759 @@ class eio_baton_t {
 };
 
 
-static void chomp(char *s) {
-    while (*s && *s != '\n' && *s != '\r')
-        s++;
-    *s = 0;
-}
-
+/*
+ * The baton for a single open from zfile() or zfileAcross(), the hot path
+ * once agents or batching have taken the fork out of it.  The work request
+ * is embedded and the zone and path are copied inline when they fit, and a
+ * finished baton goes back on a freelist (see baton_get()) rather than to
+ * the allocator, leaving the callback's Persistent as the only allocation
+ * an open makes.
+ */
+class eio_open_baton_t : public eio_baton_t {
+    public:
+        eio_open_baton_t(): _next(NULL) {
+            _zonebuf[0] = '\0';
+            _pathbuf[0] = '\0';
+            _req.data = static_cast<eio_baton_t *>(this);
+        }
 
-static void debug(const char *fmt, ...) {
-    char *buf = NULL;
-    struct tm tm;
-    time_t now;
-    va_list alist;
+        virtual ~eio_open_baton_t() {
+            release();
+        }
 
-    if (getenv("ZFILE_DEBUG") == NULL) return;
+        // Point _zone and _path at copies of zone and path.  Returns 0, or
+        // -1 if one was too long to go inline and could not be strdup()ed.
+        int set(const char *zone, const char *path) {
+            _zone = copy(_zonebuf, sizeof(_zonebuf), zone);
+            _path = copy(_pathbuf, sizeof(_pathbuf), path);
+            return (_zone == NULL || _path == NULL ? -1 : 0);
+        }
 
-    if ((buf = (char *)alloca(BUF_SZ)) == NULL)
-        return;
+        // Return the baton to the state the constructor left it in
+        void reset() {
+            release();
+            _callback.Dispose();
+            _callback.Clear();
+            if (_syscall != NULL) free(_syscall);
+            _syscall = NULL;
+            _mode = 0;
+            _errno = 0;
+            _fd = -1;
+            _queued = 0;
+            _timeout = 0;
+            _open.zo_mode = MODE_R;
+            _open.zo_flags = -1;
+            _open.zo_perms = ZFILE_PERMS;
+            _open.zo_hints = 0;
+            _across = NULL;
+            _index = 0;
+            _req.data = static_cast<eio_baton_t *>(this);
+        }
 
-    now = time(0);
-    gmtime_r(&now, &tm);
-    asctime_r(&tm, buf);
-    chomp(buf);
+        uv_work_t _req;
+        eio_open_baton_t *_next;
 
-    va_start(alist, fmt);
+    private:
+        static char *copy(char *buf, size_t len, const char *s) {
+            if (strlcpy(buf, s, len) < len)
+                return (buf);
+            return (strdup(s));
+        }
 
-    fprintf(stderr, PREFIX, buf, pthread_self(), "DEBUG");
-    vfprintf(stderr, fmt, alist);
-    va_end(alist);
-}
+        void release() {
+            if (_zone != NULL && _zone != _zonebuf) free(_zone);
+            if (_path != NULL && _path != _pathbuf) free(_path);
+            _zone = NULL;
+            _path = NULL;
+        }
 
+        char _zonebuf[ZONENAME_MAX];
+        char _pathbuf[PATH_MAX];
+};
 
-static int init_template(void) {
-    int fd = 0;
-    int err = 0;
+/*
+ * Batons are only taken and returned on the loop thread, so the freelist
+ * needs no lock.  The counters are reported by getStats().
+ */
+static eio_open_baton_t *baton_free = NULL;
+static uint32_t baton_free_count = 0;
+static uint64_t baton_hits = 0;
+static uint64_t baton_misses = 0;
 
-    fd = open64(CTFS_ROOT "/process/template", O_RDWR);
-    if (fd == -1)
-        return (-1);
+static eio_open_baton_t *baton_get(void) {
+    eio_open_baton_t *baton = baton_free;
 
-    err |= ct_tmpl_set_critical(fd, 0);
-    err |= ct_tmpl_set_informative(fd, 0);
-    err |= ct_pr_tmpl_set_fatal(fd, CT_PR_EV_HWERR);
-    err |= ct_pr_tmpl_set_param(fd, CT_PR_PGRPONLY | CT_PR_REGENT);
-    if (err || ct_tmpl_activate(fd)) {
-        (void) close(fd);
-        return (-1);
+    if (baton == NULL) {
+        baton_misses++;
+        return (new eio_open_baton_t());
     }
-
-    return (fd);
+    baton_free = baton->_next;
+    baton_free_count--;
+    baton->_next = NULL;
+    baton_hits++;
+    return (baton);
 }
 
+static void baton_put(eio_open_baton_t *baton) {
+    if (baton_free_count >= ZFILE_BATON_POOL_MAX) {
+        delete baton;
+        return;
+    }
+    baton->reset();
+    baton->_next = baton_free;
+    baton_free = baton;
+    baton_free_count++;
+}
 
-static int contract_latest(ctid_t *id) {
-  int cfd = 0;
-  int r = 0;
-  ct_stathdl_t st = {0};
-  ctid_t result = {0};
 
-  if ((cfd = open64(CTFS_ROOT "/process/latest", O_RDONLY)) == -1)
-    return (errno);
-  if ((r = ct_status_read(cfd, CTD_COMMON, &st)) != 0) {
-    (void) close(cfd);
-    return (r);
-  }
+/*
+ * An open whose file is then read whole by the worker, see readZoneFile().
+ * _data is malloc()ed and handed to the Buffer given to JS.
+ */
+class eio_read_baton_t : public eio_baton_t {
+    public:
+        eio_read_baton_t(): _max(0),
+        _data(NULL),
+        _len(0) {}
 
-  result = ct_status_get_id(st);
-  ct_status_free(st);
-  (void) close(cfd);
+        virtual ~eio_read_baton_t() {
+            if (_data != NULL) free(_data);
+            _data = NULL;
+        }
 
-  *id = result;
-  return (0);
-}
+        size_t _max;
+        char *_data;
+        size_t _len;
+};
 
 
-static int close_on_exec(int fd) {
-  int flags = fcntl(fd, F_GETFD, 0);
-  if ((flags != -1) && (fcntl(fd, F_SETFD, flags | FD_CLOEXEC) != -1))
-    return (0);
-  return (-1);
-}
+/*
+ * An lstat() or directory listing done in the zone, see statZoneFile() and
+ * readZoneDir().  _data is the query_run() result, _len bytes long.
+ */
+class eio_query_baton_t : public eio_baton_t {
+    public:
+        eio_query_baton_t(): _op(ZFILE_OP_STAT),
+        _data(NULL),
+        _len(0) {}
 
+        virtual ~eio_query_baton_t() {
+            if (_data != NULL) free(_data);
+            _data = NULL;
+        }
 
-static int contract_open(ctid_t ctid,
-                         const char *type,
-                         const char *file,
-                         int oflag) {
-  char path[PATH_MAX];
-  unsigned int n = 0;
-  int fd = 0;
+        int _op;
+        char *_data;
+        size_t _len;
+};
 
-  if (type == NULL)
-    type = "all";
 
-  n = snprintf(path, PATH_MAX, CTFS_ROOT "/%s/%ld/%s", type, ctid, file);
-  if (n >= sizeof(path)) {
-    errno = ENAMETOOLONG;
-    return (-1);
-  }
+/*
+ * An open whose file is then mapped by the worker, see mmapZoneFile().  The
+ * mapping is handed to the Buffer given to JS, which unmaps it when
+ * collected.
+ */
+class eio_mmap_baton_t : public eio_baton_t {
+    public:
+        eio_mmap_baton_t(): _map(NULL),
+        _len(0),
+        _advice(ZFILE_ADVISE_NORMAL) {}
 
-  fd = open64(path, oflag);
-  if (fd != -1) {
-    if (close_on_exec(fd) == -1) {
-      int err = errno;
-      (void) close(fd);
-      errno = err;
-      return (-1);
-    }
-  }
-  return (fd);
-}
+        virtual ~eio_mmap_baton_t() {
+            if (_map != NULL) (void) munmap(static_cast<caddr_t>(_map), _len);
+            _map = NULL;
+        }
 
+        void *_map;
+        size_t _len;
+        int _advice;
+};
 
-static int contract_abandon_id(ctid_t ctid) {
-  int fd = 0;
-  int err = 0;
 
-  fd = contract_open(ctid, "all", "ctl", O_WRONLY);
-  if (fd == -1)
-    return (errno);
+/*
+ * An atomic replacement of _path with the _len bytes at _data (a private
+ * copy of the caller's Buffer), see writeZoneFileAtomic().
+ */
+class eio_write_baton_t : public eio_baton_t {
+    public:
+        eio_write_baton_t(): _data(NULL),
+        _len(0),
+        _flags(0) {}
 
-  err = ct_ctl_abandon(fd);
-  (void) close(fd);
+        virtual ~eio_write_baton_t() {
+            if (_data != NULL) free(_data);
+            _data = NULL;
+        }
 
-  return (err);
-}
+        char *_data;
+        size_t _len;
+        int _flags;
+};
 
 
-static ssize_t read_fd(int fd, void *ptr, size_t nbytes, int *recvfd) {
-  struct msghdr msg;
-  struct iovec iov[1];
-  ssize_t n = -1;
-  union {
-    struct cmsghdr cm;
-    char control[CMSG_SPACE(sizeof(int))];
-  } control_un;
-  struct cmsghdr *cmptr = NULL;
+/*
+ * An open whose file is then searched by the worker, see scanZoneFile().
+ */
+class eio_scan_baton_t : public eio_baton_t {
+    public:
+        eio_scan_baton_t() {
+            memset(&_scan, 0, sizeof(_scan));
+        }
 
-  msg.msg_control = control_un.control;
-  msg.msg_controllen = sizeof(control_un.control);
-  msg.msg_name = NULL;
-  msg.msg_namelen = 0;
+        virtual ~eio_scan_baton_t() {
+            for (int i = 0; i < _scan.zc_nneedles; i++)
+                free(_scan.zc_needles[i]);
+            free(_scan.zc_needles);
+            free(_scan.zc_nlens);
+            free(_scan.zc_next);
+            free(_scan.zc_matches);
+            free(_scan.zc_text);
+        }
 
-  iov[0].iov_base = ptr;
-  iov[0].iov_len = nbytes;
-  msg.msg_iov = iov;
-  msg.msg_iovlen = 1;
+        zfile_scan_t _scan;
+};
 
-  if ((n = recvmsg(fd, &msg, 0)) <= 0) {
-    return (n);
-  }
 
-  if ((cmptr = CMSG_FIRSTHDR(&msg)) != NULL &&
-      cmptr->cmsg_len == CMSG_LEN(sizeof(int))) {
-    if (cmptr->cmsg_level != SOL_SOCKET ||
-        cmptr->cmsg_type != SCM_RIGHTS) {
-      *recvfd = -1;
-      errno = EINVAL;
+/*
+ * An open whose file is then hashed by the worker, see hashZoneFile().
+ * _size is the number of bytes hashed, and _mtime the file's mtime.
+ */
+class eio_hash_baton_t : public eio_baton_t {
+    public:
+        eio_hash_baton_t(): _algo(ZFILE_HASH_SHA256),
+        _dlen(0),
+        _size(0) {
+            memset(_digest, 0, sizeof(_digest));
+            memset(&_mtime, 0, sizeof(_mtime));
+        }
+
+        int _algo;
+        uint8_t _digest[ZFILE_DIGEST_MAX];
+        size_t _dlen;
+        off_t _size;
+        struct timespec _mtime;
+};
+
+
+/*
+ * A copy, see copyZoneFile(): the source is this baton's zone and path,
+ * the target _target's.  An empty zone name means the global zone's own
+ * files, opened directly.  An atomic copy is written to _tmp, next to the
+ * target, and renamed over it once complete.  _failed is the path an
+ * error is reported against.
+ */
+class eio_copy_baton_t : public eio_baton_t {
+    public:
+        eio_copy_baton_t(): _flags(0),
+        _bytes(0),
+        _tmp(NULL),
+        _failed(NULL) {}
+
+        virtual ~eio_copy_baton_t() {
+            if (_tmp != NULL) free(_tmp);
+            _tmp = NULL;
+        }
+
+        eio_query_baton_t _target;
+        int _flags;
+        int64_t _bytes;
+        char *_tmp;
+        const char *_failed;
+};
+
+
+/*
+ * One read-ahead pread() for a ZoneFileReadStream, into _len bytes of the
+ * Buffer held by _buffer from offset _pos of the already open _fd.
+ */
+class eio_pread_baton_t : public eio_baton_t {
+    public:
+        eio_pread_baton_t(): _buf(NULL),
+        _len(0),
+        _pos(0),
+        _nread(0) {}
+
+        virtual ~eio_pread_baton_t() {
+            _buffer.Dispose();
+        }
+
+        v8::Persistent<v8::Object> _buffer;
+        char *_buf;
+        size_t _len;
+        off_t _pos;
+        size_t _nread;
+};
+
+
+class eio_batch_baton_t {
+    public:
+        eio_batch_baton_t(): _zone(NULL),
+        _syscall(NULL),
+        _errno(0),
+        _queued(0),
+        _timeout(0) {
+            memset(&_batch, 0, sizeof(_batch));
+        }
+
+        virtual ~eio_batch_baton_t() {
+            _callback.Dispose();
+
+            if (_zone != NULL) free(_zone);
+            if (_syscall != NULL) free(_syscall);
+            free(const_cast<char *>(_batch.zb_buf));
+            free(_batch.zb_fds);
+            free(_batch.zb_errs);
+
+            _zone = NULL;
+            _syscall = NULL;
+        }
+
+        void setErrno(const char *syscall, int errorno) {
+            if (_syscall != NULL) {
+                free(_syscall);
+            }
+            _syscall = strdup(syscall);
+            _errno = errorno;
+        }
+
+        char *_zone;
+        char *_syscall;
+        int _errno;
+        zfile_batch_t _batch;
+        hrtime_t _queued;
+        int _timeout;
+
+        v8::Persistent<v8::Function> _callback;
+
+    private:
+        eio_batch_baton_t(const eio_batch_baton_t &);
+        eio_batch_baton_t &operator=(const eio_batch_baton_t &);
+};
+
+
+/*
+ * One path opened in many zones.  Each zone gets an eio_baton_t of its own
+ * pointing back here; at most _parallel of them are queued at a time, and
+ * _next is the first zone not yet queued.
+ */
+class eio_across_t {
+    public:
+        eio_across_t(): _zones(NULL),
+        _nzones(0),
+        _path(NULL),
+        _mode(0),
+        _parallel(1),
+        _next(0),
+        _outstanding(0),
+        _done(0),
+        _timeout(0) {}
+
+        virtual ~eio_across_t() {
+            _each.Dispose();
+            _callback.Dispose();
+            _results.Dispose();
+
+            if (_zones != NULL) {
+                for (uint32_t i = 0; i < _nzones; i++)
+                    free(_zones[i]);
+                free(_zones);
+            }
+            if (_path != NULL) free(_path);
+
+            _zones = NULL;
+            _path = NULL;
+        }
+
+        char **_zones;
+        uint32_t _nzones;
+        char *_path;
+        int _mode;
+        uint32_t _parallel;
+        uint32_t _next;
+        uint32_t _outstanding;
+        uint32_t _done;
+        int _timeout;
+
+        v8::Persistent<v8::Function> _each;
+        v8::Persistent<v8::Function> _callback;
+        v8::Persistent<v8::Array> _results;
+
+    private:
+        eio_across_t(const eio_across_t &);
+        eio_across_t &operator=(const eio_across_t &);
+};
+
+
+static ssize_t read_full(int fd, void *ptr, size_t nbytes);
+static ssize_t write_full(int fd, const void *ptr, size_t nbytes);
+static void zone_forget(const char *name, zoneid_t zoneid);
+
+
+/*
+ * Both the active process contract template and CTFS_ROOT/process/latest
+ * are per-LWP, so each worker thread can set up its own template, fork and
+ * look up the contract its child landed in without coordinating with any
+ * other thread.  See thread_template().
+ */
+static int init_template(void) {
+    int fd = 0;
+    int err = 0;
+
+    fd = open64(CTFS_ROOT "/process/template", O_RDWR);
+    if (fd == -1)
+        return (-1);
+
+    err |= ct_tmpl_set_critical(fd, 0);
+    err |= ct_tmpl_set_informative(fd, 0);
+    err |= ct_pr_tmpl_set_fatal(fd, CT_PR_EV_HWERR);
+    err |= ct_pr_tmpl_set_param(fd, CT_PR_PGRPONLY | CT_PR_REGENT);
+    if (err || ct_tmpl_activate(fd)) {
+        (void) close(fd);
+        return (-1);
+    }
+
+    return (fd);
+}
+
+
+static int contract_latest(ctid_t *id) {
+  int cfd = 0;
+  int r = 0;
+  ct_stathdl_t st = {0};
+  ctid_t result = {0};
+
+  if ((cfd = open64(CTFS_ROOT "/process/latest", O_RDONLY)) == -1)
+    return (errno);
+  if ((r = ct_status_read(cfd, CTD_COMMON, &st)) != 0) {
+    (void) close(cfd);
+    return (r);
+  }
+
+  result = ct_status_get_id(st);
+  ct_status_free(st);
+  (void) close(cfd);
+
+  *id = result;
+  return (0);
+}
+
+
+static int close_on_exec(int fd) {
+  int flags = fcntl(fd, F_GETFD, 0);
+  if ((flags != -1) && (fcntl(fd, F_SETFD, flags | FD_CLOEXEC) != -1))
+    return (0);
+  return (-1);
+}
+
+
+static int contract_open(ctid_t ctid,
+                         const char *type,
+                         const char *file,
+                         int oflag) {
+  char path[PATH_MAX];
+  unsigned int n = 0;
+  int fd = 0;
+
+  if (type == NULL)
+    type = "all";
+
+  n = snprintf(path, PATH_MAX, CTFS_ROOT "/%s/%ld/%s", type, ctid, file);
+  if (n >= sizeof(path)) {
+    errno = ENAMETOOLONG;
+    return (-1);
+  }
+
+  fd = open64(path, oflag);
+  if (fd != -1) {
+    if (close_on_exec(fd) == -1) {
+      int err = errno;
+      (void) close(fd);
+      errno = err;
       return (-1);
     }
+  }
+  return (fd);
+}
+
+
+static int contract_abandon_id(ctid_t ctid) {
+  int fd = 0;
+  int err = 0;
+
+  fd = contract_open(ctid, "all", "ctl", O_WRONLY);
+  if (fd == -1)
+    return (errno);
+
+  err = ct_ctl_abandon(fd);
+  (void) close(fd);
+
+  return (err);
+}
+
+
+/*
+ * Per worker thread state.  zt_tmpl_fd is the thread's process contract
+ * template, activated on first use and left active, so that forks from the
+ * thread need no ctfs work of their own.  zt_stats is the thread's share of
+ * the stats, linked on stats_list for as long as the thread lives.  zt_buf
+ * is ZFILE_THREAD_BUF bytes of scratch for reading files through, allocated
+ * on first use.  zt_deadline, when not 0, is when the request the thread is
+ * running times out (see deadline_wait()).  zt_ring is the trace ring the
+ * thread writes to, claimed on its first trace().
+ */
+typedef struct zfile_ring zfile_ring_t;
+
+typedef struct zfile_thread {
+    int zt_tmpl_fd;
+    zfile_stats_t zt_stats;
+    char *zt_buf;
+    hrtime_t zt_deadline;
+    zfile_ring_t *zt_ring;
+} zfile_thread_t;
+
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+
+
+/*
+ * Tracing, for post-mortem analysis of what the threads did: each thread
+ * that traces claims a ring of ZFILE_TRACE_RECS fixed-size records that
+ * only it writes, so recording an event takes no lock and no allocation.
+ * Rings are never freed; one left by an exited thread is claimed by the
+ * next thread to trace, keeping the old records until they are written
+ * over.  Readers (ZFileTrace()) copy a ring while it is being written and
+ * drop whatever was overwritten while they copied.
+ *
+ * Nothing is traced from a child, which may be sharing our address space.
+ */
+typedef struct zfile_trace {
+    hrtime_t tr_time;
+    uint32_t tr_thread;
+    int32_t tr_event;
+    int32_t tr_zoneid;
+    int32_t tr_pid;
+    int32_t tr_errno;
+    int32_t tr_arg;
+} zfile_trace_t;
+
+struct zfile_ring {
+    volatile uint32_t rg_next;
+    volatile uint32_t rg_owned;
+    zfile_ring_t *rg_link;
+    zfile_trace_t rg_recs[ZFILE_TRACE_RECS];
+};
+
+static zfile_ring_t *volatile trace_rings = NULL;
+static volatile int trace_enabled = 0;      // Set from ZFILE_TRACE by Init()
+
 
-    *recvfd = *(reinterpret_cast<int *>(CMSG_DATA(cmptr)));
+static void trace_release(zfile_ring_t *rg) {
+  membar_producer();
+  rg->rg_owned = 0;
+}
+
+
+static void thread_fini(void *arg) {
+  zfile_thread_t *zt = static_cast<zfile_thread_t *>(arg);
+
+  if (zt->zt_tmpl_fd >= 0) {
+    (void) ct_tmpl_clear(zt->zt_tmpl_fd);
+    (void) close(zt->zt_tmpl_fd);
+  }
+
+  pthread_mutex_lock(&stats_lock);
+  if (zt->zt_stats.zs_prev != NULL) {
+    zt->zt_stats.zs_prev->zs_next = zt->zt_stats.zs_next;
   } else {
-    *recvfd = -1;
+    stats_list = zt->zt_stats.zs_next;
+  }
+  if (zt->zt_stats.zs_next != NULL)
+    zt->zt_stats.zs_next->zs_prev = zt->zt_stats.zs_prev;
+  pthread_mutex_unlock(&stats_lock);
+
+  // The ring, and what it holds, outlives the thread for the next to claim
+  if (zt->zt_ring != NULL)
+    trace_release(zt->zt_ring);
+
+  free(zt->zt_buf);
+  free(zt);
+}
+
+
+static void thread_key_init(void) {
+  (void) pthread_key_create(&thread_key, thread_fini);
+}
+
+
+static zfile_thread_t *thread_self(void) {
+  zfile_thread_t *zt = NULL;
+
+  (void) pthread_once(&thread_once, thread_key_init);
+  zt = static_cast<zfile_thread_t *>(pthread_getspecific(thread_key));
+  if (zt != NULL)
+    return (zt);
+
+  if ((zt = static_cast<zfile_thread_t *>(calloc(1, sizeof(*zt)))) == NULL) {
+    errno = ENOMEM;
+    return (NULL);
+  }
+  zt->zt_tmpl_fd = -1;
+  zt->zt_stats.zs_gen = stats_gen;
+
+  if (pthread_setspecific(thread_key, zt) != 0) {
+    free(zt);
+    errno = ENOMEM;
+    return (NULL);
+  }
+
+  pthread_mutex_lock(&stats_lock);
+  zt->zt_stats.zs_next = stats_list;
+  if (stats_list != NULL)
+    stats_list->zs_prev = &zt->zt_stats;
+  stats_list = &zt->zt_stats;
+  pthread_mutex_unlock(&stats_lock);
+
+  return (zt);
+}
+
+
+/*
+ * The calling thread's ZFILE_THREAD_BUF byte, page aligned, scratch buffer.
+ * Returns NULL with errno set if it can't be had.
+ */
+static char *thread_buffer(void) {
+  zfile_thread_t *zt = thread_self();
+  void *buf = NULL;
+  int err = 0;
+
+  if (zt == NULL)
+    return (NULL);
+  if (zt->zt_buf != NULL)
+    return (zt->zt_buf);
+
+  if ((err = posix_memalign(&buf, ZFILE_THREAD_BUF_ALIGN,
+                            ZFILE_THREAD_BUF)) != 0) {
+    errno = err;
+    return (NULL);
+  }
+  zt->zt_buf = static_cast<char *>(buf);
+  return (zt->zt_buf);
+}
+
+
+static zfile_ring_t *trace_ring(zfile_thread_t *zt) {
+  zfile_ring_t *rg = NULL;
+  zfile_ring_t *head = NULL;
+
+  if (zt->zt_ring != NULL)
+    return (zt->zt_ring);
+
+  for (rg = trace_rings; rg != NULL; rg = rg->rg_link) {
+    if (atomic_cas_32(&rg->rg_owned, 0, 1) == 0)
+      break;
+  }
+  if (rg == NULL) {
+    if ((rg = static_cast<zfile_ring_t *>(calloc(1, sizeof(*rg)))) == NULL)
+      return (NULL);
+    rg->rg_owned = 1;
+    do {
+      head = trace_rings;
+      rg->rg_link = head;
+    } while (atomic_cas_ptr(&trace_rings, head, rg) != head);
+  }
+
+  zt->zt_ring = rg;
+  return (rg);
+}
+
+
+/*
+ * Record event in the calling thread's ring.  Anything not known is -1.
+ * Leaves errno alone, so it can sit between a failed call and the code
+ * reading its errno.
+ */
+static void trace(int event, zoneid_t zoneid, pid_t pid, int err, int arg) {
+  zfile_thread_t *zt = NULL;
+  zfile_ring_t *rg = NULL;
+  zfile_trace_t *tr = NULL;
+  int saved = errno;
+  uint32_t n = 0;
+
+  if (!trace_enabled)
+    return;
+
+  if ((zt = thread_self()) != NULL && (rg = trace_ring(zt)) != NULL) {
+    n = rg->rg_next;
+    tr = &rg->rg_recs[n % ZFILE_TRACE_RECS];
+    tr->tr_time = gethrtime();
+    tr->tr_thread = static_cast<uint32_t>(pthread_self());
+    tr->tr_event = event;
+    tr->tr_zoneid = zoneid;
+    tr->tr_pid = pid;
+    tr->tr_errno = err;
+    tr->tr_arg = arg;
+    membar_producer();
+    rg->rg_next = n + 1;
   }
 
-  return (n);
+  errno = saved;
+}
+
+
+static int thread_template(void) {
+  zfile_thread_t *zt = thread_self();
+
+  if (zt == NULL)
+    return (-1);
+
+  if (zt->zt_tmpl_fd < 0 && (zt->zt_tmpl_fd = init_template()) >= 0)
+    (void) close_on_exec(zt->zt_tmpl_fd);
+
+  return (zt->zt_tmpl_fd);
+}
+
+
+/*
+ * Give the request about to run on this thread timeout_ms to finish, or
+ * with 0 clear any deadline.
+ */
+static void deadline_set(int timeout_ms) {
+  zfile_thread_t *zt = thread_self();
+
+  if (zt == NULL)
+    return;
+  zt->zt_deadline = timeout_ms <= 0 ? 0 :
+      gethrtime() + static_cast<hrtime_t>(timeout_ms) * 1000000;
+}
+
+
+static bool deadline_on(void) {
+  zfile_thread_t *zt = thread_self();
+
+  return (zt != NULL && zt->zt_deadline != 0);
+}
+
+
+/*
+ * For work done on the pool thread itself: whether this thread's deadline
+ * has passed, with errno set to ETIMEDOUT if it has.
+ */
+static bool deadline_passed(void) {
+  zfile_thread_t *zt = thread_self();
+
+  if (zt == NULL || zt->zt_deadline == 0 || gethrtime() < zt->zt_deadline)
+    return (false);
+  errno = ETIMEDOUT;
+  return (true);
+}
+
+
+/*
+ * Wait for a reply on fd, for no longer than this thread's deadline allows.
+ * Returns 0 once fd is readable (at once if there's no deadline), or -1
+ * with errno set, to ETIMEDOUT if time ran out.
+ */
+static int deadline_wait(int fd) {
+  zfile_thread_t *zt = thread_self();
+  struct pollfd pfd;
+  hrtime_t left = 0;
+  int n = 0;
+
+  if (zt == NULL || zt->zt_deadline == 0)
+    return (0);
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  for (;;) {
+    if ((left = zt->zt_deadline - gethrtime()) <= 0) {
+      errno = ETIMEDOUT;
+      return (-1);
+    }
+    pfd.revents = 0;
+    n = poll(&pfd, 1, static_cast<int>((left + 999999) / 1000000));
+    if (n > 0)
+      return (0);
+    if (n < 0 && errno != EINTR)
+      return (-1);
+  }
+}
+
+
+/*
+ * read_full() for the rest of a reply, waiting with deadline_wait() before
+ * each read so that a child that stops halfway can't outlast the deadline.
+ * Returns what was read, short at EOF, or -1 with errno set.
+ */
+static ssize_t deadline_read(int fd, void *ptr, size_t nbytes) {
+  size_t off = 0;
+  ssize_t n = 0;
+
+  while (off < nbytes) {
+    if (deadline_wait(fd) != 0)
+      return (-1);
+    n = read(fd, static_cast<char *>(ptr) + off, nbytes - off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return (-1);
+    if (n == 0)
+      break;
+    off += n;
+  }
+
+  return (off);
+}
+
+
+/*
+ * The errno for a reply that never came, with *sysp set to match:
+ * ETIMEDOUT if the deadline passed, otherwise ECHILD for a child that went
+ * away without answering.
+ */
+static int recv_error(int *sysp) {
+  if (errno == ETIMEDOUT) {
+    *sysp = ZFILE_SYS_POLL;
+    return (ETIMEDOUT);
+  }
+  *sysp = ZFILE_SYS_RECVMSG;
+  return (ECHILD);
+}
+
+
+/*
+ * Lifetime counts for spotting leaks, reported by getStats(): every child
+ * forked has a contract to abandon (zl_contracts) and is reaped, left on
+ * reap_list, or given up on (zl_lost); zl_fds is the descriptors handed to
+ * JS.  Never reset.
+ */
+typedef struct zfile_leaks {
+  volatile uint64_t zl_contracts;
+  volatile uint64_t zl_abandoned;
+  volatile uint64_t zl_contract_leaks;
+  volatile uint64_t zl_reaped;
+  volatile uint64_t zl_lost;
+  uint64_t zl_fds;
+} zfile_leaks_t;
+
+static zfile_leaks_t leak_stats;
+
+
+/*
+ * First thing a child forked through the thread template does is tell the
+ * parent which contract it landed in, sparing the parent a trip through
+ * CTFS_ROOT/process/latest.
+ */
+static void contract_report(int sock) {
+  int32_t id = getctid();
+
+  (void) write_full(sock, &id, sizeof(id));
+}
+
+
+/*
+ * Parent side of contract_report(): abandon the child's contract so that
+ * it is not ours to clean up once the child is gone.  Falls back on the
+ * LWP's latest contract should the child have died before reporting.
+ */
+static void contract_release(int sock) {
+  int32_t id = -1;
+  ctid_t ct = -1;
+  int err = 0;
+
+  atomic_inc_64(&leak_stats.zl_contracts);
+  if (read_full(sock, &id, sizeof(id)) == sizeof(id)) {
+    ct = id;
+  } else if ((err = contract_latest(&ct)) != 0) {
+    ct = -1;
+  }
+
+  if (ct != -1 && (err = contract_abandon_id(ct)) == 0) {
+    atomic_inc_64(&leak_stats.zl_abandoned);
+    return;
+  }
+
+  atomic_inc_64(&leak_stats.zl_contract_leaks);
+  trace(ZFILE_TRACE_CONTRACT_LEAK, -1, -1, err, ct);
+}
+
+
+/*
+ * This thread's stats, zeroed first if a reset happened since it last
+ * recorded anything.
+ */
+static zfile_stats_t *stats_self(void) {
+  zfile_thread_t *zt = thread_self();
+  uint32_t gen = stats_gen;
+
+  if (zt == NULL)
+    return (NULL);
+
+  if (zt->zt_stats.zs_gen != gen) {
+    zt->zt_stats.zs_ops = 0;
+    zt->zt_stats.zs_cache_hits = 0;
+    zt->zt_stats.zs_cache_misses = 0;
+    memset(zt->zt_stats.zs_errors, 0, sizeof(zt->zt_stats.zs_errors));
+    memset(zt->zt_stats.zs_hist, 0, sizeof(zt->zt_stats.zs_hist));
+    membar_producer();
+    zt->zt_stats.zs_gen = gen;
+  }
+
+  return (&zt->zt_stats);
+}
+
+
+static int hist_bucket(uint64_t v) {
+  int msb = 0;
+
+  if (v < ZFILE_HIST_SUB)
+    return (static_cast<int>(v));
+
+  msb = 63 - __builtin_clzll(v);
+  return ((msb - ZFILE_HIST_SUB_BITS + 1) * ZFILE_HIST_SUB +
+          static_cast<int>((v >> (msb - ZFILE_HIST_SUB_BITS)) &
+                           (ZFILE_HIST_SUB - 1)));
+}
+
+
+/* Midpoint of the values that land in bucket b */
+static uint64_t hist_value(int b) {
+  int msb = b / ZFILE_HIST_SUB + ZFILE_HIST_SUB_BITS - 1;
+  uint64_t width = 0;
+
+  if (b < ZFILE_HIST_SUB)
+    return (b);
+
+  width = 1ULL << (msb - ZFILE_HIST_SUB_BITS);
+  return ((1ULL << msb) + (b % ZFILE_HIST_SUB) * width + width / 2);
+}
+
+
+static void stats_time(int phase, hrtime_t ns) {
+  zfile_stats_t *zs = stats_self();
+  zfile_hist_t *zh = NULL;
+
+  if (zs == NULL || ns < 0)
+    return;
+
+  zh = &zs->zs_hist[phase];
+  zh->zh_count++;
+  zh->zh_sum += ns;
+  if ((uint64_t)ns > zh->zh_max)
+    zh->zh_max = ns;
+  zh->zh_bucket[hist_bucket(ns)]++;
+}
+
+
+/* Count a finished request, failed in syscall sys if err is non-zero */
+static void stats_op(int sys, int err) {
+  zfile_stats_t *zs = stats_self();
+
+  if (zs == NULL)
+    return;
+
+  zs->zs_ops++;
+  if (err != 0)
+    zs->zs_errors[sys >= 0 && sys < ZFILE_SYS_MAX ? sys : ZFILE_SYS_ZFILE]++;
+}
+
+
+/*
+ * Add up every thread's stats into out.  The counters are read while their
+ * owners may be bumping them, so the totals are only approximately
+ * consistent with each other; that is fine for monitoring.
+ */
+static void stats_sum(zfile_stats_t *out) {
+  zfile_stats_t *zs = NULL;
+  uint32_t gen = stats_gen;
+  int i = 0;
+  int j = 0;
+
+  memset(out, 0, sizeof(*out));
+  pthread_mutex_lock(&stats_lock);
+  for (zs = stats_list; zs != NULL; zs = zs->zs_next) {
+    if (zs->zs_gen != gen)
+      continue;
+    membar_consumer();
+
+    out->zs_ops += zs->zs_ops;
+    out->zs_cache_hits += zs->zs_cache_hits;
+    out->zs_cache_misses += zs->zs_cache_misses;
+    for (i = 0; i < ZFILE_SYS_MAX; i++)
+      out->zs_errors[i] += zs->zs_errors[i];
+    for (i = 0; i < ZFILE_PHASE_MAX; i++) {
+      zfile_hist_t *src = &zs->zs_hist[i];
+      zfile_hist_t *dst = &out->zs_hist[i];
+
+      dst->zh_count += src->zh_count;
+      dst->zh_sum += src->zh_sum;
+      if (src->zh_max > dst->zh_max)
+        dst->zh_max = src->zh_max;
+      for (j = 0; j < ZFILE_HIST_BUCKETS; j++)
+        dst->zh_bucket[j] += src->zh_bucket[j];
+    }
+  }
+  pthread_mutex_unlock(&stats_lock);
+}
+
+
+/* The value at quantile q (0 < q <= 1) of zh, in nanoseconds */
+static uint64_t hist_percentile(const zfile_hist_t *zh, double q) {
+  uint64_t want = 0;
+  uint64_t seen = 0;
+  uint64_t v = 0;
+  int b = 0;
+
+  if (zh->zh_count == 0)
+    return (0);
+
+  want = static_cast<uint64_t>(q * zh->zh_count + 0.5);
+  if (want == 0)
+    want = 1;
+  for (b = 0; b < ZFILE_HIST_BUCKETS; b++) {
+    if ((seen += zh->zh_bucket[b]) >= want)
+      break;
+  }
+
+  v = hist_value(b);
+  return (v > zh->zh_max ? zh->zh_max : v);
+}
+
+
+/*
+ * Receive up to maxfds descriptors alongside nbytes of data.  *nrecv is set
+ * to the number of descriptors actually received.
+ */
+static ssize_t read_fds(int fd, void *ptr, size_t nbytes,
+                        int *recvfds, int maxfds, int *nrecv) {
+  struct msghdr msg;
+  struct iovec iov[1];
+  ssize_t n = -1;
+  union {
+    struct cmsghdr cm;
+    char control[CMSG_SPACE(sizeof(int) * ZFILE_FDS_PER_MSG)];
+  } control_un;
+  struct cmsghdr *cmptr = NULL;
+  int count = 0;
+  int i = 0;
+
+  *nrecv = 0;
+  if (maxfds > ZFILE_FDS_PER_MSG)
+    maxfds = ZFILE_FDS_PER_MSG;
+
+  msg.msg_control = control_un.control;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * maxfds);
+  msg.msg_name = NULL;
+  msg.msg_namelen = 0;
+
+  iov[0].iov_base = ptr;
+  iov[0].iov_len = nbytes;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 1;
+
+  if ((n = recvmsg(fd, &msg, 0)) <= 0) {
+    return (n);
+  }
+
+  if ((cmptr = CMSG_FIRSTHDR(&msg)) != NULL &&
+      cmptr->cmsg_len > CMSG_LEN(0)) {
+    count = (cmptr->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if (cmptr->cmsg_level != SOL_SOCKET ||
+        cmptr->cmsg_type != SCM_RIGHTS || count > maxfds) {
+      // Don't leak descriptors we won't be handing back
+      if (cmptr->cmsg_level == SOL_SOCKET &&
+          cmptr->cmsg_type == SCM_RIGHTS) {
+        for (i = 0; i < count; i++)
+          (void) close((reinterpret_cast<int *>(CMSG_DATA(cmptr)))[i]);
+      }
+      errno = EINVAL;
+      return (-1);
+    }
+
+    for (i = 0; i < count; i++)
+      recvfds[i] = (reinterpret_cast<int *>(CMSG_DATA(cmptr)))[i];
+    *nrecv = count;
+  }
+
+  return (n);
+}
+
+
+static ssize_t read_fd(int fd, void *ptr, size_t nbytes, int *recvfd) {
+  int nrecv = 0;
+  ssize_t n = read_fds(fd, ptr, nbytes, recvfd, 1, &nrecv);
+
+  if (nrecv == 0)
+    *recvfd = -1;
+  return (n);
+}
+
+
+/*
+ * Send nbytes of data with up to ZFILE_FDS_PER_MSG descriptors attached.
+ */
+static ssize_t write_fds(int fd, void *ptr, size_t nbytes,
+                         const int *sendfds, int nfds) {
+  struct msghdr msg;
+  struct iovec iov[1];
+  union {
+    struct cmsghdr cm;
+    char control[CMSG_SPACE(sizeof(int) * ZFILE_FDS_PER_MSG)];
+  } control_un;
+  struct cmsghdr *cmptr = NULL;
+  int i = 0;
+
+  if (nfds > ZFILE_FDS_PER_MSG) {
+    errno = EINVAL;
+    return (-1);
+  }
+
+  if (nfds > 0) {
+    msg.msg_control = control_un.control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+    cmptr = CMSG_FIRSTHDR(&msg);
+    cmptr->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    cmptr->cmsg_level = SOL_SOCKET;
+    cmptr->cmsg_type = SCM_RIGHTS;
+    for (i = 0; i < nfds; i++)
+      (reinterpret_cast<int *>(CMSG_DATA(cmptr)))[i] = sendfds[i];
+  } else {
+    msg.msg_control = NULL;
+    msg.msg_controllen = 0;
+  }
+
+  msg.msg_name = NULL;
+  msg.msg_namelen = 0;
+  iov[0].iov_base = ptr;
+  iov[0].iov_len = nbytes;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 1;
+
+  msg.msg_flags = 0;
+
+  return (sendmsg(fd, &msg, 0));
+}
+
+
+static ssize_t write_fd(int fd, void *ptr, size_t nbytes, int sendfd) {
+  return (write_fds(fd, ptr, nbytes, &sendfd, sendfd >= 0 ? 1 : 0));
+}
+
+
+static ssize_t read_full(int fd, void *ptr, size_t nbytes) {
+  size_t off = 0;
+  ssize_t n = 0;
+
+  while (off < nbytes) {
+    n = read(fd, static_cast<char *>(ptr) + off, nbytes - off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return (-1);
+    if (n == 0)
+      break;
+    off += n;
+  }
+
+  return (off);
+}
+
+
+static ssize_t write_full(int fd, const void *ptr, size_t nbytes) {
+  size_t off = 0;
+  ssize_t n = 0;
+
+  while (off < nbytes) {
+    n = write(fd, static_cast<const char *>(ptr) + off, nbytes - off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return (-1);
+    off += n;
+  }
+
+  return (off);
+}
+
+
+/*
+ * Read one zfile_resp_t, along with the fd riding on it if any.  Returns -1
+ * if the peer went away before a whole reply arrived.
+ */
+static int resp_recv(int sock, zfile_resp_t *resp, int *fdp) {
+  ssize_t n = 0;
+  int fd = -1;
+
+  *fdp = -1;
+  if (deadline_wait(sock) != 0)
+    return (-1);
+  if ((n = read_fd(sock, resp, sizeof(*resp), &fd)) <= 0)
+    return (-1);
+  if ((size_t)n < sizeof(*resp) &&
+      deadline_read(sock, reinterpret_cast<char *>(resp) + n,
+                    sizeof(*resp) - n) != (ssize_t)(sizeof(*resp) - n)) {
+    if (fd >= 0)
+      (void) close(fd);
+    return (-1);
+  }
+
+  if (resp->zp_errno != 0 && fd >= 0) {
+    (void) close(fd);
+    fd = -1;
+  }
+
+  *fdp = fd;
+  return (0);
+}
+
+
+static int open_flags(int mode) {
+  switch (mode) {
+    case MODE_R:
+      return (O_RDONLY);
+    case MODE_W:
+      return (O_WRONLY | O_CREAT | O_TRUNC);
+    case MODE_A:
+      return (O_WRONLY | O_APPEND | O_CREAT);
+    default:
+      return (-1);
+  }
+}
+
+
+/*
+ * Apply ZFILE_HINT_* to fd.  These are only advice: a filesystem that
+ * doesn't take it (ZFS has no directio(), for one) is no reason to fail the
+ * open, so errors are ignored.  Only makes system calls, so is safe in a
+ * vforkx() child.
+ */
+static void open_hint(int fd, int hints) {
+  if (hints & ZFILE_HINT_SEQUENTIAL)
+    (void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  if (hints & ZFILE_HINT_WILLNEED)
+    (void) posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  if (hints & ZFILE_HINT_DIRECTIO)
+    (void) directio(fd, DIRECTIO_ON);
+}
+
+
+/*
+ * Read all of fd, which must be no more than max bytes long, into a buffer
+ * from malloc().  The size from fstat() is only a first guess, as the file
+ * may be growing or be something like a /proc file that has none.  Returns
+ * 0, or -1 with errno and *sysp set; EFBIG if the file is over max.
+ */
+static int read_whole(int fd, size_t max, char **bufp, size_t *lenp,
+                      int *sysp) {
+  struct stat st;
+  char *buf = NULL;
+  char *nbuf = NULL;
+  size_t cap = 0;
+  size_t len = 0;
+  ssize_t n = 0;
+
+  if (fstat(fd, &st) != 0) {
+    *sysp = ZFILE_SYS_FSTAT;
+    return (-1);
+  }
+  if (S_ISDIR(st.st_mode)) {
+    *sysp = ZFILE_SYS_READ;
+    errno = EISDIR;
+    return (-1);
+  }
+
+  // One byte beyond the expected size, so that EOF is seen in one read
+  cap = st.st_size > 0 ? (size_t)st.st_size + 1 : 4096;
+  if (cap > max + 1)
+    cap = max + 1;
+  if ((buf = static_cast<char *>(malloc(cap))) == NULL) {
+    *sysp = ZFILE_SYS_READ;
+    errno = ENOMEM;
+    return (-1);
+  }
+
+  for (;;) {
+    if (len == cap) {
+      if (cap > max)
+        break;
+      cap = cap * 2 > max + 1 ? max + 1 : cap * 2;
+      if ((nbuf = static_cast<char *>(realloc(buf, cap))) == NULL) {
+        free(buf);
+        *sysp = ZFILE_SYS_READ;
+        errno = ENOMEM;
+        return (-1);
+      }
+      buf = nbuf;
+    }
+
+    n = pread(fd, buf + len, cap - len, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      free(buf);
+      *sysp = ZFILE_SYS_READ;
+      return (-1);
+    }
+    if (n == 0)
+      break;
+    len += n;
+  }
+
+  if (len > max) {
+    free(buf);
+    *sysp = ZFILE_SYS_READ;
+    errno = EFBIG;
+    return (-1);
+  }
+
+  *bufp = buf;
+  *lenp = len;
+  return (0);
+}
+
+
+/*
+ * Map all of fd read-only, applying the ZFILE_ADVISE_* hint advice.  An
+ * empty file gives a NULL mapping of length 0.  Returns 0, or -1 with errno
+ * and *sysp set.
+ */
+static int map_whole(int fd, int advice, void **mapp, size_t *lenp,
+                     int *sysp) {
+  struct stat st;
+  void *map = NULL;
+  int how = MADV_NORMAL;
+
+  if (fstat(fd, &st) != 0) {
+    *sysp = ZFILE_SYS_FSTAT;
+    return (-1);
+  }
+  if (!S_ISREG(st.st_mode)) {
+    *sysp = ZFILE_SYS_MMAP;
+    errno = S_ISDIR(st.st_mode) ? EISDIR : ENODEV;
+    return (-1);
+  }
+  if (st.st_size > ZFILE_MMAP_MAX) {
+    *sysp = ZFILE_SYS_MMAP;
+    errno = EFBIG;
+    return (-1);
+  }
+
+  *mapp = NULL;
+  *lenp = 0;
+  if (st.st_size == 0)
+    return (0);
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    *sysp = ZFILE_SYS_MMAP;
+    return (-1);
+  }
+
+  switch (advice) {
+    case ZFILE_ADVISE_SEQUENTIAL:
+      how = MADV_SEQUENTIAL;
+      break;
+    case ZFILE_ADVISE_RANDOM:
+      how = MADV_RANDOM;
+      break;
+    case ZFILE_ADVISE_WILLNEED:
+      how = MADV_WILLNEED;
+      break;
+    default:
+      how = MADV_NORMAL;
+      break;
+  }
+  if (how != MADV_NORMAL)
+    (void) madvise(static_cast<caddr_t>(map), st.st_size, how);
+
+  *mapp = map;
+  *lenp = st.st_size;
+  return (0);
+}
+
+
+/*
+ * Where the nlen byte needle first occurs in the n bytes at hay, or NULL.
+ * memchr() does the scanning, and is vectorized in libc; candidates are
+ * then confirmed with memcmp().
+ */
+static const char *needle_find(const char *hay, size_t n, const char *needle,
+                               size_t nlen) {
+  const char *p = hay;
+  const char *last = NULL;
+
+  if (nlen == 0 || nlen > n)
+    return (NULL);
+
+  last = hay + (n - nlen);
+  while (p <= last) {
+    p = static_cast<const char *>(memchr(p, needle[0], last - p + 1));
+    if (p == NULL)
+      return (NULL);
+    if (memcmp(p + 1, needle + 1, nlen - 1) == 0)
+      return (p);
+    p++;
+  }
+
+  return (NULL);
+}
+
+
+/*
+ * Record the len byte line at line, which starts at file offset off, as a
+ * match.  Returns -1 with errno set if out of memory, 1 if a limit has been
+ * reached and the search should stop, otherwise 0.
+ */
+static int scan_record(zfile_scan_t *zc, off_t off, const char *line,
+                       size_t len) {
+  zfile_match_t *zm = NULL;
+
+  if (zc->zc_nmatches == zc->zc_limit ||
+      (zc->zc_keep && zc->zc_textlen + len > ZFILE_SCAN_TEXT_MAX)) {
+    zc->zc_truncated = 1;
+    return (1);
+  }
+
+  if (zc->zc_nmatches == zc->zc_cap) {
+    int cap = zc->zc_cap == 0 ? 64 : zc->zc_cap * 2;
+    void *p = realloc(zc->zc_matches, cap * sizeof(zfile_match_t));
+    if (p == NULL)
+      return (-1);
+    zc->zc_matches = static_cast<zfile_match_t *>(p);
+    zc->zc_cap = cap;
+  }
+
+  if (zc->zc_keep && zc->zc_textlen + len > zc->zc_textcap) {
+    size_t cap = zc->zc_textcap == 0 ? 4096 : zc->zc_textcap;
+    while (cap < zc->zc_textlen + len)
+      cap *= 2;
+    void *p = realloc(zc->zc_text, cap);
+    if (p == NULL)
+      return (-1);
+    zc->zc_text = static_cast<char *>(p);
+    zc->zc_textcap = cap;
+  }
+
+  zm = &zc->zc_matches[zc->zc_nmatches++];
+  zm->zm_off = off;
+  zm->zm_text = zc->zc_textlen;
+  zm->zm_len = len;
+  if (zc->zc_keep) {
+    memcpy(zc->zc_text + zc->zc_textlen, line, len);
+    zc->zc_textlen += len;
+  }
+
+  return (0);
+}
+
+
+/*
+ * Search the len bytes at region, which start a line at file offset base,
+ * recording each line holding any needle.  Rather than testing every line,
+ * this jumps straight to the next occurrence of whichever needle comes
+ * first, remembering the others' so each needle is scanned for only once
+ * per region.  Returns as scan_record() does.
+ */
+static int scan_region(zfile_scan_t *zc, const char *region, size_t len,
+                       off_t base) {
+  size_t pos = 0;
+  int i = 0;
+  int rv = 0;
+
+  for (i = 0; i < zc->zc_nneedles; i++) {
+    const char *p = needle_find(region, len, zc->zc_needles[i],
+                                zc->zc_nlens[i]);
+    zc->zc_next[i] = p == NULL ? len : p - region;
+  }
+
+  while (pos < len) {
+    size_t best = len;
+    size_t start = 0;
+    const char *nl = NULL;
+
+    for (i = 0; i < zc->zc_nneedles; i++) {
+      if (zc->zc_next[i] < pos) {
+        const char *p = needle_find(region + pos, len - pos,
+                                    zc->zc_needles[i], zc->zc_nlens[i]);
+        zc->zc_next[i] = p == NULL ? len : p - region;
+      }
+      if (zc->zc_next[i] < best)
+        best = zc->zc_next[i];
+    }
+    if (best == len)
+      break;
+
+    start = best;
+    while (start > pos && region[start - 1] != '\n')
+      start--;
+    nl = static_cast<const char *>(memchr(region + best, '\n', len - best));
+    best = nl == NULL ? len : nl - region;
+
+    if ((rv = scan_record(zc, base + start, region + start,
+                          best - start)) != 0)
+      return (rv);
+    pos = best + 1;
+  }
+
+  return (0);
+}
+
+
+/*
+ * Search all of fd for the needles in zc.  The file is read a chunk at a
+ * time into the aligned chunk half of the thread buffer, and each chunk's
+ * complete lines scanned before the partial one at its end is moved down
+ * to sit just below the chunk half, in front of the next.  As in hash_fd(),
+ * only a regular file is read, and the deadline is checked between reads.
+ * Returns 0, or -1 with errno and *sysp set.
+ */
+static int scan_fd(int fd, zfile_scan_t *zc, int *sysp) {
+  struct stat st;
+  char *buf = NULL;
+  char *chunk = NULL;
+  size_t carry = 0;
+  off_t off = 0;
+  int rv = 0;
+
+  if (fstat(fd, &st) != 0) {
+    *sysp = ZFILE_SYS_FSTAT;
+    return (-1);
+  }
+  if (!S_ISREG(st.st_mode)) {
+    *sysp = ZFILE_SYS_READ;
+    errno = S_ISDIR(st.st_mode) ? EISDIR : ENODEV;
+    return (-1);
+  }
+  if ((buf = thread_buffer()) == NULL) {
+    *sysp = ZFILE_SYS_READ;
+    return (-1);
+  }
+  chunk = buf + ZFILE_SCAN_CHUNK;
+
+  for (;;) {
+    char *region = NULL;
+    ssize_t n = 0;
+    size_t have = 0;
+    size_t end = 0;
+
+    while ((n = pread(fd, chunk, ZFILE_SCAN_CHUNK, off)) < 0 &&
+           errno == EINTR) {}
+    if (n < 0) {
+      *sysp = ZFILE_SYS_READ;
+      return (-1);
+    }
+
+    // Scan up to the last newline, or everything at EOF, or split a line
+    // that would no longer fit below the chunk half with the next one
+    region = chunk - carry;
+    have = carry + n;
+    end = have;
+    if (n != 0) {
+      while (end > 0 && region[end - 1] != '\n')
+        end--;
+      if (have - end >= ZFILE_SCAN_CHUNK)
+        end = have;
+    }
+
+    if (end > 0 && (rv = scan_region(zc, region, end, off - carry)) != 0) {
+      if (rv < 0) {
+        *sysp = ZFILE_SYS_READ;
+        return (-1);
+      }
+      return (0);
+    }
+
+    carry = have - end;
+    memmove(chunk - carry, region + end, carry);
+    off += n;
+    if (n == 0)
+      break;
+    if (deadline_passed()) {
+      *sysp = ZFILE_SYS_READ;
+      return (-1);
+    }
+  }
+
+  return (0);
+}
+
+
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t xxh_rotl(uint64_t x, int r) {
+  return ((x << r) | (x >> (64 - r)));
+}
+
+
+static uint64_t xxh_read64(const uint8_t *p) {
+  uint64_t v = 0;
+
+  for (int i = 7; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return (v);
+}
+
+
+static uint32_t xxh_read32(const uint8_t *p) {
+  return (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+  acc += input * XXH_PRIME2;
+  acc = xxh_rotl(acc, 31);
+  return (acc * XXH_PRIME1);
+}
+
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+  acc ^= xxh_round(0, v);
+  return (acc * XXH_PRIME1 + XXH_PRIME4);
+}
+
+
+static void xxh64_init(zfile_xxh64_t *xh) {
+  memset(xh, 0, sizeof(*xh));
+  xh->xh_v[0] = XXH_PRIME1 + XXH_PRIME2;
+  xh->xh_v[1] = XXH_PRIME2;
+  xh->xh_v[2] = 0;
+  xh->xh_v[3] = -XXH_PRIME1;
+}
+
+
+static void xxh64_stripe(zfile_xxh64_t *xh, const uint8_t *p) {
+  for (int i = 0; i < 4; i++)
+    xh->xh_v[i] = xxh_round(xh->xh_v[i], xxh_read64(p + i * 8));
+}
+
+
+static void xxh64_update(zfile_xxh64_t *xh, const uint8_t *p, size_t len) {
+  const uint8_t *end = p + len;
+
+  xh->xh_total += len;
+
+  if (xh->xh_memlen + len < sizeof(xh->xh_mem)) {
+    memcpy(xh->xh_mem + xh->xh_memlen, p, len);
+    xh->xh_memlen += len;
+    return;
+  }
+
+  if (xh->xh_memlen != 0) {
+    size_t fill = sizeof(xh->xh_mem) - xh->xh_memlen;
+    memcpy(xh->xh_mem + xh->xh_memlen, p, fill);
+    xxh64_stripe(xh, xh->xh_mem);
+    p += fill;
+    xh->xh_memlen = 0;
+  }
+
+  while (end - p >= 32) {
+    xxh64_stripe(xh, p);
+    p += 32;
+  }
+
+  memcpy(xh->xh_mem, p, end - p);
+  xh->xh_memlen = end - p;
+}
+
+
+static uint64_t xxh64_final(const zfile_xxh64_t *xh) {
+  const uint8_t *p = xh->xh_mem;
+  const uint8_t *end = p + xh->xh_memlen;
+  uint64_t h = 0;
+
+  if (xh->xh_total >= 32) {
+    h = xxh_rotl(xh->xh_v[0], 1) + xxh_rotl(xh->xh_v[1], 7) +
+        xxh_rotl(xh->xh_v[2], 12) + xxh_rotl(xh->xh_v[3], 18);
+    for (int i = 0; i < 4; i++)
+      h = xxh_merge(h, xh->xh_v[i]);
+  } else {
+    h = xh->xh_v[2] + XXH_PRIME5;
+  }
+  h += xh->xh_total;
+
+  for (; end - p >= 8; p += 8) {
+    h ^= xxh_round(0, xxh_read64(p));
+    h = xxh_rotl(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+  }
+  if (end - p >= 4) {
+    h ^= xxh_read32(p) * XXH_PRIME1;
+    h = xxh_rotl(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= *p * XXH_PRIME5;
+    h = xxh_rotl(h, 11) * XXH_PRIME1;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_PRIME2;
+  h ^= h >> 29;
+  h *= XXH_PRIME3;
+  h ^= h >> 32;
+  return (h);
+}
+
+
+/*
+ * Hash all of fd with algo, a ZFILE_HASH_*, reading it through the thread
+ * buffer.  The digest goes to digest (in the usual byte order: XXH64 is
+ * big-endian, as it's conventionally printed) and its length to *dlenp,
+ * with the bytes hashed in *sizep and the file's mtime in *mtimep.  Only
+ * a regular file is hashed, and the deadline is checked between reads.
+ * Returns 0, or -1 with errno and *sysp set.
+ */
+static int hash_fd(int fd, int algo, uint8_t *digest, size_t *dlenp,
+                   off_t *sizep, struct timespec *mtimep, int *sysp) {
+  struct stat st;
+  SHA2_CTX sha;
+  zfile_xxh64_t xh;
+  char *buf = NULL;
+  off_t off = 0;
+  ssize_t n = 0;
+
+  if (fstat(fd, &st) != 0) {
+    *sysp = ZFILE_SYS_FSTAT;
+    return (-1);
+  }
+  // A device or FIFO could go on (or keep us waiting) forever
+  if (!S_ISREG(st.st_mode)) {
+    *sysp = ZFILE_SYS_READ;
+    errno = S_ISDIR(st.st_mode) ? EISDIR : ENODEV;
+    return (-1);
+  }
+  if ((buf = thread_buffer()) == NULL) {
+    *sysp = ZFILE_SYS_READ;
+    return (-1);
+  }
+
+  if (algo == ZFILE_HASH_SHA256) {
+    SHA2Init(SHA256, &sha);
+  } else {
+    xxh64_init(&xh);
+  }
+
+  for (;;) {
+    while ((n = pread(fd, buf, ZFILE_THREAD_BUF, off)) < 0 &&
+           errno == EINTR) {}
+    if (n < 0) {
+      *sysp = ZFILE_SYS_READ;
+      return (-1);
+    }
+    if (n == 0)
+      break;
+
+    if (algo == ZFILE_HASH_SHA256) {
+      SHA2Update(&sha, buf, n);
+    } else {
+      xxh64_update(&xh, reinterpret_cast<uint8_t *>(buf), n);
+    }
+    off += n;
+    if (deadline_passed()) {
+      *sysp = ZFILE_SYS_READ;
+      return (-1);
+    }
+  }
+
+  if (algo == ZFILE_HASH_SHA256) {
+    SHA2Final(digest, &sha);
+    *dlenp = 32;
+  } else {
+    uint64_t h = xxh64_final(&xh);
+    for (int i = 7; i >= 0; i--, h >>= 8)
+      digest[i] = h & 0xff;
+    *dlenp = 8;
+  }
+
+  *sizep = off;
+  *mtimep = st.st_mtim;
+  return (0);
+}
+
+
+/*
+ * Copy the rest of in to out: with sendfile(3EXT) where the pair allows it,
+ * otherwise through the thread buffer.  The deadline is checked after each
+ * piece.  Returns the bytes copied, or -1 with errno set and *sysp naming
+ * the call that failed.
+ */
+static int64_t copy_fd(int in, int out, int *sysp) {
+  off_t off = 0;
+  ssize_t n = 0;
+  int64_t total = 0;
+  char *buf = NULL;
+
+  for (;;) {
+    n = sendfile(out, in, &off, ZFILE_COPY_CHUNK);
+    if (n == 0)
+      return (static_cast<int64_t>(off));
+    if (deadline_passed()) {
+      *sysp = ZFILE_SYS_SENDFILE;
+      return (-1);
+    }
+    if (n > 0 || errno == EINTR || errno == EAGAIN)
+      continue;
+    if (off == 0 && (errno == EINVAL || errno == ENOTSUP ||
+                     errno == EOPNOTSUPP || errno == EAFNOSUPPORT))
+      break;
+    *sysp = ZFILE_SYS_SENDFILE;
+    return (-1);
+  }
+
+  if ((buf = thread_buffer()) == NULL) {
+    *sysp = ZFILE_SYS_READ;
+    return (-1);
+  }
+  for (;;) {
+    if ((n = read(in, buf, ZFILE_THREAD_BUF)) < 0) {
+      if (errno == EINTR)
+        continue;
+      *sysp = ZFILE_SYS_READ;
+      return (-1);
+    }
+    if (n == 0)
+      return (total);
+    if (write_full(out, buf, n) < 0) {
+      *sysp = ZFILE_SYS_WRITE;
+      return (-1);
+    }
+    total += n;
+    if (deadline_passed()) {
+      *sysp = ZFILE_SYS_READ;
+      return (-1);
+    }
+  }
+}
+
+
+/*
+ * Replace path, in the current zone, with the len bytes at data: they are
+ * written to a new file alongside path that is then rename()d over it, so
+ * readers see either the old contents or the new, never a mix.  An existing
+ * file's owner and permissions carry over to the replacement, and only a
+ * regular file is replaced: a symlink at path is refused rather than
+ * followed.  With
+ * ZFILE_WRITE_FSYNC the data and the rename are flushed before returning.
+ * Returns 0, or -1 with errno and *sysp set.
+ */
+static int atomic_write(const char *path, const char *data, size_t len,
+                        int flags, int *sysp) {
+  char tmp[PATH_MAX];
+  char dir[PATH_MAX];
+  struct stat st;
+  const char *slash = NULL;
+  int have_st = 0;
+  int tries = 0;
+  int fd = -1;
+  int dfd = -1;
+  int err = 0;
+
+  have_st = (lstat(path, &st) == 0);
+  if (!have_st && errno != ENOENT) {
+    *sysp = ZFILE_SYS_LSTAT;
+    return (-1);
+  }
+  if (have_st && !S_ISREG(st.st_mode)) {
+    *sysp = ZFILE_SYS_RENAME;
+    errno = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+    return (-1);
+  }
+
+  for (tries = 0; fd < 0; tries++) {
+    if (snprintf(tmp, sizeof(tmp), "%s.zfile-%d-%llx", path, (int)getpid(),
+                 gethrtime()) >= (int)sizeof(tmp)) {
+      *sysp = ZFILE_SYS_OPEN;
+      errno = ENAMETOOLONG;
+      return (-1);
+    }
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW,
+              have_st ? (st.st_mode & 07777) : 0644);
+    if (fd < 0 && (errno != EEXIST || tries == 3)) {
+      *sysp = ZFILE_SYS_OPEN;
+      return (-1);
+    }
+  }
+
+  if (have_st && fchown(fd, st.st_uid, st.st_gid) != 0) {
+    *sysp = ZFILE_SYS_FCHOWN;
+  } else if (have_st && fchmod(fd, st.st_mode & 07777) != 0) {
+    *sysp = ZFILE_SYS_FCHMOD;
+  } else if (write_full(fd, data, len) < 0) {
+    *sysp = ZFILE_SYS_WRITE;
+  } else if ((flags & ZFILE_WRITE_FSYNC) && fsync(fd) != 0) {
+    *sysp = ZFILE_SYS_FSYNC;
+  } else {
+    err = close(fd);
+    fd = -1;
+    if (err != 0) {
+      *sysp = ZFILE_SYS_WRITE;
+    } else if (rename(tmp, path) != 0) {
+      *sysp = ZFILE_SYS_RENAME;
+    } else {
+      if (flags & ZFILE_WRITE_FSYNC) {
+        if ((slash = strrchr(path, '/')) == NULL) {
+          (void) strlcpy(dir, ".", sizeof(dir));
+        } else {
+          (void) strlcpy(dir, path, sizeof(dir));
+          dir[slash == path ? 1 : slash - path] = '\0';
+        }
+        if ((dfd = open(dir, O_RDONLY)) >= 0) {
+          (void) fsync(dfd);
+          (void) close(dfd);
+        }
+      }
+      return (0);
+    }
+  }
+
+  err = errno;
+  if (fd >= 0)
+    (void) close(fd);
+  (void) unlink(tmp);
+  errno = err;
+  return (-1);
+}
+
+
+/*
+ * Bytes of request that path makes for query op, including the NUL: two
+ * strings' worth for ZFILE_OP_RENAME, one for the rest.
+ */
+static size_t query_path_len(int op, const char *path) {
+  size_t len = strlen(path) + 1;
+
+  if (op == ZFILE_OP_RENAME)
+    len += strlen(path + len) + 1;
+  return (len);
+}
+
+
+/*
+ * Run a ZFILE_OP_STAT or ZFILE_OP_READDIR query for path in the current
+ * zone, leaving the result in a buffer from malloc(): a zfile_stat_t from
+ * lstat(), or the names in the directory but for "." and "..", each NUL
+ * terminated.  As with opens, this is done inside the zone so that path,
+ * symlinks and all, resolves as the zone sees it, and lstat() does not
+ * follow a final symlink.  Returns 0, or -1 with errno and *sysp set.
+ */
+static int query_run(int op, const char *path, char **bufp, size_t *lenp,
+                     int *sysp) {
+  struct stat st;
+  zfile_stat_t zi;
+  struct dirent *de = NULL;
+  DIR *dir = NULL;
+  char *buf = NULL;
+  size_t len = 0;
+  size_t cap = 0;
+  size_t n = 0;
+  int _errno = 0;
+
+  *bufp = NULL;
+  *lenp = 0;
+
+  if (op == ZFILE_OP_RENAME) {
+    *sysp = ZFILE_SYS_RENAME;
+    return (rename(path, path + strlen(path) + 1));
+  }
+  if (op == ZFILE_OP_UNLINK) {
+    *sysp = ZFILE_SYS_UNLINK;
+    return (unlink(path));
+  }
+
+  if (op == ZFILE_OP_STAT) {
+    *sysp = ZFILE_SYS_LSTAT;
+    if (lstat(path, &st) != 0)
+      return (-1);
+
+    memset(&zi, 0, sizeof(zi));
+    zi.zi_dev = st.st_dev;
+    zi.zi_ino = st.st_ino;
+    zi.zi_size = st.st_size;
+    zi.zi_blocks = st.st_blocks;
+    zi.zi_mode = st.st_mode;
+    zi.zi_nlink = st.st_nlink;
+    zi.zi_uid = st.st_uid;
+    zi.zi_gid = st.st_gid;
+    zi.zi_atime[0] = st.st_atim.tv_sec;
+    zi.zi_atime[1] = st.st_atim.tv_nsec;
+    zi.zi_mtime[0] = st.st_mtim.tv_sec;
+    zi.zi_mtime[1] = st.st_mtim.tv_nsec;
+    zi.zi_ctime[0] = st.st_ctim.tv_sec;
+    zi.zi_ctime[1] = st.st_ctim.tv_nsec;
+
+    if ((buf = static_cast<char *>(malloc(sizeof(zi)))) == NULL)
+      return (-1);
+    memcpy(buf, &zi, sizeof(zi));
+    *bufp = buf;
+    *lenp = sizeof(zi);
+    return (0);
+  }
+
+  *sysp = ZFILE_SYS_READDIR;
+  if (op != ZFILE_OP_READDIR) {
+    errno = EINVAL;
+    return (-1);
+  }
+  if ((dir = opendir(path)) == NULL)
+    return (-1);
+
+  // Only ever run in a single threaded child or agent, so readdir() is fine
+  for (;;) {
+    errno = 0;
+    if ((de = readdir(dir)) == NULL) {  // NOLINT(runtime/threadsafe_fn)
+      _errno = errno;
+      break;
+    }
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+      continue;
+
+    n = strlen(de->d_name) + 1;
+    if (len + n > ZFILE_QUERY_MAX) {
+      _errno = EFBIG;
+      break;
+    }
+    if (len + n > cap) {
+      void *p = NULL;
+      cap = cap == 0 ? 4096 : cap * 2;
+      if ((p = realloc(buf, cap)) == NULL) {
+        _errno = ENOMEM;
+        break;
+      }
+      buf = static_cast<char *>(p);
+    }
+    memcpy(buf + len, de->d_name, n);
+    len += n;
+  }
+  (void) closedir(dir);
+
+  if (_errno != 0) {
+    free(buf);
+    errno = _errno;
+    return (-1);
+  }
+
+  *bufp = buf;
+  *lenp = len;
+  return (0);
+}
+
+
+/*
+ * Send the outcome of query_run() on sock: resp, with the result's length
+ * in zp_value, then the result itself.
+ */
+static int query_send(int sock, zfile_resp_t *resp, const char *buf,
+                      size_t len) {
+  resp->zp_value = len;
+  if (write_full(sock, resp, sizeof(*resp)) < 0)
+    return (-1);
+  if (len > 0 && write_full(sock, buf, len) < 0)
+    return (-1);
+  return (0);
+}
+
+
+/*
+ * Parent side of query_send(), once resp has been read: read the result
+ * that follows a successful reply.  Returns -1 on a transport failure.
+ */
+static int query_recv(int sock, const zfile_resp_t *resp, char **bufp,
+                      size_t *lenp) {
+  char *buf = NULL;
+
+  *bufp = NULL;
+  *lenp = 0;
+  if (resp->zp_errno != 0 || resp->zp_value == 0)
+    return (0);
+  if (resp->zp_value < 0 || resp->zp_value > ZFILE_QUERY_MAX)
+    return (-1);
+
+  if ((buf = static_cast<char *>(malloc(resp->zp_value))) == NULL)
+    return (-1);
+  if (deadline_read(sock, buf, resp->zp_value) != resp->zp_value) {
+    free(buf);
+    return (-1);
+  }
+
+  *bufp = buf;
+  *lenp = resp->zp_value;
+  return (0);
+}
+
+
+/*
+ * Child side of a batch: open every entry in the current zone and send the
+ * results back ZFILE_FDS_PER_MSG entries at a time, as an int32_t errno per
+ * entry with the fds of the entries that opened attached in order.
+ */
+static int batch_open(int sock, const char *buf, size_t len, uint32_t count) {
+  int32_t errs[ZFILE_FDS_PER_MSG];
+  int fds[ZFILE_FDS_PER_MSG];
+  const char *end = buf + len;
+  const char *p = buf + count * sizeof(int32_t);
+  const char *nul = NULL;
+  int32_t mode = 0;
+  uint32_t i = 0;
+  int flags = 0;
+  int nfds = 0;
+  int rc = 0;
+  int j = 0;
+  int k = 0;
+
+  if (count * sizeof(int32_t) > len)
+    return (-1);
+
+  while (i < count) {
+    for (k = 0, nfds = 0; k < ZFILE_FDS_PER_MSG && i < count; k++, i++) {
+      memcpy(&mode, buf + i * sizeof(int32_t), sizeof(mode));
+      nul = p < end ?
+          static_cast<const char *>(memchr(p, '\0', end - p)) : NULL;
+
+      errs[k] = 0;
+      if (nul == NULL || (flags = open_flags(mode)) < 0) {
+        errs[k] = EINVAL;
+      } else if ((fds[nfds] = open(p, flags, ZFILE_PERMS)) < 0) {
+        errs[k] = errno;
+      } else {
+        nfds++;
+      }
+
+      if (nul != NULL)
+        p = nul + 1;
+    }
+
+    if (write_fds(sock, errs, k * sizeof(int32_t), fds, nfds) < 0)
+      rc = -1;
+    for (j = 0; j < nfds; j++)
+      (void) close(fds[j]);
+    if (rc != 0)
+      return (rc);
+  }
+
+  return (0);
+}
+
+
+/*
+ * Parent side of batch_open().  On a transport failure every fd received so
+ * far is closed and -1 returned.
+ */
+static int batch_recv(int sock, zfile_batch_t *zb) {
+  int32_t errs[ZFILE_FDS_PER_MSG];
+  int recvd[ZFILE_FDS_PER_MSG];
+  uint32_t off = 0;
+  uint32_t i = 0;
+  ssize_t want = 0;
+  ssize_t got = 0;
+  ssize_t n = 0;
+  int nrecv = 0;
+  int more = 0;
+  int err = ECONNRESET;
+  int j = 0;
+  int k = 0;
+
+  for (off = 0; off < zb->zb_count; off += k) {
+    k = zb->zb_count - off;
+    if (k > ZFILE_FDS_PER_MSG)
+      k = ZFILE_FDS_PER_MSG;
+    want = k * sizeof(int32_t);
+
+    /*
+     * A reply may arrive in pieces, each with some of the fds attached,
+     * so keep collecting both until the errnos are all in.
+     */
+    nrecv = 0;
+    n = 1;
+    for (got = 0; n > 0 && got < want; ) {
+      if (deadline_wait(sock) != 0) {
+        err = errno == ETIMEDOUT ? ETIMEDOUT : ECONNRESET;
+        n = -1;
+        break;
+      }
+      n = read_fds(sock, reinterpret_cast<char *>(errs) + got, want - got,
+                   recvd + nrecv, ZFILE_FDS_PER_MSG - nrecv, &more);
+      if (n < 0 && errno == EINTR) {
+        n = 1;
+        continue;
+      }
+      if (n > 0) {
+        got += n;
+        nrecv += more;
+      }
+    }
+
+    if (n <= 0) {
+      for (j = 0; j < nrecv; j++)
+        (void) close(recvd[j]);
+      for (i = 0; i < off; i++) {
+        if (zb->zb_fds[i] >= 0)
+          (void) close(zb->zb_fds[i]);
+        zb->zb_fds[i] = -1;
+      }
+      errno = err;
+      return (-1);
+    }
+
+    for (i = 0, j = 0; i < (uint32_t)k; i++) {
+      zb->zb_fds[off + i] = -1;
+      zb->zb_errs[off + i] = errs[i];
+      if (errs[i] == 0) {
+        if (j < nrecv) {
+          zb->zb_fds[off + i] = recvd[j++];
+          (void) close_on_exec(zb->zb_fds[off + i]);
+        } else {
+          zb->zb_errs[off + i] = EBADF;
+        }
+      }
+    }
+    while (j < nrecv)
+      (void) close(recvd[j++]);
+  }
+
+  return (0);
+}
+
+
+/*
+ * Fire the per-entry probes for a batch that has come back.
+ */
+static void batch_probe(const zfile_batch_t *zb, int pid) {
+  const char *p = NULL;
+  int32_t mode = 0;
+  uint32_t i = 0;
+
+  if (!ZFILE_CHILD_OPEN_DONE_ENABLED() && !ZFILE_FD_RECEIVED_ENABLED())
+    return;
+
+  p = zb->zb_buf + zb->zb_count * sizeof(int32_t);
+  for (i = 0; i < zb->zb_count; i++) {
+    memcpy(&mode, zb->zb_buf + i * sizeof(int32_t), sizeof(mode));
+    ZFILE_CHILD_OPEN_DONE(PROBE_STR(p), mode, pid, zb->zb_errs[i]);
+    ZFILE_FD_RECEIVED(PROBE_STR(p), zb->zb_fds[i], zb->zb_errs[i]);
+    p += strlen(p) + 1;
+  }
+}
+
+
+/*
+ * One-shot children that were killed on a timeout but had not gone by the
+ * time we stopped waiting, to be reaped by a later child_reap().
+ */
+static pthread_mutex_t reap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pid_t reap_list[ZFILE_REAP_MAX];
+static volatile int reap_count = 0;
+
+
+static void reap_orphans(void) {
+  int stat = 0;
+  int i = 0;
+
+  pthread_mutex_lock(&reap_lock);
+  while (i < reap_count) {
+    if (waitpid(reap_list[i], &stat, WNOHANG) == 0) {
+      i++;
+      continue;
+    }
+    reap_list[i] = reap_list[--reap_count];
+    atomic_inc_64(&leak_stats.zl_reaped);
+  }
+  pthread_mutex_unlock(&reap_lock);
+}
+
+
+/*
+ * Reap one-shot child pid.  One that timed out may be wedged in the zone,
+ * in which case waiting on it could take forever, so it's killed and given
+ * only a few ms to go before being left for later.
+ */
+static void child_reap(pid_t pid, bool timedout) {
+  hrtime_t start = gethrtime();
+  pid_t rc = 0;
+  int stat = 0;
+
+  if (reap_count != 0)
+    reap_orphans();
+
+  trace(ZFILE_TRACE_WAIT, -1, pid, 0, timedout);
+  if (!timedout) {
+    while ((waitpid(pid, &stat, 0) != pid) && errno != ECHILD) {}
+    atomic_inc_64(&leak_stats.zl_reaped);
+    stats_time(ZFILE_PHASE_WAIT, gethrtime() - start);
+    return;
+  }
+
+  (void) kill(pid, SIGKILL);
+  for (int i = 0; i < ZFILE_REAP_TRIES; i++) {
+    rc = waitpid(pid, &stat, WNOHANG);
+    if (rc == pid || (rc < 0 && errno != EINTR)) {
+      atomic_inc_64(&leak_stats.zl_reaped);
+      return;
+    }
+    (void) poll(NULL, 0, 1);
+  }
+
+  trace(ZFILE_TRACE_WEDGED, -1, pid, 0, -1);
+  pthread_mutex_lock(&reap_lock);
+  if (reap_count < ZFILE_REAP_MAX) {
+    reap_list[reap_count++] = pid;
+  } else {
+    // Left a zombie until we exit
+    atomic_inc_64(&leak_stats.zl_lost);
+    trace(ZFILE_TRACE_CHILD_LOST, -1, pid, 0, -1);
+  }
+  pthread_mutex_unlock(&reap_lock);
+}
+
+
+/*
+ * A one-shot child started by child_spawn(): zc_sock is our end of the
+ * socketpair it answers on.
+ */
+typedef struct zfile_child {
+  zoneid_t zc_zoneid;
+  pid_t zc_pid;
+  int zc_sock;
+} zfile_child_t;
+
+/*
+ * What a one-shot child does once it is in the zone: answer on sock,
+ * starting from resp (with zp_enter_ns already filled in), and return the
+ * status to exit with.  This may be running in a vforkx() child borrowing
+ * the parent's address space, so it must stick to system calls: no stdio
+ * (hence no trace()) and no memory but its own frame and what arg points
+ * at.
+ */
+typedef int (*child_body_t)(int sock, zfile_resp_t *resp, void *arg);
+
+
+/*
+ * Close every fd above stderr but keep in a one-shot child.  Other pool
+ * threads' child sockets and zone fds on their way to JS (or in the fd
+ * cache) are all open in node, and a child that never execs would carry
+ * them into its zone and hold other children's sockets open past their
+ * exit.  This runs in vforkx() children too, so it is plain close() calls
+ * rather than fdwalk() or closefrom(), which allocate.
+ */
+static void child_close_fds(int keep) {
+  struct rlimit rl;
+  int max = 0;
+  int fd = 0;
+
+  // An unlimited (or unreadable) limit would be a very long loop
+  if (getrlimit(RLIMIT_NOFILE, &rl) != 0 ||
+      rl.rlim_cur > ZFILE_CHILD_FD_MAX) {
+    max = ZFILE_CHILD_FD_MAX;
+  } else {
+    max = static_cast<int>(rl.rlim_cur);
+  }
+
+  for (fd = STDERR_FILENO + 1; fd < max; fd++) {
+    if (fd != keep)
+      (void) close(fd);
+  }
+}
+
+
+/*
+ * Child half of child_spawn(): let go of the template, drop every fd but
+ * our end of the socket, enter the zone and run body.  If the zone can't be
+ * entered the answer is a zfile_resp_t naming the error, alone.  It is kept
+ * out of line so that it never shares a frame with child_spawn(), which a
+ * vforkx() parent goes on to use.
+ */
+static void __attribute__((noinline, noreturn))
+child_run(int tmpl_fd, int *sockfd, zoneid_t zoneid, child_body_t body,
+          void *arg) {
+  zfile_resp_t resp = {0};
+  hrtime_t start = 0;
+  int ret = 0;
+
+  (void) ct_tmpl_clear(tmpl_fd);
+  child_close_fds(sockfd[1]);
+  contract_report(sockfd[1]);
+
+  start = gethrtime();
+  ret = zone_enter(zoneid);
+  resp.zp_enter_ns = gethrtime() - start;
+  if (ret != 0) {
+    resp.zp_errno = errno;
+    resp.zp_syscall = ZFILE_SYS_ZONE_ENTER;
+    (void) write_full(sockfd[1], &resp, sizeof(resp));
+    _exit(0);
+  }
+
+  _exit(body(sockfd[1], &resp, arg));
+}
+
+
+/*
+ * Start a one-shot child, created as how (a ZFILE_SPAWN_*) says, that
+ * enters zoneid and runs body(arg); event is the trace record for the
+ * fork.  Returns 0 with *zc filled in once the child's contract has been
+ * released, or -1 with errno and *sysp set.
+ */
+static int child_spawn(zoneid_t zoneid, int how, int event,
+                       child_body_t body, void *arg, zfile_child_t *zc,
+                       int *sysp) {
+  int sockfd[2] = {0};
+  int tmpl_fd = 0;
+  int _errno = 0;
+  pid_t pid = 0;
+  hrtime_t start = 0;
+
+  if ((tmpl_fd = thread_template()) < 0) {
+    *sysp = ZFILE_SYS_TEMPLATE;
+    return (-1);
+  }
+
+  if (socketpair(AF_LOCAL, SOCK_STREAM, 0, sockfd) != 0) {
+    *sysp = ZFILE_SYS_SOCKETPAIR;
+    return (-1);
+  }
+
+  start = gethrtime();
+  switch (how) {
+    case ZFILE_SPAWN_VFORK:
+      pid = vforkx(FORK_NOSIGCHLD | FORK_WAITPID);
+      break;
+    case ZFILE_SPAWN_FORKX:
+      pid = forkx(FORK_NOSIGCHLD | FORK_WAITPID);
+      break;
+    default:
+      pid = fork();
+      break;
+  }
+
+  if (pid == 0)
+    child_run(tmpl_fd, sockfd, zoneid, body, arg);
+
+  if (ZFILE_FORK_DONE_ENABLED())
+    ZFILE_FORK_DONE(zoneid, pid, pid < 0 ? errno : 0);
+  stats_time(ZFILE_PHASE_FORK, gethrtime() - start);
+  trace(event, zoneid, pid, pid < 0 ? errno : 0, -1);
+  if (pid < 0) {
+    _errno = errno;
+    (void) close(sockfd[0]);
+    (void) close(sockfd[1]);
+    *sysp = ZFILE_SYS_FORK;
+    errno = _errno;
+    return (-1);
+  }
+
+  (void) close(sockfd[1]);
+  contract_release(sockfd[0]);
+
+  zc->zc_zoneid = zoneid;
+  zc->zc_pid = pid;
+  zc->zc_sock = sockfd[0];
+  return (0);
+}
+
+
+/*
+ * Parent half, once we're done reading from the child: record how long it
+ * took to enter the zone and do its work from resp, or that it never
+ * answered if resp is NULL, then close the socket and reap it.  err is the
+ * outcome of the request; ETIMEDOUT has the child killed rather than
+ * waited for.
+ */
+static void child_finish(zfile_child_t *zc, const zfile_resp_t *resp,
+                         int err) {
+  if (resp == NULL) {
+    trace(ZFILE_TRACE_NO_REPLY, zc->zc_zoneid, zc->zc_pid, err, -1);
+  } else {
+    if (resp->zp_enter_ns > 0)
+      stats_time(ZFILE_PHASE_ENTER, resp->zp_enter_ns);
+    if (resp->zp_open_ns > 0)
+      stats_time(ZFILE_PHASE_OPEN, resp->zp_open_ns);
+    if (ZFILE_ZONE_ENTER_DONE_ENABLED()) {
+      ZFILE_ZONE_ENTER_DONE(zc->zc_zoneid, zc->zc_pid,
+          resp->zp_syscall == ZFILE_SYS_ZONE_ENTER ? resp->zp_errno : 0);
+    }
+  }
+
+  (void) close(zc->zc_sock);
+  child_reap(zc->zc_pid, err == ETIMEDOUT);
+}
+
+
+/*
+ * The spawn mode for children that must not be vforkx()ed: any whose
+ * parent has to keep reading while the child runs, or whose child calls
+ * into libc beyond system calls.
+ */
+static int child_no_vfork(void) {
+  return (spawn_mode == ZFILE_SPAWN_FORK ? ZFILE_SPAWN_FORK :
+          ZFILE_SPAWN_FORKX);
+}
+
+
+/*
+ * Child half of zfile_many(): announce the entry count, then open and send
+ * back each entry of the batch at arg.
+ */
+static int zfile_many_child(int sock, zfile_resp_t *resp, void *arg) {
+  zfile_batch_t *zb = static_cast<zfile_batch_t *>(arg);
+
+  resp->zp_value = zb->zb_count;
+  if (write_full(sock, resp, sizeof(*resp)) < 0)
+    return (1);
+  if (batch_open(sock, zb->zb_buf, zb->zb_len, zb->zb_count) != 0)
+    return (1);
+  return (0);
+}
+
+
+/*
+ * Like zfile(), but opens every entry of zb from a single child.  Returns 0
+ * when the batch ran (see zb for per-entry results), or -1 with errno and
+ * *sysp set if the zone could not be entered at all.
+ */
+static int zfile_many(zoneid_t zoneid, zfile_batch_t *zb, int *sysp) {
+  zfile_child_t zc;
+  zfile_resp_t resp = {0};
+  bool replied = false;
+  int _errno = 0;
+  int fd = -1;
+
+  *sysp = ZFILE_SYS_ZFILE;
+  if (zoneid < 0 || zb->zb_count == 0) {
+    errno = EINVAL;
+    return (-1);
+  }
+
+  /*
+   * A vforkx() parent stays suspended until the child exits, so it could not
+   * drain replies that overflow the socket buffer; batches never use it.
+   */
+  if (child_spawn(zoneid, child_no_vfork(), ZFILE_TRACE_BATCH_FORK,
+                  zfile_many_child, zb, &zc, sysp) != 0)
+    return (-1);
+
+  /*
+   * Drain the replies before reaping: a large batch need not fit in the
+   * socket buffer, so the child may still be blocked sending.
+   */
+  if (resp_recv(zc.zc_sock, &resp, &fd) != 0) {
+    _errno = recv_error(sysp);
+  } else {
+    replied = true;
+    if (resp.zp_errno != 0) {
+      _errno = resp.zp_errno;
+      *sysp = resp.zp_syscall;
+    } else if (batch_recv(zc.zc_sock, zb) != 0) {
+      _errno = recv_error(sysp);
+    }
+  }
+  if (fd >= 0)
+    (void) close(fd);
+  if (_errno == 0)
+    batch_probe(zb, zc.zc_pid);
+
+  child_finish(&zc, replied ? &resp : NULL, _errno);
+
+  if (_errno != 0) {
+    errno = _errno;
+    return (-1);
+  }
+
+  errno = 0;
+  return (0);
+}
+
+
+typedef struct child_open_arg {
+  const char *co_path;
+  const zfile_open_t *co_open;
+} child_open_arg_t;
+
+
+/*
+ * Child half of zfile(): open the file and answer with it attached, or
+ * with the errno and the call that failed.
+ */
+static int zfile_child(int sock, zfile_resp_t *resp, void *arg) {
+  const child_open_arg_t *co = static_cast<child_open_arg_t *>(arg);
+  const zfile_open_t *zo = co->co_open;
+  hrtime_t start = 0;
+  int file_fd = -1;
+
+  if (zo->zo_flags < 0) {
+    resp->zp_errno = EINVAL;
+    resp->zp_syscall = ZFILE_SYS_OPEN;
+  } else {
+    start = gethrtime();
+    file_fd = open(co->co_path, zo->zo_flags, zo->zo_perms);
+    resp->zp_open_ns = gethrtime() - start;
+    if (file_fd < 0) {
+      resp->zp_errno = errno;
+      resp->zp_syscall = ZFILE_SYS_OPEN;
+    } else {
+      open_hint(file_fd, zo->zo_hints);
+    }
+  }
+
+  if (write_fd(sock, resp, sizeof(*resp), file_fd) < 0)
+    return (1);
+  return (0);
+}
+
+
+/*
+ * Open path in zoneid from a one-shot child, as zo says.  Returns the fd,
+ * or -1 with errno set and *sysp naming the call that failed.
+ */
+static int zfile(zoneid_t zoneid, const char *path, const zfile_open_t *zo,
+                 int *sysp) {
+  child_open_arg_t co = { path, zo };
+  zfile_child_t zc;
+  zfile_resp_t resp = {0};
+  bool replied = false;
+  int _errno = 0;
+  int how = spawn_mode;
+
+  /* The FD for the file we will open */
+  int file_fd = -1;
+
+  // A vforkx() parent can't run, let alone time out, until its child does
+  if (how == ZFILE_SPAWN_VFORK && deadline_on())
+    how = ZFILE_SPAWN_FORKX;
+
+  *sysp = ZFILE_SYS_ZFILE;
+  if (zoneid < 0 || path == NULL) {
+    errno = EINVAL;
+    return (-1);
+  }
+
+  if (child_spawn(zoneid, how, ZFILE_TRACE_FORK, zfile_child, &co, &zc,
+                  sysp) != 0)
+    return (-1);
+
+  if (resp_recv(zc.zc_sock, &resp, &file_fd) != 0) {
+    _errno = recv_error(sysp);
+  } else {
+    replied = true;
+    if (ZFILE_CHILD_OPEN_DONE_ENABLED() &&
+        resp.zp_syscall != ZFILE_SYS_ZONE_ENTER) {
+      ZFILE_CHILD_OPEN_DONE(PROBE_STR(path), zo->zo_mode, zc.zc_pid,
+                            resp.zp_errno);
+    }
+
+    if (resp.zp_errno != 0) {
+      _errno = resp.zp_errno;
+      *sysp = resp.zp_syscall;
+    } else if (file_fd < 0) {
+      _errno = EBADF;
+      *sysp = ZFILE_SYS_RECVMSG;
+    }
+  }
+
+  if (ZFILE_FD_RECEIVED_ENABLED())
+    ZFILE_FD_RECEIVED(PROBE_STR(path), file_fd, _errno);
+
+  child_finish(&zc, replied ? &resp : NULL, _errno);
+
+  if (file_fd < 0) {
+    errno = _errno;
+  } else {
+    (void) close_on_exec(file_fd);
+    errno = 0;
+  }
+  trace(ZFILE_TRACE_OPEN_DONE, zoneid, zc.zc_pid, errno, file_fd);
+  return (file_fd);
+}
+
+
+typedef struct child_write_arg {
+  const char *cw_path;
+  const char *cw_data;
+  size_t cw_len;
+  int cw_flags;
+} child_write_arg_t;
+
+
+/*
+ * Child half of zfile_write().
+ */
+static int zfile_write_child(int sock, zfile_resp_t *resp, void *arg) {
+  const child_write_arg_t *cw = static_cast<child_write_arg_t *>(arg);
+  hrtime_t start = gethrtime();
+  int sys = ZFILE_SYS_ZFILE;
+
+  if (atomic_write(cw->cw_path, cw->cw_data, cw->cw_len, cw->cw_flags,
+                   &sys) != 0) {
+    resp->zp_errno = errno;
+    resp->zp_syscall = sys;
+  }
+  resp->zp_open_ns = gethrtime() - start;
+
+  (void) write_full(sock, resp, sizeof(*resp));
+  return (0);
+}
+
+
+/*
+ * Atomically replace path in zoneid with the len bytes at data, from a
+ * one-shot child (see atomic_write()).  The child already has data in its
+ * copy of our address space, so nothing but the reply crosses the socket;
+ * for the same reason a vforkx() child is never used.  Returns 0, or -1
+ * with errno and *sysp set.
+ */
+static int zfile_write(zoneid_t zoneid, const char *path, const char *data,
+                       size_t len, int flags, int *sysp) {
+  child_write_arg_t cw = { path, data, len, flags };
+  zfile_child_t zc;
+  zfile_resp_t resp = {0};
+  bool replied = false;
+  int _errno = 0;
+  int fd = -1;
+
+  *sysp = ZFILE_SYS_ZFILE;
+  if (zoneid < 0 || path == NULL) {
+    errno = EINVAL;
+    return (-1);
+  }
+
+  if (child_spawn(zoneid, child_no_vfork(), ZFILE_TRACE_WRITE_FORK,
+                  zfile_write_child, &cw, &zc, sysp) != 0)
+    return (-1);
+
+  if (resp_recv(zc.zc_sock, &resp, &fd) != 0) {
+    _errno = recv_error(sysp);
+  } else {
+    replied = true;
+    if (resp.zp_errno != 0) {
+      _errno = resp.zp_errno;
+      *sysp = resp.zp_syscall;
+    }
+  }
+  if (fd >= 0)
+    (void) close(fd);
+
+  child_finish(&zc, replied ? &resp : NULL, _errno);
+
+  if (_errno != 0) {
+    errno = _errno;
+    return (-1);
+  }
+
+  errno = 0;
+  return (0);
+}
+
+
+typedef struct child_query_arg {
+  int cq_op;
+  const char *cq_path;
+} child_query_arg_t;
+
+
+/*
+ * Child half of zfile_query().
+ */
+static int zfile_query_child(int sock, zfile_resp_t *resp, void *arg) {
+  const child_query_arg_t *cq = static_cast<child_query_arg_t *>(arg);
+  hrtime_t start = gethrtime();
+  char *buf = NULL;
+  size_t len = 0;
+  int sys = ZFILE_SYS_ZFILE;
+
+  if (query_run(cq->cq_op, cq->cq_path, &buf, &len, &sys) != 0) {
+    resp->zp_errno = errno;
+    resp->zp_syscall = sys;
+  }
+  resp->zp_open_ns = gethrtime() - start;
+
+  (void) query_send(sock, resp, buf, len);
+  return (0);
+}
+
+
+/*
+ * Run query op (ZFILE_OP_STAT or ZFILE_OP_READDIR) for path in zoneid,
+ * from a child that enters the zone, the way zfile() opens.  On success
+ * returns 0 with the query_run() result in *bufp and *lenp; on failure -1
+ * with errno and *sysp set.
+ */
+static int zfile_query(zoneid_t zoneid, int op, const char *path,
+                       char **bufp, size_t *lenp, int *sysp) {
+  child_query_arg_t cq = { op, path };
+  zfile_child_t zc;
+  zfile_resp_t resp = {0};
+  bool replied = false;
+  char *buf = NULL;
+  size_t len = 0;
+  int _errno = 0;
+  int fd = -1;
+
+  *sysp = ZFILE_SYS_ZFILE;
+  if (zoneid < 0 || path == NULL) {
+    errno = EINVAL;
+    return (-1);
+  }
+
+  if (child_spawn(zoneid, child_no_vfork(), ZFILE_TRACE_QUERY_FORK,
+                  zfile_query_child, &cq, &zc, sysp) != 0)
+    return (-1);
+
+  if (resp_recv(zc.zc_sock, &resp, &fd) != 0) {
+    _errno = recv_error(sysp);
+  } else {
+    replied = true;
+    if (query_recv(zc.zc_sock, &resp, &buf, &len) != 0) {
+      _errno = recv_error(sysp);
+    } else if (resp.zp_errno != 0) {
+      _errno = resp.zp_errno;
+      *sysp = resp.zp_syscall;
+    }
+  }
+  if (fd >= 0)
+    (void) close(fd);
+
+  child_finish(&zc, replied ? &resp : NULL, _errno);
+
+  if (_errno != 0) {
+    free(buf);
+    errno = _errno;
+    return (-1);
+  }
+
+  *bufp = buf;
+  *lenp = len;
+  errno = 0;
+  return (0);
+}
+
+
+static int agent_close_fd(void *arg, int fd) {
+  if (fd > STDERR_FILENO && fd != *static_cast<int *>(arg))
+    (void) close(fd);
+  return (0);
+}
+
+
+/*
+ * Body of a zone agent.  Runs in a process that has been detached from the
+ * node process (so it is reaped by init), enters the zone and then answers
+ * open requests on sock until the parent closes its end or the agent sits
+ * idle for idle_ms.
+ */
+static void agent_main(int sock, zoneid_t zoneid, int idle_ms) {
+  zfile_req_t req = {0};
+  zfile_resp_t resp = {0};
+  char path[PATH_MAX];
+  char *batch = NULL;
+  struct pollfd pfd;
+  hrtime_t start = 0;
+  char *nul = NULL;
+  size_t qlen = 0;
+  int file_fd = -1;
+  int sys = 0;
+  int n = 0;
+
+  /*
+   * We were forked from node, so drop everything it had open: the agent
+   * outlives the request and must not pin listen sockets, other agents'
+   * sockets or files.
+   */
+  (void) fdwalk(agent_close_fd, &sock);
+
+  start = gethrtime();
+  n = zone_enter(zoneid);
+  resp.zp_enter_ns = gethrtime() - start;
+  if (n != 0) {
+    resp.zp_errno = errno;
+    resp.zp_syscall = ZFILE_SYS_ZONE_ENTER;
+    (void) write_full(sock, &resp, sizeof(resp));
+    _exit(1);
+  }
+
+  resp.zp_value = getpid();
+  if (write_full(sock, &resp, sizeof(resp)) < 0)
+    _exit(1);
+
+  pfd.fd = sock;
+  pfd.events = POLLIN;
+
+  for (;;) {
+    pfd.revents = 0;
+    n = poll(&pfd, 1, idle_ms > 0 ? idle_ms : -1);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      _exit(0);
+
+    if (read_full(sock, &req, sizeof(req)) != sizeof(req))
+      _exit(0);
+
+    file_fd = -1;
+    resp.zp_errno = 0;
+    resp.zp_syscall = ZFILE_SYS_ZFILE;
+    resp.zp_value = 0;
+    resp.zp_open_ns = 0;
+
+    switch (req.zr_op) {
+      case ZFILE_OP_OPEN:
+        if (req.zr_len == 0 || req.zr_len > sizeof(path) ||
+            read_full(sock, path, req.zr_len) != (ssize_t)req.zr_len)
+          _exit(1);
+        path[req.zr_len - 1] = '\0';
+
+        resp.zp_syscall = ZFILE_SYS_OPEN;
+        if (req.zr_open.zo_flags < 0) {
+          resp.zp_errno = EINVAL;
+        } else {
+          start = gethrtime();
+          if ((file_fd = open(path, req.zr_open.zo_flags,
+                              req.zr_open.zo_perms)) < 0)
+            resp.zp_errno = errno;
+          resp.zp_open_ns = gethrtime() - start;
+          if (file_fd >= 0)
+            open_hint(file_fd, req.zr_open.zo_hints);
+        }
+
+        if (write_fd(sock, &resp, sizeof(resp), file_fd) < 0)
+          _exit(1);
+        if (file_fd >= 0)
+          (void) close(file_fd);
+        break;
+
+      case ZFILE_OP_OPEN_MANY:
+        if (req.zr_count == 0 || req.zr_count > ZFILE_BATCH_MAX ||
+            req.zr_len > ZFILE_BATCH_MAX * (sizeof(int32_t) + PATH_MAX) ||
+            (batch = static_cast<char *>(malloc(req.zr_len))) == NULL)
+          _exit(1);
+        if (read_full(sock, batch, req.zr_len) != (ssize_t)req.zr_len)
+          _exit(1);
+
+        resp.zp_value = req.zr_count;
+        if (write_full(sock, &resp, sizeof(resp)) < 0 ||
+            batch_open(sock, batch, req.zr_len, req.zr_count) != 0)
+          _exit(1);
+        free(batch);
+        batch = NULL;
+        break;
+
+      case ZFILE_OP_WRITE:
+        if (req.zr_len == 0 || req.zr_len > ZFILE_WRITE_MAX + PATH_MAX ||
+            (batch = static_cast<char *>(malloc(req.zr_len))) == NULL)
+          _exit(1);
+        if (read_full(sock, batch, req.zr_len) != (ssize_t)req.zr_len)
+          _exit(1);
+
+        resp.zp_syscall = ZFILE_SYS_OPEN;
+        if ((nul = static_cast<char *>(memchr(batch, '\0', req.zr_len))) ==
+            NULL) {
+          resp.zp_errno = EINVAL;
+        } else {
+          start = gethrtime();
+          if (atomic_write(batch, nul + 1, batch + req.zr_len - (nul + 1),
+                           req.zr_mode, &sys) != 0) {
+            resp.zp_errno = errno;
+            resp.zp_syscall = sys;
+          }
+          resp.zp_open_ns = gethrtime() - start;
+        }
+        free(batch);
+        batch = NULL;
+
+        if (write_full(sock, &resp, sizeof(resp)) < 0)
+          _exit(1);
+        break;
+
+      case ZFILE_OP_STAT:
+      case ZFILE_OP_READDIR:
+      case ZFILE_OP_RENAME:
+      case ZFILE_OP_UNLINK:
+        if (req.zr_len == 0 || req.zr_len > sizeof(path) ||
+            read_full(sock, path, req.zr_len) != (ssize_t)req.zr_len)
+          _exit(1);
+        path[req.zr_len - 1] = '\0';
+
+        start = gethrtime();
+        if (query_run(req.zr_op, path, &batch, &qlen, &sys) != 0) {
+          resp.zp_errno = errno;
+          resp.zp_syscall = sys;
+        }
+        resp.zp_open_ns = gethrtime() - start;
+
+        if (query_send(sock, &resp, batch, qlen) < 0)
+          _exit(1);
+        free(batch);
+        batch = NULL;
+        break;
+
+      default:
+        _exit(1);
+    }
+  }
+}
+
+
+static void agent_close(zfile_agent_t *za) {
+  if (za->za_sock >= 0)
+    (void) close(za->za_sock);
+  za->za_sock = -1;
+  za->za_pid = -1;
+}
+
+
+static zfile_agent_t *agent_lookup(zoneid_t zoneid) {
+  zfile_agent_t *za = NULL;
+
+  pthread_mutex_lock(&agents_lock);
+  for (za = agents; za != NULL; za = za->za_next) {
+    if (za->za_zoneid == zoneid)
+      break;
+  }
+
+  if (za == NULL &&
+      (za = static_cast<zfile_agent_t *>(calloc(1, sizeof(*za)))) != NULL) {
+    za->za_zoneid = zoneid;
+    za->za_pid = -1;
+    za->za_sock = -1;
+    pthread_mutex_init(&za->za_lock, NULL);
+    za->za_next = agents;
+    agents = za;
+  }
+  if (za != NULL)
+    za->za_refs++;
+  pthread_mutex_unlock(&agents_lock);
+
+  if (za == NULL)
+    errno = ENOMEM;
+  return (za);
+}
+
+
+/*
+ * Drop a reference taken by agent_lookup(), freeing za if zone_forget() has
+ * already taken it off the agents list.
+ */
+static void agent_release(zfile_agent_t *za) {
+  int last = 0;
+
+  pthread_mutex_lock(&agents_lock);
+  last = (--za->za_refs == 0 && za->za_gone);
+  pthread_mutex_unlock(&agents_lock);
+
+  if (last) {
+    agent_close(za);
+    pthread_mutex_destroy(&za->za_lock);
+    free(za);
+  }
+}
+
+
+/*
+ * Start an agent for za->za_zoneid.  Called with za->za_lock held.  The
+ * agent is created through the same contract template as zfile() children
+ * and double-forked so it never lingers as our zombie after an idle exit.
+ */
+static int agent_spawn(zfile_agent_t *za, int *sysp) {
+  zfile_resp_t hello = {0};
+  int _errno = 0;
+  int pid = 0;
+  int sockfd[2] = {0};
+  int stat = 0;
+  int tmpl_fd = 0;
+  int fd = -1;
+  int idle_ms = static_cast<int>(agent_idle_ms);
+  hrtime_t start = 0;
+
+  if ((tmpl_fd = thread_template()) < 0) {
+    *sysp = ZFILE_SYS_TEMPLATE;
+    return (-1);
+  }
+
+  if (socketpair(AF_LOCAL, SOCK_STREAM, 0, sockfd) != 0) {
+    *sysp = ZFILE_SYS_SOCKETPAIR;
+    return (-1);
+  }
+
+  start = gethrtime();
+  pid = fork();
+  if (pid != 0) {
+    if (ZFILE_FORK_DONE_ENABLED())
+      ZFILE_FORK_DONE(za->za_zoneid, pid, pid < 0 ? errno : 0);
+    stats_time(ZFILE_PHASE_FORK, gethrtime() - start);
+  }
+  trace(ZFILE_TRACE_AGENT_FORK, za->za_zoneid, pid, pid < 0 ? errno : 0,
+        -1);
+  if (pid < 0) {
+    _errno = errno;
+    (void) close(sockfd[0]);
+    (void) close(sockfd[1]);
+    *sysp = ZFILE_SYS_FORK;
+    errno = _errno;
+    return (-1);
+  }
+
+  if (pid == 0) {
+    (void) ct_tmpl_clear(tmpl_fd);
+    (void) close(tmpl_fd);
+    (void) close(sockfd[0]);
+    contract_report(sockfd[1]);
+
+    if ((pid = fork()) != 0)
+      _exit(pid < 0 ? 1 : 0);
+
+    agent_main(sockfd[1], za->za_zoneid, idle_ms);
+    _exit(0);
+  }
+
+  (void) close(sockfd[1]);
+  contract_release(sockfd[0]);
+
+  start = gethrtime();
+  while ((waitpid(pid, &stat, 0) != pid) && errno != ECHILD) {}
+  atomic_inc_64(&leak_stats.zl_reaped);
+  stats_time(ZFILE_PHASE_WAIT, gethrtime() - start);
+
+  if (resp_recv(sockfd[0], &hello, &fd) != 0 || hello.zp_errno != 0) {
+    // An agent that timed out exits once it finds its socket closed
+    if (hello.zp_errno != 0) {
+      _errno = hello.zp_errno;
+      *sysp = hello.zp_syscall;
+    } else {
+      _errno = recv_error(sysp);
+    }
+    trace(ZFILE_TRACE_AGENT_FAILED, za->za_zoneid, pid, _errno, -1);
+    if (ZFILE_ZONE_ENTER_DONE_ENABLED())
+      ZFILE_ZONE_ENTER_DONE(za->za_zoneid, -1, _errno);
+    (void) close(sockfd[0]);
+    errno = _errno;
+    return (-1);
+  }
+  if (fd >= 0)
+    (void) close(fd);
+  stats_time(ZFILE_PHASE_ENTER, hello.zp_enter_ns);
+  if (ZFILE_ZONE_ENTER_DONE_ENABLED())
+    ZFILE_ZONE_ENTER_DONE(za->za_zoneid, hello.zp_value, 0);
+
+  (void) close_on_exec(sockfd[0]);
+  za->za_sock = sockfd[0];
+  za->za_pid = hello.zp_value;
+  trace(ZFILE_TRACE_AGENT_STARTED, za->za_zoneid, za->za_pid, 0, -1);
+
+  return (0);
+}
+
+
+/*
+ * An operation run against a live agent.  Returns -1 if the agent could not
+ * be talked to (it has died or exited idle), otherwise 0 with *errp and
+ * *sysp holding the outcome of the operation itself.
+ */
+typedef int (*agent_call_t)(zfile_agent_t *za, void *arg, int *errp,
+                            int *sysp);
+
+typedef struct agent_open_arg {
+    const char *ao_path;
+    const zfile_open_t *ao_open;
+    int ao_fd;
+} agent_open_arg_t;
+
+
+static int agent_call_open(zfile_agent_t *za, void *arg, int *errp,
+                           int *sysp) {
+  agent_open_arg_t *ao = static_cast<agent_open_arg_t *>(arg);
+  char buf[sizeof(zfile_req_t) + PATH_MAX];
+  zfile_req_t req = {0};
+  zfile_resp_t resp = {0};
+  size_t len = strlen(ao->ao_path) + 1;
+
+  ao->ao_fd = -1;
+  if (len > PATH_MAX) {
+    *errp = ENAMETOOLONG;
+    *sysp = ZFILE_SYS_OPEN;
+    return (0);
+  }
+
+  req.zr_op = ZFILE_OP_OPEN;
+  req.zr_mode = ao->ao_open->zo_mode;
+  req.zr_len = len;
+  req.zr_open = *ao->ao_open;
+  memcpy(buf, &req, sizeof(req));
+  memcpy(buf + sizeof(req), ao->ao_path, len);
+
+  if (write_full(za->za_sock, buf, sizeof(req) + len) < 0)
+    return (-1);
+
+  if (resp_recv(za->za_sock, &resp, &ao->ao_fd) != 0)
+    return (-1);
+
+  if (resp.zp_open_ns > 0)
+    stats_time(ZFILE_PHASE_OPEN, resp.zp_open_ns);
+  *errp = resp.zp_errno;
+  *sysp = resp.zp_syscall;
+  if (ZFILE_CHILD_OPEN_DONE_ENABLED()) {
+    ZFILE_CHILD_OPEN_DONE(PROBE_STR(ao->ao_path), ao->ao_open->zo_mode,
+                          za->za_pid, *errp);
+  }
+  if (*errp == 0 && ao->ao_fd < 0) {
+    *errp = EBADF;
+    *sysp = ZFILE_SYS_RECVMSG;
+  }
+  if (ZFILE_FD_RECEIVED_ENABLED())
+    ZFILE_FD_RECEIVED(PROBE_STR(ao->ao_path), ao->ao_fd, *errp);
+  return (0);
+}
+
+
+static int agent_call_open_many(zfile_agent_t *za, void *arg, int *errp,
+                                int *sysp) {
+  zfile_batch_t *zb = static_cast<zfile_batch_t *>(arg);
+  zfile_req_t req = {0};
+  zfile_resp_t resp = {0};
+  int fd = -1;
+
+  req.zr_op = ZFILE_OP_OPEN_MANY;
+  req.zr_count = zb->zb_count;
+  req.zr_len = zb->zb_len;
+
+  if (write_full(za->za_sock, &req, sizeof(req)) < 0 ||
+      write_full(za->za_sock, zb->zb_buf, zb->zb_len) < 0)
+    return (-1);
+
+  if (resp_recv(za->za_sock, &resp, &fd) != 0)
+    return (-1);
+  if (fd >= 0)
+    (void) close(fd);
+  if (resp.zp_errno != 0) {
+    *errp = resp.zp_errno;
+    *sysp = resp.zp_syscall;
+    return (0);
+  }
+
+  if (batch_recv(za->za_sock, zb) != 0)
+    return (-1);
+  batch_probe(zb, za->za_pid);
+
+  *errp = 0;
+  return (0);
+}
+
+
+/*
+ * Run call against the agent for zoneid, starting (or restarting) the agent
+ * as necessary.  Returns 0, or -1 with errno and *sysp set from either the
+ * agent spawn or the operation.
+ */
+static int agent_run(zoneid_t zoneid, agent_call_t call, void *arg,
+                     int *sysp) {
+  zfile_agent_t *za = NULL;
+  hrtime_t start = 0;
+  int _errno = 0;
+  int tries = 0;
+
+  *sysp = ZFILE_SYS_ZFILE;
+  if (zoneid < 0) {
+    errno = EINVAL;
+    return (-1);
+  }
+
+  if ((za = agent_lookup(zoneid)) == NULL)
+    return (-1);
+
+  start = gethrtime();
+  pthread_mutex_lock(&za->za_lock);
+  stats_time(ZFILE_PHASE_LOCK, gethrtime() - start);
+  if (ZFILE_LOCK_ACQUIRED_ENABLED())
+    ZFILE_LOCK_ACQUIRED(zoneid, za->za_pid);
+  for (tries = 0; tries < 2; tries++) {
+    if (za->za_sock < 0 && agent_spawn(za, sysp) != 0) {
+      _errno = errno;
+      break;
+    }
+
+    _errno = 0;
+    *sysp = ZFILE_SYS_ZFILE;
+    if (call(za, arg, &_errno, sysp) == 0)
+      break;
+    if (errno == ETIMEDOUT) {
+      // Wedged rather than gone: kill it, and don't try again
+      trace(ZFILE_TRACE_AGENT_TIMEOUT, zoneid, za->za_pid, ETIMEDOUT, -1);
+      if (za->za_pid > 0)
+        (void) kill(za->za_pid, SIGKILL);
+      agent_close(za);
+      _errno = ETIMEDOUT;
+      *sysp = ZFILE_SYS_POLL;
+      break;
+    }
+
+    // The agent exited underneath us (usually its idle timeout); respawn.
+    trace(ZFILE_TRACE_AGENT_GONE, zoneid, za->za_pid, errno, -1);
+    agent_close(za);
+    _errno = ECONNRESET;
+    *sysp = ZFILE_SYS_RECVMSG;
+  }
+  pthread_mutex_unlock(&za->za_lock);
+  agent_release(za);
+
+  errno = _errno;
+  return (_errno == 0 ? 0 : -1);
+}
+
+
+/*
+ * Open path in zoneid through that zone's agent.  Same contract as zfile().
+ */
+static int agent_open(zoneid_t zoneid, const char *path,
+                      const zfile_open_t *zo, int *sysp) {
+  agent_open_arg_t ao = { path, zo, -1 };
+
+  *sysp = ZFILE_SYS_ZFILE;
+  if (path == NULL) {
+    errno = EINVAL;
+    return (-1);
+  }
+
+  if (agent_run(zoneid, agent_call_open, &ao, sysp) != 0)
+    return (-1);
+
+  (void) close_on_exec(ao.ao_fd);
+  errno = 0;
+  trace(ZFILE_TRACE_AGENT_OPEN, zoneid, -1, 0, ao.ao_fd);
+  return (ao.ao_fd);
+}
+
+
+/*
+ * Batch counterpart of agent_open(), with the contract of zfile_many().
+ */
+static int agent_open_many(zoneid_t zoneid, zfile_batch_t *zb, int *sysp) {
+  return (agent_run(zoneid, agent_call_open_many, zb, sysp));
+}
+
+
+typedef struct agent_write_arg {
+  const char *aw_path;
+  const char *aw_data;
+  size_t aw_len;
+  int aw_flags;
+} agent_write_arg_t;
+
+
+static int agent_call_write(zfile_agent_t *za, void *arg, int *errp,
+                            int *sysp) {
+  agent_write_arg_t *aw = static_cast<agent_write_arg_t *>(arg);
+  char buf[sizeof(zfile_req_t) + PATH_MAX];
+  zfile_req_t req = {0};
+  zfile_resp_t resp = {0};
+  size_t plen = strlen(aw->aw_path) + 1;
+  int fd = -1;
+
+  if (plen > PATH_MAX) {
+    *errp = ENAMETOOLONG;
+    *sysp = ZFILE_SYS_OPEN;
+    return (0);
+  }
+  if (aw->aw_len > ZFILE_WRITE_MAX) {
+    *errp = EFBIG;
+    *sysp = ZFILE_SYS_WRITE;
+    return (0);
+  }
+
+  req.zr_op = ZFILE_OP_WRITE;
+  req.zr_mode = aw->aw_flags;
+  req.zr_len = plen + aw->aw_len;
+  memcpy(buf, &req, sizeof(req));
+  memcpy(buf + sizeof(req), aw->aw_path, plen);
+
+  if (write_full(za->za_sock, buf, sizeof(req) + plen) < 0 ||
+      write_full(za->za_sock, aw->aw_data, aw->aw_len) < 0)
+    return (-1);
+
+  if (resp_recv(za->za_sock, &resp, &fd) != 0)
+    return (-1);
+  if (fd >= 0)
+    (void) close(fd);
+
+  if (resp.zp_open_ns > 0)
+    stats_time(ZFILE_PHASE_OPEN, resp.zp_open_ns);
+  *errp = resp.zp_errno;
+  *sysp = resp.zp_syscall;
+  return (0);
+}
+
+
+/*
+ * Atomically replace path in zoneid through that zone's agent.  Same
+ * contract as zfile_write().
+ */
+static int agent_write(zoneid_t zoneid, const char *path, const char *data,
+                       size_t len, int flags, int *sysp) {
+  agent_write_arg_t aw = { path, data, len, flags };
+
+  return (agent_run(zoneid, agent_call_write, &aw, sysp));
+}
+
+
+typedef struct agent_query_arg {
+  int aq_op;
+  const char *aq_path;
+  char *aq_buf;
+  size_t aq_len;
+} agent_query_arg_t;
+
+
+static int agent_call_query(zfile_agent_t *za, void *arg, int *errp,
+                            int *sysp) {
+  agent_query_arg_t *aq = static_cast<agent_query_arg_t *>(arg);
+  char buf[sizeof(zfile_req_t) + PATH_MAX];
+  zfile_req_t req = {0};
+  zfile_resp_t resp = {0};
+  size_t len = query_path_len(aq->aq_op, aq->aq_path);
+  int fd = -1;
+
+  aq->aq_buf = NULL;
+  aq->aq_len = 0;
+  if (len > PATH_MAX) {
+    *errp = ENAMETOOLONG;
+    *sysp = ZFILE_SYS_OPEN;
+    return (0);
+  }
+
+  req.zr_op = aq->aq_op;
+  req.zr_len = len;
+  memcpy(buf, &req, sizeof(req));
+  memcpy(buf + sizeof(req), aq->aq_path, len);
+
+  if (write_full(za->za_sock, buf, sizeof(req) + len) < 0)
+    return (-1);
+
+  if (resp_recv(za->za_sock, &resp, &fd) != 0)
+    return (-1);
+  if (fd >= 0)
+    (void) close(fd);
+  if (query_recv(za->za_sock, &resp, &aq->aq_buf, &aq->aq_len) != 0)
+    return (-1);
+
+  if (resp.zp_open_ns > 0)
+    stats_time(ZFILE_PHASE_OPEN, resp.zp_open_ns);
+  *errp = resp.zp_errno;
+  *sysp = resp.zp_syscall;
+  return (0);
+}
+
+
+/*
+ * Run a query through zoneid's agent.  Same contract as zfile_query().
+ */
+static int agent_query(zoneid_t zoneid, int op, const char *path,
+                       char **bufp, size_t *lenp, int *sysp) {
+  agent_query_arg_t aq = { op, path, NULL, 0 };
+
+  if (agent_run(zoneid, agent_call_query, &aq, sysp) != 0) {
+    free(aq.aq_buf);
+    return (-1);
+  }
+
+  *bufp = aq.aq_buf;
+  *lenp = aq.aq_len;
+  return (0);
+}
+
+
+static uint32_t zone_hash(const char *name) {
+    uint32_t h = 2166136261U;
+
+    while (*name != '\0') {
+        h ^= (unsigned char)*name++;
+        h *= 16777619U;
+    }
+
+    return (h);
+}
+
+
+/*
+ * Returns 1 and sets *idp if name is cached with a valid id.
+ */
+static int zone_cache_get(const char *name, zoneid_t *idp) {
+    uint32_t h = zone_hash(name);
+    zone_cache_ent_t *ze = NULL;
+    uint32_t seq = 0;
+    zoneid_t id = -1;
+    int empty = 0;
+    int match = 0;
+
+    for (int i = 0; i < ZONE_CACHE_PROBES; i++) {
+        ze = &zone_cache[(h + i) & (ZONE_CACHE_SLOTS - 1)];
+        do {
+            while ((seq = ze->zc_seq) & 1) {}
+            membar_consumer();
+            id = ze->zc_zoneid;
+            empty = (ze->zc_name[0] == '\0');
+            match = (strncmp(ze->zc_name, name, ZONENAME_MAX) == 0);
+            membar_consumer();
+        } while (seq != ze->zc_seq);
+
+        if (empty)
+            return (0);
+        if (match) {
+            if (id < 0)
+                return (0);
+            *idp = id;
+            return (1);
+        }
+    }
+
+    return (0);
+}
+
+
+static void zone_cache_write(zone_cache_ent_t *ze, const char *name,
+                             zoneid_t id) {
+    ze->zc_seq++;
+    membar_producer();
+    ze->zc_zoneid = id;
+    if (name != NULL)
+        (void) strlcpy(ze->zc_name, name, sizeof(ze->zc_name));
+    membar_producer();
+    ze->zc_seq++;
+}
+
+
+/*
+ * Record name -> id, or with an id of -1 forget whatever name maps to.
+ * When expect is not -1 the entry is only changed if it still holds expect,
+ * so that racing invalidations of the same stale id don't clobber a fresh
+ * one.
+ */
+static void zone_cache_set(const char *name, zoneid_t id, zoneid_t expect) {
+    uint32_t h = zone_hash(name);
+    zone_cache_ent_t *ze = NULL;
+
+    pthread_mutex_lock(&zone_cache_lock);
+    for (int i = 0; i < ZONE_CACHE_PROBES; i++) {
+        ze = &zone_cache[(h + i) & (ZONE_CACHE_SLOTS - 1)];
+        if (ze->zc_name[0] == '\0') {
+            if (id >= 0)
+                zone_cache_write(ze, name, id);
+            break;
+        }
+        if (strcmp(ze->zc_name, name) == 0) {
+            if (expect == -1 || ze->zc_zoneid == expect)
+                zone_cache_write(ze, NULL, id);
+            break;
+        }
+        // Every slot we may probe is taken; evict the home slot.
+        if (i == ZONE_CACHE_PROBES - 1 && id >= 0)
+            zone_cache_write(&zone_cache[h & (ZONE_CACHE_SLOTS - 1)],
+                             name, id);
+    }
+    pthread_mutex_unlock(&zone_cache_lock);
+}
+
+
+/*
+ * Whether zoneid is still the id of the zone called name.  Zone ids are
+ * reused once a zone halts, so a cached one may have gone to another zone.
+ */
+static bool zone_owns(zoneid_t zoneid, const char *name) {
+    char buf[ZONENAME_MAX];
+
+    return (getzonenamebyid(zoneid, buf, sizeof(buf)) >= 0 &&
+            strcmp(buf, name) == 0);
+}
+
+
+/*
+ * The id of the zone called name.  A cached id is checked against the name
+ * before it is used: one that has gone away, or now names another zone, is
+ * dropped along with its agent and cached fds, as if the zone watch had
+ * seen it go, and the name resolved again.
+ */
+static zoneid_t zone_lookup(const char *name) {
+    zoneid_t id = -1;
+
+    if (strlen(name) >= ZONENAME_MAX)
+        return (getzoneidbyname(name));
+
+    if (zone_cache_get(name, &id)) {
+        if (zone_owns(id, name))
+            return (id);
+        trace(ZFILE_TRACE_ZONE_STALE, id, -1, 0, -1);
+        zone_forget(name, id);
+    }
+
+    if ((id = getzoneidbyname(name)) >= 0)
+        zone_cache_set(name, id, -1);
+
+    return (id);
+}
+
+
+/*
+ * zone_enter() failing with EINVAL means the id we had for name no longer
+ * exists (the zone halted, or rebooted and came back under a new id).  Drop
+ * it and resolve the name again.
+ */
+static zoneid_t zone_refresh(const char *name, zoneid_t stale) {
+    trace(ZFILE_TRACE_ZONE_STALE, stale, -1, 0, -1);
+    if (strlen(name) < ZONENAME_MAX)
+        zone_cache_set(name, -1, stale);
+    return (zone_lookup(name));
+}
+
+
+static void fdcache_unlink(zfile_fdent_t *zd) {
+    if (zd->zd_prev != NULL) {
+        zd->zd_prev->zd_next = zd->zd_next;
+    } else {
+        fdcache_head = zd->zd_next;
+    }
+    if (zd->zd_next != NULL) {
+        zd->zd_next->zd_prev = zd->zd_prev;
+    } else {
+        fdcache_tail = zd->zd_prev;
+    }
+    zd->zd_prev = zd->zd_next = NULL;
+    fdcache_count--;
+}
+
+
+static void fdcache_push(zfile_fdent_t *zd) {
+    zd->zd_prev = NULL;
+    zd->zd_next = fdcache_head;
+    if (fdcache_head != NULL) {
+        fdcache_head->zd_prev = zd;
+    } else {
+        fdcache_tail = zd;
+    }
+    fdcache_head = zd;
+    fdcache_count++;
+}
+
+
+static void fdcache_free(zfile_fdent_t *zd) {
+    (void) close(zd->zd_fd);
+    free(zd->zd_path);
+    free(zd->zd_real);
+    free(zd);
+}
+
+
+/*
+ * Drop least recently used entries until there are no more than max.
+ * Called with fdcache_lock held.
+ */
+static void fdcache_trim(uint32_t max) {
+    while (fdcache_count > max) {
+        zfile_fdent_t *zd = fdcache_tail;
+        fdcache_unlink(zd);
+        fdcache_free(zd);
+    }
+}
+
+
+/*
+ * A fresh read-only fd for path in zoneid from the cache, or -1 if there
+ * is no entry or it no longer checks out (in which case it's dropped).
+ */
+static int fdcache_get(zoneid_t zoneid, const char *path) {
+    uint32_t h = zone_hash(path);
+    zfile_fdent_t *zd = NULL;
+    struct stat st;
+    char name[32];
+    uint32_t gen = 0;
+    int fd = -1;
+
+    pthread_mutex_lock(&fdcache_lock);
+    for (zd = fdcache_head; zd != NULL; zd = zd->zd_next) {
+        if (zd->zd_hash == h && zd->zd_zoneid == zoneid &&
+            strcmp(zd->zd_path, path) == 0)
+            break;
+    }
+    if (zd == NULL) {
+        pthread_mutex_unlock(&fdcache_lock);
+        return (-1);
+    }
+    fdcache_unlink(zd);
+    gen = fdcache_gen;
+    pthread_mutex_unlock(&fdcache_lock);
+
+    if (gethrtime() < zd->zd_expires &&
+        lstat(zd->zd_real, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_dev == zd->zd_dev && st.st_ino == zd->zd_ino &&
+        st.st_size == zd->zd_size &&
+        st.st_mtim.tv_sec == zd->zd_mtime.tv_sec &&
+        st.st_mtim.tv_nsec == zd->zd_mtime.tv_nsec) {
+        (void) snprintf(name, sizeof(name), "/proc/self/fd/%d", zd->zd_fd);
+        fd = open(name, O_RDONLY | O_NOCTTY);
+    }
+
+    pthread_mutex_lock(&fdcache_lock);
+    if (fd >= 0 && gen == fdcache_gen && fdcache_max > 0) {
+        fdcache_push(zd);
+        fdcache_trim(fdcache_max);
+        zd = NULL;
+    }
+    pthread_mutex_unlock(&fdcache_lock);
+    if (zd != NULL)
+        fdcache_free(zd);
+
+    return (fd);
+}
+
+
+/*
+ * Remember fd, just opened read-only from path in zoneid, keeping a dup of
+ * it.  Files that aren't regular, or that the global zone can't find by
+ * the same path under the zone's root (as through a symlink, which would
+ * resolve against the wrong root), aren't cached.  Failures are ignored;
+ * they only cost a later miss.
+ */
+static void fdcache_put(zoneid_t zoneid, const char *path, int fd) {
+    zfile_fdent_t *zd = NULL;
+    struct stat fst;
+    struct stat st;
+    char root[MAXPATHLEN];
+    char real[MAXPATHLEN];
+
+    if (path[0] != '/' || fstat(fd, &fst) != 0 || !S_ISREG(fst.st_mode))
+        return;
+    if (zone_getattr(zoneid, ZONE_ATTR_ROOT, root, sizeof(root)) < 0)
+        return;
+    if (snprintf(real, sizeof(real), "%s%s", root, path) >=
+        static_cast<int>(sizeof(real)))
+        return;
+    if (lstat(real, &st) != 0 || st.st_dev != fst.st_dev ||
+        st.st_ino != fst.st_ino)
+        return;
+
+    if ((zd = static_cast<zfile_fdent_t *>(calloc(1, sizeof(*zd)))) == NULL)
+        return;
+    zd->zd_zoneid = zoneid;
+    zd->zd_hash = zone_hash(path);
+    zd->zd_path = strdup(path);
+    zd->zd_real = strdup(real);
+    zd->zd_dev = fst.st_dev;
+    zd->zd_ino = fst.st_ino;
+    zd->zd_size = fst.st_size;
+    zd->zd_mtime = fst.st_mtim;
+    zd->zd_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (zd->zd_path == NULL || zd->zd_real == NULL || zd->zd_fd < 0) {
+        if (zd->zd_fd >= 0)
+            (void) close(zd->zd_fd);
+        free(zd->zd_path);
+        free(zd->zd_real);
+        free(zd);
+        return;
+    }
+
+    pthread_mutex_lock(&fdcache_lock);
+    if (fdcache_max == 0) {
+        pthread_mutex_unlock(&fdcache_lock);
+        fdcache_free(zd);
+        return;
+    }
+    zd->zd_expires = gethrtime() + fdcache_ttl;
+    fdcache_push(zd);
+    fdcache_trim(fdcache_max);
+    pthread_mutex_unlock(&fdcache_lock);
+}
+
+
+static void inflight_enter(void) {
+    uint32_t n = atomic_inc_32_nv(&zfile_inflight);
+    uint32_t max = 0;
+
+    while ((max = zfile_inflight_max) < n &&
+           atomic_cas_32(&zfile_inflight_max, max, n) != max) {}
+}
+
+
+static void inflight_exit(void) {
+    atomic_dec_32(&zfile_inflight);
+}
+
+
+static void *pool_worker(void *arg) {
+    zpool_zone_t *zz = NULL;
+    zpool_work_t *zw = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        while (pool_ring == NULL && pool_threads <= pool_size)
+            pthread_cond_wait(&pool_cv, &pool_lock);
+        if (pool_threads > pool_size)
+            break;
+
+        // Take one request from the zone at the head of the ring, and send
+        // the zone to the back if it has more.
+        zz = pool_ring;
+        zw = zz->zz_head;
+        pool_ring = zz->zz_next;
+        if (pool_ring == NULL)
+            pool_ring_tail = NULL;
+        if ((zz->zz_head = zw->zw_next) != NULL) {
+            zz->zz_next = NULL;
+            if (pool_ring_tail != NULL) {
+                pool_ring_tail->zz_next = zz;
+            } else {
+                pool_ring = zz;
+            }
+            pool_ring_tail = zz;
+        } else {
+            free(zz);
+        }
+        pool_queued--;
+        zw->zw_next = pool_running;
+        pool_running = zw;
+        pthread_mutex_unlock(&pool_lock);
+
+        zw->zw_work(zw->zw_req);
+
+        pthread_mutex_lock(&pool_lock);
+        for (zpool_work_t **zwp = &pool_running; *zwp != NULL;
+             zwp = &(*zwp)->zw_next) {
+            if (*zwp == zw) {
+                *zwp = zw->zw_next;
+                break;
+            }
+        }
+        zw->zw_next = pool_done;
+        pool_done = zw;
+        uv_async_send(&pool_async);
+    }
+    pool_threads--;
+    pthread_mutex_unlock(&pool_lock);
+
+    return (NULL);
+}
+
+
+/*
+ * Runs on the loop thread when workers have finished something: hand every
+ * finished request to its after callback, oldest first.
+ */
+static void pool_reap(uv_async_t *handle, int status) {
+    zpool_work_t *done = NULL;
+    zpool_work_t *zw = NULL;
+    zpool_work_t *next = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    for (zw = pool_done; zw != NULL; zw = next) {
+        next = zw->zw_next;
+        zw->zw_next = done;
+        done = zw;
+    }
+    pool_done = NULL;
+    pthread_mutex_unlock(&pool_lock);
+
+    for (zw = done; zw != NULL; zw = next) {
+        next = zw->zw_next;
+        zw->zw_after(zw->zw_req, zw->zw_cancelled ? ZFILE_CANCELLED : 0);
+        free(zw);
+        if (--pool_pending == 0)
+            uv_unref(reinterpret_cast<uv_handle_t *>(&pool_async));
+    }
+}
+
+
+/*
+ * Queue req to run work on the zfile pool and after on the loop thread, in
+ * the manner of uv_queue_work().  Must be called from the loop thread.
+ * Returns -1 with errno set to EAGAIN if the queue is full, or if no worker
+ * thread could be started.
+ */
+static int pool_queue(const char *zone, uv_work_t *req, uv_work_cb work,
+                      uv_after_work_cb after, uint32_t *ticketp = NULL) {
+    zpool_zone_t *zz = NULL;
+    zpool_work_t *zw = NULL;
+    pthread_attr_t attr;
+    pthread_t tid;
+
+    if (!pool_async_ready) {
+        if (uv_async_init(uv_default_loop(), &pool_async, pool_reap) != 0) {
+            errno = EAGAIN;
+            return (-1);
+        }
+        uv_unref(reinterpret_cast<uv_handle_t *>(&pool_async));
+        pool_async_ready = 1;
+    }
+
+    if ((zw = static_cast<zpool_work_t *>(calloc(1, sizeof(*zw)))) == NULL) {
+        errno = ENOMEM;
+        return (-1);
+    }
+    zw->zw_req = req;
+    zw->zw_work = work;
+    zw->zw_after = after;
+
+    pthread_mutex_lock(&pool_lock);
+    if (pool_max_queue > 0 && pool_queued >= pool_max_queue) {
+        pthread_mutex_unlock(&pool_lock);
+        free(zw);
+        errno = EAGAIN;
+        return (-1);
+    }
+
+    if (pool_threads < pool_size) {
+        (void) pthread_attr_init(&attr);
+        (void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        while (pool_threads < pool_size &&
+               pthread_create(&tid, &attr, pool_worker, NULL) == 0)
+            pool_threads++;
+        (void) pthread_attr_destroy(&attr);
+    }
+    if (pool_threads == 0) {
+        pthread_mutex_unlock(&pool_lock);
+        free(zw);
+        errno = EAGAIN;
+        return (-1);
+    }
+
+    for (zz = pool_ring; zz != NULL; zz = zz->zz_next) {
+        if (strcmp(zz->zz_name, zone) == 0)
+            break;
+    }
+    if (zz == NULL) {
+        if ((zz = static_cast<zpool_zone_t *>(calloc(1, sizeof(*zz)))) ==
+            NULL) {
+            pthread_mutex_unlock(&pool_lock);
+            free(zw);
+            errno = ENOMEM;
+            return (-1);
+        }
+        (void) strlcpy(zz->zz_name, zone, sizeof(zz->zz_name));
+        if (pool_ring_tail != NULL) {
+            pool_ring_tail->zz_next = zz;
+        } else {
+            pool_ring = zz;
+        }
+        pool_ring_tail = zz;
+    }
+
+    if (zz->zz_head != NULL) {
+        zz->zz_tail->zw_next = zw;
+    } else {
+        zz->zz_head = zw;
+    }
+    zz->zz_tail = zw;
+    pool_queued++;
+    if (ticketp != NULL) {
+        if (++pool_ticket == 0)
+            pool_ticket = 1;
+        zw->zw_ticket = *ticketp = pool_ticket;
+    }
+    pthread_cond_signal(&pool_cv);
+    pthread_mutex_unlock(&pool_lock);
+
+    if (pool_pending++ == 0)
+        uv_ref(reinterpret_cast<uv_handle_t *>(&pool_async));
+
+    return (0);
+}
+
+/*
+ * Cancel the request pool_queue() handed out ticket for.  If it is still
+ * queued it is taken off its zone and its after callback run now, with
+ * ZFILE_CANCELLED, without the work ever having run; if it is running or
+ * done the callback gets ZFILE_CANCELLED from pool_reap() instead.  Either
+ * way the callback releases whatever the request holds without calling
+ * into JS.  Returns 0, or -1 if the request has already been reaped.
+ */
+static int pool_cancel(uint32_t ticket) {
+    zpool_zone_t *zz = NULL;
+    zpool_zone_t *pz = NULL;
+    zpool_work_t *zw = NULL;
+    zpool_work_t *pw = NULL;
+
+    if (ticket == 0)
+        return (-1);
+
+    pthread_mutex_lock(&pool_lock);
+    for (zz = pool_ring; zz != NULL; pz = zz, zz = zz->zz_next) {
+        for (pw = NULL, zw = zz->zz_head; zw != NULL;
+             pw = zw, zw = zw->zw_next) {
+            if (zw->zw_ticket == ticket)
+                break;
+        }
+        if (zw != NULL)
+            break;
+    }
+
+    if (zw != NULL) {
+        if (pw != NULL) {
+            pw->zw_next = zw->zw_next;
+        } else {
+            zz->zz_head = zw->zw_next;
+        }
+        if (zz->zz_tail == zw)
+            zz->zz_tail = pw;
+        if (zz->zz_head == NULL) {
+            if (pz != NULL) {
+                pz->zz_next = zz->zz_next;
+            } else {
+                pool_ring = zz->zz_next;
+            }
+            if (pool_ring_tail == zz)
+                pool_ring_tail = pz;
+            free(zz);
+        }
+        pool_queued--;
+        pthread_mutex_unlock(&pool_lock);
+
+        zw->zw_after(zw->zw_req, ZFILE_CANCELLED);
+        free(zw);
+        if (--pool_pending == 0)
+            uv_unref(reinterpret_cast<uv_handle_t *>(&pool_async));
+        return (0);
+    }
+
+    for (zw = pool_running; zw != NULL; zw = zw->zw_next) {
+        if (zw->zw_ticket == ticket)
+            break;
+    }
+    if (zw == NULL) {
+        for (zw = pool_done; zw != NULL; zw = zw->zw_next) {
+            if (zw->zw_ticket == ticket)
+                break;
+        }
+    }
+    if (zw != NULL)
+        zw->zw_cancelled = 1;
+    pthread_mutex_unlock(&pool_lock);
+
+    return (zw != NULL ? 0 : -1);
+}
+
+
+/*
+ * Name of the syscall a failed zfile()/agent call was attributed to.
+ */
+static const char *zfile_syscall(int sys) {
+  if (sys < 0 || sys >= ZFILE_SYS_MAX)
+    sys = ZFILE_SYS_ZFILE;
+  return (zfile_syscalls[sys]);
+}
+
+
+/*
+ * Whether a failure reported by zfile()/agent calls is worth retrying
+ * as-is.  Only child creation failing for lack of resources or a signal
+ * qualifies; an error from open(2) inside the zone is the answer.
+ */
+static bool zfile_transient(int sys, int err) {
+  return (sys == ZFILE_SYS_FORK && (err == EAGAIN || err == EINTR));
+}
+
+
+/*
+ * The operation a baton asks for, run against zone zoneid.  Returns >= 0 on
+ * success, or -1 with errno and *sysp set.
+ */
+typedef int (*zfile_op_t)(zoneid_t zoneid, eio_baton_t *baton, int *sysp);
+
+
+/*
+ * Run op for baton on the calling pool thread: look the zone up, retry
+ * what is worth retrying (see zfile_transient()) and record stats.  On
+ * failure the baton's errno is set and -1 returned.
+ */
+static int baton_run(eio_baton_t *baton, zfile_op_t op) {
+    hrtime_t start = gethrtime();
+
+    if (ZFILE_REQUEST_START_ENABLED()) {
+        ZFILE_REQUEST_START(baton->_zone, baton->_path, baton->_mode);
+    }
+    stats_time(ZFILE_PHASE_QUEUE, start - baton->_queued);
+    zoneid_t zoneid = zone_lookup(baton->_zone);
+    if (zoneid < 0) {
+        stats_op(ZFILE_SYS_ZFILE, errno);
+        baton->setErrno("getzoneidbyname", errno);
+        return (-1);
+    }
+    int rc = -1;
+    int sys = ZFILE_SYS_ZFILE;
+    int attempts = 1;
+    inflight_enter();
+    deadline_set(baton->_timeout);
+    do {
+        if ((rc = op(zoneid, baton, &sys)) >= 0)
+            break;
+        // A zone_enter EINVAL means our cached id went stale under a reboot
+        if (sys == ZFILE_SYS_ZONE_ENTER && errno == EINVAL) {
+            if ((zoneid = zone_refresh(baton->_zone, zoneid)) < 0) {
+                deadline_set(0);
+                inflight_exit();
+                stats_op(ZFILE_SYS_ZFILE, errno);
+                baton->setErrno("getzoneidbyname", errno);
+                return (-1);
+            }
+        } else if (!zfile_transient(sys, errno)) {
+            break;
+        }
+    } while (attempts++ < 3);
+    deadline_set(0);
+    inflight_exit();
+    stats_time(ZFILE_PHASE_TOTAL, gethrtime() - start);
+    stats_op(sys, rc < 0 ? errno : 0);
+    if (rc < 0) {
+        baton->setErrno(zfile_syscall(sys), errno);
+        return (-1);
+    }
+
+    return (rc);
+}
+
+
+/*
+ * Read-only opens go through the fd cache when it's on: a hit is counted
+ * and returned without entering the zone, and a miss's fd is remembered.
+ */
+static int op_open(zoneid_t zoneid, eio_baton_t *baton, int *sysp) {
+    zfile_open_t zo = baton->_open;
+    int cache = 0;
+    zfile_stats_t *zs = NULL;
+    int fd = -1;
+
+    zo.zo_mode = baton->_mode;
+    if (zo.zo_flags < 0)
+        zo.zo_flags = open_flags(baton->_mode);
+    // A hit is a reopen of the cached fd, which would skip the hints
+    cache = zo.zo_flags == O_RDONLY && zo.zo_hints == 0 && fdcache_max > 0;
+    zs = cache ? stats_self() : NULL;
+
+    if (cache && (fd = fdcache_get(zoneid, baton->_path)) >= 0) {
+        if (zs != NULL)
+            zs->zs_cache_hits++;
+        return (fd);
+    }
+    if (zs != NULL)
+        zs->zs_cache_misses++;
+
+    if (agents_enabled) {
+        fd = agent_open(zoneid, baton->_path, &zo, sysp);
+    } else {
+        fd = zfile(zoneid, baton->_path, &zo, sysp);
+    }
+    if (cache && fd >= 0)
+        fdcache_put(zoneid, baton->_path, fd);
+
+    return (fd);
+}
+
+
+static void uv_ZFile(uv_work_t *req) {
+    eio_baton_t *baton = static_cast<eio_baton_t *>(req->data);
+    int file_fd = baton_run(baton, op_open);
+
+    if (file_fd >= 0)
+        baton->_fd = file_fd;
+}
+
+
+static void uv_After(uv_work_t *req, int status) {
+    v8::HandleScope scope;
+    eio_open_baton_t *baton = static_cast<eio_open_baton_t *>(
+        static_cast<eio_baton_t *>(req->data));
+
+    // Nobody wants the descriptor of a cancelled open
+    if (status == ZFILE_CANCELLED) {
+        if (baton->_fd >= 0)
+            (void) close(baton->_fd);
+        baton_put(baton);
+        return;
+    }
+
+    int argc = 1;
+    v8::Local<v8::Value> argv[2];
+
+    if (baton->_fd < 0) {
+        argv[0] = node::ErrnoException(baton->_errno, baton->_syscall, "",
+                                       baton->_path);
+    } else {
+        leak_stats.zl_fds++;
+        argc = 2;
+        argv[0] = v8::Local<v8::Value>::New(v8::Null());
+        argv[1] = v8::Integer::New(baton->_fd);
+    }
+
+    if (ZFILE_CALLBACK_FIRED_ENABLED()) {
+        ZFILE_CALLBACK_FIRED(baton->_zone, baton->_path, baton->_fd,
+                             baton->_errno);
+    }
+
+    v8::TryCatch try_catch;
+
+    baton->_callback->Call(v8::Context::GetCurrent()->Global(), argc, argv);
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+
+    baton_put(baton);
+}
+
+
+/*
+ * The optional open(2) flags, creation permissions and hints that zfile()
+ * and zfileSync() take from args[i] on, into zo.  Returns NULL, or the
+ * message to throw a TypeError with.
+ */
+static const char *open_args(const v8::Arguments& args, int i,
+                             zfile_open_t *zo) {
+    if (args.Length() > i && args[i]->IsNumber()) {
+        zo->zo_flags = args[i]->Int32Value();
+        if (zo->zo_flags < 0 || (zo->zo_flags & ~ZFILE_OPEN_FLAGS) != 0)
+            return ("unsupported open flags");
+    }
+    if (args.Length() > i + 1 && args[i + 1]->IsNumber()) {
+        zo->zo_perms = args[i + 1]->Int32Value();
+        if (zo->zo_perms < 0 || zo->zo_perms > 07777)
+            return ("permissions must be from 0 to 07777");
+    }
+    if (args.Length() > i + 2 && args[i + 2]->IsNumber()) {
+        zo->zo_hints = args[i + 2]->Int32Value();
+        if (zo->zo_hints < 0 || (zo->zo_hints & ~ZFILE_HINTS) != 0)
+            return ("unsupported open hints");
+    }
+
+    return (NULL);
+}
+
+static v8::Handle<v8::Value> ZFile(const v8::Arguments& args) {
+    v8::HandleScope scope;
+
+    REQUIRE_STRING_ARG(args, 0, zone);
+    REQUIRE_STRING_ARG(args, 1, path);
+    REQUIRE_INT_ARG(args, 2, mode);
+    REQUIRE_FUNCTION_ARG(args, 3, callback);
+
+    // After the timeout: open(2) flags, creation permissions, and hints
+    zfile_open_t zo = { MODE_R, -1, ZFILE_PERMS, 0 };
+    const char *bad = open_args(args, 5, &zo);
+    if (bad != NULL)
+        RETURN_ARGS_EXCEPTION(bad);
+
+    eio_open_baton_t *baton = baton_get();
+    baton->_open.zo_flags = zo.zo_flags;
+    baton->_open.zo_perms = zo.zo_perms;
+    baton->_open.zo_hints = zo.zo_hints;
+    baton->_mode = mode;
+    if (baton->set(*zone, *path) != 0) {
+        baton_put(baton);
+        RETURN_EXCEPTION("OutOfMemory");
+    }
+
+    baton->_callback = v8::Persistent<v8::Function>::New(callback);
+    baton->_timeout = timeout_arg(args, 4);
+
+    if (ZFILE_REQUEST_QUEUED_ENABLED()) {
+        ZFILE_REQUEST_QUEUED(baton->_zone, baton->_path, baton->_mode);
+    }
+    baton->_queued = gethrtime();
+    uint32_t ticket = 0;
+    if (pool_queue(baton->_zone, &baton->_req, uv_ZFile, uv_After,
+                   &ticket) != 0) {
+        v8::Local<v8::Value> err = node::ErrnoException(errno, "zfile",
+            errno == EAGAIN ? "zfile queue full" : "", baton->_path);
+        baton_put(baton);
+        return scope.Close(err);
+    }
+
+    return scope.Close(v8::Integer::NewFromUnsigned(ticket));
+}
+
+
+/*
+ * Close the fd that an op opened and has finished with, keeping the op's
+ * errno; rc is passed through.
+ */
+static int op_close(int fd, int rc) {
+    int err = errno;
+
+    (void) close(fd);
+    errno = err;
+    return (rc);
+}
+
+
+/*
+ * The read, mmap, scan and hash ops open the file and work on it in one
+ * op, so that baton_run() counts a failure of the second step against the
+ * syscall that failed rather than counting the open's success.
+ */
+static int op_read(zoneid_t zoneid, eio_baton_t *b, int *sysp) {
+    eio_read_baton_t *baton = static_cast<eio_read_baton_t *>(b);
+    int fd = op_open(zoneid, b, sysp);
+
+    if (fd < 0)
+        return (-1);
+    return (op_close(fd, read_whole(fd, baton->_max, &baton->_data,
+                                    &baton->_len, sysp)));
+}
+
+
+static void uv_ZFileRead(uv_work_t *req) {
+    (void) baton_run(static_cast<eio_baton_t *>(req->data), op_read);
+}
+
+
+static void buffer_free(char *data, void *hint) {
+    free(data);
+}
+
+
+static void uv_AfterRead(uv_work_t *req, int status) {
+    v8::HandleScope scope;
+    eio_read_baton_t *baton = static_cast<eio_read_baton_t *>(
+        static_cast<eio_baton_t *>(req->data));
+    delete (req);
+
+    if (status == ZFILE_CANCELLED) {
+        delete baton;
+        return;
+    }
+
+    int argc = 1;
+    v8::Local<v8::Value> argv[2];
+
+    if (baton->_errno != 0) {
+        argv[0] = node::ErrnoException(baton->_errno, baton->_syscall, "",
+                                       baton->_path);
+    } else {
+        // The Buffer takes over _data rather than copying it
+        node::Buffer *buf = node::Buffer::New(baton->_data, baton->_len,
+                                              buffer_free, NULL);
+        baton->_data = NULL;
+        argc = 2;
+        argv[0] = v8::Local<v8::Value>::New(v8::Null());
+        argv[1] = v8::Local<v8::Value>::New(buf->handle_);
+    }
+
+    if (ZFILE_CALLBACK_FIRED_ENABLED()) {
+        ZFILE_CALLBACK_FIRED(baton->_zone, baton->_path, -1, baton->_errno);
+    }
+
+    v8::TryCatch try_catch;
+
+    baton->_callback->Call(v8::Context::GetCurrent()->Global(), argc, argv);
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+
+    delete baton;
+}
+
+
+static int op_mmap(zoneid_t zoneid, eio_baton_t *b, int *sysp) {
+    eio_mmap_baton_t *baton = static_cast<eio_mmap_baton_t *>(b);
+    int fd = op_open(zoneid, b, sysp);
+
+    if (fd < 0)
+        return (-1);
+    return (op_close(fd, map_whole(fd, baton->_advice, &baton->_map,
+                                   &baton->_len, sysp)));
+}
+
+
+static void uv_ZFileMmap(uv_work_t *req) {
+    (void) baton_run(static_cast<eio_baton_t *>(req->data), op_mmap);
+}
+
+
+/* Buffer free callback for a mapping; hint is the mapping's length */
+static void buffer_unmap(char *data, void *hint) {
+    (void) munmap(data, reinterpret_cast<uintptr_t>(hint));
+}
+
+
+static void uv_AfterMmap(uv_work_t *req, int status) {
+    v8::HandleScope scope;
+    eio_mmap_baton_t *baton = static_cast<eio_mmap_baton_t *>(
+        static_cast<eio_baton_t *>(req->data));
+    delete (req);
+
+    int argc = 1;
+    v8::Local<v8::Value> argv[2];
+
+    if (baton->_errno != 0) {
+        argv[0] = node::ErrnoException(baton->_errno, baton->_syscall, "",
+                                       baton->_path);
+    } else {
+        node::Buffer *buf = NULL;
+        if (baton->_map == NULL) {
+            buf = node::Buffer::New(0);
+        } else {
+            buf = node::Buffer::New(static_cast<char *>(baton->_map),
+                                    baton->_len, buffer_unmap,
+                                    reinterpret_cast<void *>(baton->_len));
+            baton->_map = NULL;
+        }
+        argc = 2;
+        argv[0] = v8::Local<v8::Value>::New(v8::Null());
+        argv[1] = v8::Local<v8::Value>::New(buf->handle_);
+    }
+
+    if (ZFILE_CALLBACK_FIRED_ENABLED()) {
+        ZFILE_CALLBACK_FIRED(baton->_zone, baton->_path, -1, baton->_errno);
+    }
+
+    v8::TryCatch try_catch;
+
+    baton->_callback->Call(v8::Context::GetCurrent()->Global(), argc, argv);
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+
+    delete baton;
+}
+
+
+static int op_scan(zoneid_t zoneid, eio_baton_t *b, int *sysp) {
+    eio_scan_baton_t *baton = static_cast<eio_scan_baton_t *>(b);
+    int fd = op_open(zoneid, b, sysp);
+
+    if (fd < 0)
+        return (-1);
+    return (op_close(fd, scan_fd(fd, &baton->_scan, sysp)));
+}
+
+
+static void uv_ZFileScan(uv_work_t *req) {
+    (void) baton_run(static_cast<eio_baton_t *>(req->data), op_scan);
+}
+
+
+static void uv_AfterScan(uv_work_t *req, int status) {
+    v8::HandleScope scope;
+    eio_scan_baton_t *baton = static_cast<eio_scan_baton_t *>(
+        static_cast<eio_baton_t *>(req->data));
+    zfile_scan_t *zc = &baton->_scan;
+    delete (req);
+
+    int argc = 1;
+    v8::Local<v8::Value> argv[3];
+
+    if (baton->_errno != 0) {
+        argv[0] = node::ErrnoException(baton->_errno, baton->_syscall, "",
+                                       baton->_path);
+    } else {
+        v8::Local<v8::Array> matches = v8::Array::New(zc->zc_nmatches);
+        v8::Local<v8::String> offset_sym = v8::String::New("offset");
+        v8::Local<v8::String> line_sym = v8::String::New("line");
+
+        for (int i = 0; i < zc->zc_nmatches; i++) {
+            zfile_match_t *zm = &zc->zc_matches[i];
+            v8::Local<v8::Number> off =
+                v8::Number::New(static_cast<double>(zm->zm_off));
+            if (!zc->zc_keep) {
+                matches->Set(i, off);
+                continue;
+            }
+            v8::Local<v8::Object> m = v8::Object::New();
+            m->Set(offset_sym, off);
+            m->Set(line_sym, v8::String::New(zc->zc_text + zm->zm_text,
+                                             zm->zm_len));
+            matches->Set(i, m);
+        }
+
+        argc = 3;
+        argv[0] = v8::Local<v8::Value>::New(v8::Null());
+        argv[1] = matches;
+        argv[2] = v8::Local<v8::Value>::New(
+            v8::Boolean::New(zc->zc_truncated != 0));
+    }
+
+    if (ZFILE_CALLBACK_FIRED_ENABLED()) {
+        ZFILE_CALLBACK_FIRED(baton->_zone, baton->_path, -1, baton->_errno);
+    }
+
+    v8::TryCatch try_catch;
+
+    baton->_callback->Call(v8::Context::GetCurrent()->Global(), argc, argv);
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+
+    delete baton;
+}
+
+
+static int op_hash(zoneid_t zoneid, eio_baton_t *b, int *sysp) {
+    eio_hash_baton_t *baton = static_cast<eio_hash_baton_t *>(b);
+    int fd = op_open(zoneid, b, sysp);
+
+    if (fd < 0)
+        return (-1);
+    return (op_close(fd, hash_fd(fd, baton->_algo, baton->_digest,
+                                 &baton->_dlen, &baton->_size,
+                                 &baton->_mtime, sysp)));
+}
+
+
+static void uv_ZFileHash(uv_work_t *req) {
+    (void) baton_run(static_cast<eio_baton_t *>(req->data), op_hash);
+}
+
+
+static void uv_AfterHash(uv_work_t *req, int status) {
+    v8::HandleScope scope;
+    eio_hash_baton_t *baton = static_cast<eio_hash_baton_t *>(
+        static_cast<eio_baton_t *>(req->data));
+    delete (req);
+
+    int argc = 1;
+    v8::Local<v8::Value> argv[2];
+
+    if (baton->_errno != 0) {
+        argv[0] = node::ErrnoException(baton->_errno, baton->_syscall, "",
+                                       baton->_path);
+    } else {
+        static const char hex[] = "0123456789abcdef";
+        char digest[ZFILE_DIGEST_MAX * 2];
+        for (size_t i = 0; i < baton->_dlen; i++) {
+            digest[i * 2] = hex[baton->_digest[i] >> 4];
+            digest[i * 2 + 1] = hex[baton->_digest[i] & 0xf];
+        }
+
+        double mtime = static_cast<double>(baton->_mtime.tv_sec) * 1000 +
+            baton->_mtime.tv_nsec / 1000000;
+        v8::Local<v8::Object> result = v8::Object::New();
+        result->Set(v8::String::New("digest"),
+                    v8::String::New(digest, baton->_dlen * 2));
+        result->Set(v8::String::New("size"),
+                    v8::Number::New(static_cast<double>(baton->_size)));
+        result->Set(v8::String::New("mtime"), v8::Date::New(mtime));
+
+        argc = 2;
+        argv[0] = v8::Local<v8::Value>::New(v8::Null());
+        argv[1] = result;
+    }
+
+    if (ZFILE_CALLBACK_FIRED_ENABLED()) {
+        ZFILE_CALLBACK_FIRED(baton->_zone, baton->_path, -1, baton->_errno);
+    }
+
+    v8::TryCatch try_catch;
+
+    baton->_callback->Call(v8::Context::GetCurrent()->Global(), argc, argv);
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+
+    delete baton;
+}
+
+
+static int op_query(zoneid_t zoneid, eio_baton_t *baton, int *sysp) {
+    eio_query_baton_t *qb = static_cast<eio_query_baton_t *>(baton);
+
+    free(qb->_data);
+    qb->_data = NULL;
+    qb->_len = 0;
+    if (agents_enabled) {
+        return (agent_query(zoneid, qb->_op, qb->_path, &qb->_data,
+                            &qb->_len, sysp));
+    }
+    return (zfile_query(zoneid, qb->_op, qb->_path, &qb->_data, &qb->_len,
+                        sysp));
+}
+
+
+static void uv_ZFileQuery(uv_work_t *req) {
+    eio_baton_t *baton = static_cast<eio_baton_t *>(req->data);
+
+    (void) baton_run(baton, op_query);
+}
+
+
+static v8::Local<v8::Value> stat_time(const int64_t *ts) {
+    return (v8::Date::New(static_cast<double>(ts[0]) * 1000 +
+                          ts[1] / 1000000));
+}
+
+
+static void uv_AfterQuery(uv_work_t *req, int status) {
+    v8::HandleScope scope;
+    eio_query_baton_t *baton = static_cast<eio_query_baton_t *>(
+        static_cast<eio_baton_t *>(req->data));
+    delete (req);
+
+    if (status == ZFILE_CANCELLED) {
+        delete baton;
+        return;
+    }
+
+    int argc = 1;
+    v8::Local<v8::Value> argv[2];
+
+    if (baton->_errno != 0) {
+        argv[0] = node::ErrnoException(baton->_errno, baton->_syscall, "",
+                                       baton->_path);
+    } else if (baton->_op == ZFILE_OP_STAT) {
+        zfile_stat_t zi;
+        v8::Local<v8::Object> st = v8::Object::New();
+
+        memset(&zi, 0, sizeof(zi));
+        if (baton->_len == sizeof(zi))
+            memcpy(&zi, baton->_data, sizeof(zi));
+        st->Set(v8::String::NewSymbol("dev"),
+                v8::Number::New(static_cast<double>(zi.zi_dev)));
+        st->Set(v8::String::NewSymbol("ino"),
+                v8::Number::New(static_cast<double>(zi.zi_ino)));
+        st->Set(v8::String::NewSymbol("mode"),
+                v8::Integer::NewFromUnsigned(zi.zi_mode));
+        st->Set(v8::String::NewSymbol("nlink"),
+                v8::Integer::NewFromUnsigned(zi.zi_nlink));
+        st->Set(v8::String::NewSymbol("uid"),
+                v8::Integer::NewFromUnsigned(zi.zi_uid));
+        st->Set(v8::String::NewSymbol("gid"),
+                v8::Integer::NewFromUnsigned(zi.zi_gid));
+        st->Set(v8::String::NewSymbol("size"),
+                v8::Number::New(static_cast<double>(zi.zi_size)));
+        st->Set(v8::String::NewSymbol("blocks"),
+                v8::Number::New(static_cast<double>(zi.zi_blocks)));
+        st->Set(v8::String::NewSymbol("atime"), stat_time(zi.zi_atime));
+        st->Set(v8::String::NewSymbol("mtime"), stat_time(zi.zi_mtime));
+        st->Set(v8::String::NewSymbol("ctime"), stat_time(zi.zi_ctime));
+
+        argc = 2;
+        argv[0] = v8::Local<v8::Value>::New(v8::Null());
+        argv[1] = st;
+    } else {
+        v8::Local<v8::Array> names = v8::Array::New();
+        const char *p = baton->_data;
+        const char *end = p + baton->_len;
+        uint32_t i = 0;
+
+        while (p < end) {
+            const char *nul = static_cast<const char *>(
+                memchr(p, '\0', end - p));
+            if (nul == NULL)
+                break;
+            names->Set(i++, v8::String::New(p, nul - p));
+            p = nul + 1;
+        }
+
+        argc = 2;
+        argv[0] = v8::Local<v8::Value>::New(v8::Null());
+        argv[1] = names;
+    }
+
+    if (ZFILE_CALLBACK_FIRED_ENABLED()) {
+        ZFILE_CALLBACK_FIRED(baton->_zone, baton->_path, -1, baton->_errno);
+    }
+
+    v8::TryCatch try_catch;
+
+    baton->_callback->Call(v8::Context::GetCurrent()->Global(), argc, argv);
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+
+    delete baton;
+}
+
+
+/*
+ * Open b's file for a copy: through its zone, or if it has none directly.
+ * On failure the error is left in b.
+ */
+static int copy_open(eio_baton_t *b) {
+    int flags = b->_open.zo_flags < 0 ? open_flags(b->_mode) :
+        b->_open.zo_flags;
+    int fd = -1;
+
+    if (b->_zone[0] != '\0')
+        return (baton_run(b, op_open));
+
+    if ((fd = open(b->_path, flags, b->_open.zo_perms)) < 0) {
+        b->setErrno("open", errno);
+        return (-1);
+    }
+    (void) close_on_exec(fd);
+    return (fd);
+}
+
+
+/*
+ * Run query op on the target of a copy, naming path (with ZFILE_OP_RENAME,
+ * the old and new names back to back).
+ */
+static int copy_target_query(eio_copy_baton_t *baton, int op, char *path) {
+    eio_query_baton_t *t = &baton->_target;
+    char *target = t->_path;
+    int rc = 0;
+
+    if (t->_zone[0] == '\0') {
+        rc = op == ZFILE_OP_RENAME ? rename(path, path + strlen(path) + 1) :
+            unlink(path);
+        if (rc != 0)
+            t->setErrno(op == ZFILE_OP_RENAME ? "rename" : "unlink", errno);
+        return (rc);
+    }
+
+    t->_op = op;
+    t->_path = path;
+    rc = baton_run(t, op_query) < 0 ? -1 : 0;
+    t->_path = target;
+    return (rc);
+}
+
+
+/*
+ * lstat() the target of a copy through its zone into *zi.  Returns 0 if it
+ * exists, 1 if it doesn't, and -1 with the error left in the target baton.
+ */
+static int copy_target_stat(eio_copy_baton_t *baton, zfile_stat_t *zi) {
+    eio_query_baton_t *t = &baton->_target;
+    struct stat st;
+
+    if (t->_zone[0] == '\0') {
+        if (lstat(t->_path, &st) != 0) {
+            if (errno == ENOENT)
+                return (1);
+            t->setErrno("lstat", errno);
+            return (-1);
+        }
+        zi->zi_mode = st.st_mode;
+        zi->zi_uid = st.st_uid;
+        zi->zi_gid = st.st_gid;
+        return (0);
+    }
+
+    t->_op = ZFILE_OP_STAT;
+    if (baton_run(t, op_query) < 0) {
+        if (t->_errno != ENOENT)
+            return (-1);
+        t->_errno = 0;
+        return (1);
+    }
+    if (t->_len != sizeof(*zi)) {
+        t->setErrno("lstat", EPROTO);
+        return (-1);
+    }
+    memcpy(zi, t->_data, sizeof(*zi));
+    return (0);
+}
+
+
+static void uv_ZFileCopy(uv_work_t *req) {
+    eio_copy_baton_t *baton = static_cast<eio_copy_baton_t *>(
+        static_cast<eio_baton_t *>(req->data));
+    eio_query_baton_t *t = &baton->_target;
+    char *target = t->_path;
+    char *names = NULL;
+    struct stat st;
+    zfile_stat_t zi;
+    int64_t n = 0;
+    int sys = ZFILE_SYS_ZFILE;
+    int exists = 1;
+    int src = -1;
+    int dst = -1;
+
+    if ((src = copy_open(baton)) < 0)
+        return;
+    if (fstat(src, &st) != 0) {
+        baton->setErrno("fstat", errno);
+        (void) close(src);
+        return;
+    }
+    // A device or FIFO source could be endless, or never finish a read
+    if (!S_ISREG(st.st_mode)) {
+        baton->setErrno("read", S_ISDIR(st.st_mode) ? EISDIR : ENODEV);
+        (void) close(src);
+        return;
+    }
+
+    /*
+     * A new target gets the source's permissions, less setuid, setgid and
+     * sticky: it's created by root, so anything more would hand out a
+     * root-owned setuid file.  An existing target keeps its owner and mode,
+     * as O_TRUNC does, so an atomic copy carries them over to the
+     * replacement and refuses to replace anything but a regular file.
+     */
+    t->_mode = MODE_W;
+    t->_open.zo_perms = st.st_mode & 0777;
+    t->_open.zo_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    if (baton->_flags & ZFILE_COPY_ATOMIC) {
+        size_t len = strlen(target) + 64;
+        if ((exists = copy_target_stat(baton, &zi)) == 0 &&
+            !S_ISREG(zi.zi_mode)) {
+            t->setErrno("lstat", S_ISDIR(zi.zi_mode) ? EISDIR : EINVAL);
+        }
+        if (t->_errno != 0) {
+            baton->setErrno(t->_syscall, t->_errno);
+            baton->_failed = target;
+            (void) close(src);
+            return;
+        }
+        if ((baton->_tmp = static_cast<char *>(malloc(len))) == NULL) {
+            baton->setErrno("malloc", ENOMEM);
+            (void) close(src);
+            return;
+        }
+        (void) snprintf(baton->_tmp, len, "%s.zfile-%d-%llx", target,
+                        static_cast<int>(getpid()), gethrtime());
+        t->_open.zo_flags = O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW;
+        t->_path = baton->_tmp;
+    }
+
+    dst = copy_open(t);
+    t->_path = target;
+    if (dst < 0) {
+        baton->setErrno(t->_syscall, t->_errno);
+        baton->_failed = target;
+        (void) close(src);
+        return;
+    }
+
+    // The opens ran under baton_run()'s deadline; give copy_fd() its own
+    deadline_set(baton->_timeout);
+    if (exists == 0 && fchown(dst, zi.zi_uid, zi.zi_gid) != 0) {
+        baton->setErrno("fchown", errno);
+    } else if (exists == 0 && fchmod(dst, zi.zi_mode & 07777) != 0) {
+        baton->setErrno("fchmod", errno);
+    } else if ((n = copy_fd(src, dst, &sys)) < 0) {
+        baton->setErrno(zfile_syscall(sys), errno);
+    } else if ((baton->_flags & ZFILE_COPY_FSYNC) && fsync(dst) != 0) {
+        baton->setErrno("fsync", errno);
+    } else {
+        baton->_bytes = n;
+    }
+    deadline_set(0);
+    if (close(dst) != 0 && baton->_errno == 0)
+        baton->setErrno("close", errno);
+    (void) close(src);
+    if (baton->_errno != 0)
+        baton->_failed = target;
+
+    if (baton->_tmp == NULL)
+        return;
+
+    if (baton->_errno == 0) {
+        size_t tlen = strlen(baton->_tmp) + 1;
+        size_t len = strlen(target) + 1;
+        if ((names = static_cast<char *>(malloc(tlen + len))) == NULL) {
+            baton->setErrno("malloc", ENOMEM);
+        } else {
+            memcpy(names, baton->_tmp, tlen);
+            memcpy(names + tlen, target, len);
+            if (copy_target_query(baton, ZFILE_OP_RENAME, names) != 0) {
+                baton->setErrno(t->_syscall, t->_errno);
+                baton->_failed = target;
+            }
+            free(names);
+        }
+    }
+    if (baton->_errno != 0)
+        (void) copy_target_query(baton, ZFILE_OP_UNLINK, baton->_tmp);
+}
+
+
+static void uv_AfterCopy(uv_work_t *req, int status) {
+    v8::HandleScope scope;
+    eio_copy_baton_t *baton = static_cast<eio_copy_baton_t *>(
+        static_cast<eio_baton_t *>(req->data));
+    delete (req);
+
+    int argc = 1;
+    v8::Local<v8::Value> argv[2];
+
+    if (baton->_errno != 0) {
+        argv[0] = node::ErrnoException(baton->_errno, baton->_syscall, "",
+            baton->_failed != NULL ? baton->_failed : baton->_path);
+    } else {
+        v8::Local<v8::Object> result = v8::Object::New();
+        result->Set(v8::String::New("bytes"),
+                    v8::Number::New(static_cast<double>(baton->_bytes)));
+
+        argc = 2;
+        argv[0] = v8::Local<v8::Value>::New(v8::Null());
+        argv[1] = result;
+    }
+
+    if (ZFILE_CALLBACK_FIRED_ENABLED()) {
+        ZFILE_CALLBACK_FIRED(baton->_zone, baton->_path, -1, baton->_errno);
+    }
+
+    v8::TryCatch try_catch;
+
+    baton->_callback->Call(v8::Context::GetCurrent()->Global(), argc, argv);
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+
+    delete baton;
+}
+
+
+/*
+ * Fill the baton's piece of Buffer, stopping short only at end of file.
+ */
+static void uv_ZFilePread(uv_work_t *req) {
+    eio_pread_baton_t *baton = static_cast<eio_pread_baton_t *>(
+        static_cast<eio_baton_t *>(req->data));
+    ssize_t n = 0;
+
+    while (baton->_nread < baton->_len) {
+        n = pread(baton->_fd, baton->_buf + baton->_nread,
+                  baton->_len - baton->_nread, baton->_pos + baton->_nread);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            baton->setErrno("pread", errno);
+            return;
+        }
+        if (n == 0)
+            break;
+        baton->_nread += n;
+    }
+}
+
+
+static void uv_AfterPread(uv_work_t *req, int status) {
+    v8::HandleScope scope;
+    eio_pread_baton_t *baton = static_cast<eio_pread_baton_t *>(
+        static_cast<eio_baton_t *>(req->data));
+    delete (req);
+
+    int argc = 1;
+    v8::Local<v8::Value> argv[2];
+
+    if (baton->_errno != 0) {
+        argv[0] = node::ErrnoException(baton->_errno, baton->_syscall, "");
+    } else {
+        argc = 2;
+        argv[0] = v8::Local<v8::Value>::New(v8::Null());
+        argv[1] = v8::Number::New(static_cast<double>(baton->_nread));
+    }
+
+    v8::TryCatch try_catch;
+
+    baton->_callback->Call(v8::Context::GetCurrent()->Global(), argc, argv);
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+
+    delete baton;
+}
+
+
+static int op_write(zoneid_t zoneid, eio_baton_t *baton, int *sysp) {
+    eio_write_baton_t *wb = static_cast<eio_write_baton_t *>(baton);
+
+    if (agents_enabled) {
+        return (agent_write(zoneid, wb->_path, wb->_data, wb->_len,
+                            wb->_flags, sysp));
+    }
+    return (zfile_write(zoneid, wb->_path, wb->_data, wb->_len, wb->_flags,
+                        sysp));
+}
+
+
+static void uv_ZFileWrite(uv_work_t *req) {
+    (void) baton_run(static_cast<eio_baton_t *>(req->data), op_write);
+}
+
+
+static void uv_AfterWrite(uv_work_t *req, int status) {
+    v8::HandleScope scope;
+    eio_baton_t *baton = static_cast<eio_baton_t *>(req->data);
+    delete (req);
+
+    v8::Local<v8::Value> argv[1];
+
+    if (baton->_errno != 0) {
+        argv[0] = node::ErrnoException(baton->_errno, baton->_syscall, "",
+                                       baton->_path);
+    } else {
+        argv[0] = v8::Local<v8::Value>::New(v8::Null());
+    }
+
+    if (ZFILE_CALLBACK_FIRED_ENABLED()) {
+        ZFILE_CALLBACK_FIRED(baton->_zone, baton->_path, -1, baton->_errno);
+    }
+
+    v8::TryCatch try_catch;
+
+    baton->_callback->Call(v8::Context::GetCurrent()->Global(), 1, argv);
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+
+    delete baton;
+}
+
+
+static void uv_ZFileMany(uv_work_t *req) {
+    eio_batch_baton_t *baton = static_cast<eio_batch_baton_t *>(req->data);
+    hrtime_t start = gethrtime();
+
+    if (ZFILE_REQUEST_START_ENABLED()) {
+        ZFILE_REQUEST_START(baton->_zone, PROBE_STR(""), -1);
+    }
+    stats_time(ZFILE_PHASE_QUEUE, start - baton->_queued);
+    zoneid_t zoneid = zone_lookup(baton->_zone);
+    if (zoneid < 0) {
+        stats_op(ZFILE_SYS_ZFILE, errno);
+        baton->setErrno("getzoneidbyname", errno);
+        return;
+    }
+    int rc = -1;
+    int sys = ZFILE_SYS_ZFILE;
+    int attempts = 1;
+    inflight_enter();
+    deadline_set(baton->_timeout);
+    do {
+        if (agents_enabled) {
+            rc = agent_open_many(zoneid, &baton->_batch, &sys);
+        } else {
+            rc = zfile_many(zoneid, &baton->_batch, &sys);
+        }
+        if (rc == 0)
+            break;
+        if (sys == ZFILE_SYS_ZONE_ENTER && errno == EINVAL) {
+            if ((zoneid = zone_refresh(baton->_zone, zoneid)) < 0) {
+                deadline_set(0);
+                inflight_exit();
+                stats_op(ZFILE_SYS_ZFILE, errno);
+                baton->setErrno("getzoneidbyname", errno);
+                return;
+            }
+        } else if (!zfile_transient(sys, errno)) {
+            break;
+        }
+    } while (attempts++ < 3);
+    deadline_set(0);
+    inflight_exit();
+    stats_time(ZFILE_PHASE_TOTAL, gethrtime() - start);
+    stats_op(sys, rc != 0 ? errno : 0);
+    if (rc != 0) {
+        baton->setErrno(zfile_syscall(sys), errno);
+        return;
+    }
+
+    return;
+}
+
+
+static void uv_AfterMany(uv_work_t *req, int status) {
+    v8::HandleScope scope;
+    eio_batch_baton_t *baton = static_cast<eio_batch_baton_t *>(req->data);
+    delete (req);
+
+    int argc = 1;
+    v8::Local<v8::Value> argv[2];
+
+    if (baton->_errno != 0) {
+        argv[0] = node::ErrnoException(baton->_errno, baton->_syscall);
+    } else {
+        zfile_batch_t *zb = &baton->_batch;
+        const char *path = zb->zb_buf + zb->zb_count * sizeof(int32_t);
+        v8::Local<v8::Array> results = v8::Array::New(zb->zb_count);
+
+        for (uint32_t i = 0; i < zb->zb_count; i++) {
+            if (zb->zb_fds[i] >= 0) {
+                leak_stats.zl_fds++;
+                results->Set(i, v8::Integer::New(zb->zb_fds[i]));
+            } else {
+                results->Set(i, node::ErrnoException(zb->zb_errs[i],
+                                                     "open", "", path));
+            }
+            path += strlen(path) + 1;
+        }
+
+        argc = 2;
+        argv[0] = v8::Local<v8::Value>::New(v8::Null());
+        argv[1] = results;
+    }
+
+    if (ZFILE_CALLBACK_FIRED_ENABLED()) {
+        ZFILE_CALLBACK_FIRED(baton->_zone, PROBE_STR(""), -1, baton->_errno);
+    }
+
+    v8::TryCatch try_catch;
+
+    baton->_callback->Call(v8::Context::GetCurrent()->Global(), argc, argv);
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+
+    delete baton;
+}
+
+
+/*
+ * zfileRead(zone, path, maxSize, callback): callback(err, buffer) with the
+ * whole of the file, opened, read and closed in a single trip to the pool.
+ */
+static v8::Handle<v8::Value> ZFileRead(const v8::Arguments& args) {
+    v8::HandleScope scope;
+
+    REQUIRE_STRING_ARG(args, 0, zone);
+    REQUIRE_STRING_ARG(args, 1, path);
+    REQUIRE_INT_ARG(args, 2, max);
+    REQUIRE_FUNCTION_ARG(args, 3, callback);
+
+    if (max < 0)
+        RETURN_ARGS_EXCEPTION("maxSize must be >= 0");
+
+    eio_read_baton_t *baton = new eio_read_baton_t();
+    baton->_zone = strdup(*zone);
+    baton->_path = strdup(*path);
+    baton->_mode = MODE_R;
+    baton->_max = max;
+    if (baton->_zone == NULL || baton->_path == NULL) {
+        delete baton;
+        RETURN_EXCEPTION("OutOfMemory");
+    }
+
+    baton->_callback = v8::Persistent<v8::Function>::New(callback);
+    baton->_timeout = timeout_arg(args, 4);
+
+    uv_work_t *req = new uv_work_t;
+    req->data = static_cast<eio_baton_t *>(baton);
+    if (ZFILE_REQUEST_QUEUED_ENABLED()) {
+        ZFILE_REQUEST_QUEUED(baton->_zone, baton->_path, baton->_mode);
+    }
+    baton->_queued = gethrtime();
+    uint32_t ticket = 0;
+    if (pool_queue(baton->_zone, req, uv_ZFileRead, uv_AfterRead,
+                   &ticket) != 0) {
+        v8::Local<v8::Value> err = node::ErrnoException(errno, "zfile",
+            errno == EAGAIN ? "zfile queue full" : "", baton->_path);
+        delete req;
+        delete baton;
+        return scope.Close(err);
+    }
+
+    return scope.Close(v8::Integer::NewFromUnsigned(ticket));
+}
+
+
+/*
+ * The calling thread's contract template is left active after a fork, so
+ * that a pool thread sets it up only once.  The loop thread forks node's
+ * own children too, and those must not land in contracts made from it, so
+ * the sync calls below take it down again when they're done.
+ */
+static void thread_template_clear(void) {
+  zfile_thread_t *zt = thread_self();
+
+  if (zt == NULL || zt->zt_tmpl_fd < 0)
+    return;
+  (void) ct_tmpl_clear(zt->zt_tmpl_fd);
+  (void) close(zt->zt_tmpl_fd);
+  zt->zt_tmpl_fd = -1;
+}
+
+
+/*
+ * zfileSync(zone, path, mode, timeout, flags, perms, hints): the fd, opened
+ * on the calling thread with the same agent, cache and retry handling as
+ * zfile(), or a thrown ErrnoException.  It blocks the event loop for the
+ * whole open, so it is meant for startup only.
+ */
+static v8::Handle<v8::Value> ZFileSync(const v8::Arguments& args) {
+    v8::HandleScope scope;
+
+    REQUIRE_STRING_ARG(args, 0, zone);
+    REQUIRE_STRING_ARG(args, 1, path);
+    REQUIRE_INT_ARG(args, 2, mode);
+
+    eio_baton_t baton;
+    const char *bad = open_args(args, 4, &baton._open);
+    if (bad != NULL)
+        RETURN_ARGS_EXCEPTION(bad);
+
+    baton._zone = strdup(*zone);
+    baton._path = strdup(*path);
+    baton._mode = mode;
+    if (baton._zone == NULL || baton._path == NULL)
+        RETURN_EXCEPTION("OutOfMemory");
+    baton._timeout = timeout_arg(args, 3);
+
+    uv_work_t req;
+    req.data = &baton;
+    baton._queued = gethrtime();
+    uv_ZFile(&req);
+    thread_template_clear();
+
+    if (baton._fd < 0) {
+        return v8::ThrowException(node::ErrnoException(baton._errno,
+            baton._syscall, "", baton._path));
+    }
+
+    leak_stats.zl_fds++;
+    return scope.Close(v8::Integer::New(baton._fd));
+}
+
+
+/*
+ * zfileReadSync(zone, path, max, timeout): readZoneFile() on the calling
+ * thread, returning the Buffer or throwing.  Startup only, as zfileSync().
+ */
+static v8::Handle<v8::Value> ZFileReadSync(const v8::Arguments& args) {
+    v8::HandleScope scope;
+
+    REQUIRE_STRING_ARG(args, 0, zone);
+    REQUIRE_STRING_ARG(args, 1, path);
+    REQUIRE_INT_ARG(args, 2, max);
+
+    if (max < 0)
+        RETURN_ARGS_EXCEPTION("maxSize must be >= 0");
+
+    eio_read_baton_t baton;
+    baton._zone = strdup(*zone);
+    baton._path = strdup(*path);
+    baton._mode = MODE_R;
+    baton._max = max;
+    if (baton._zone == NULL || baton._path == NULL)
+        RETURN_EXCEPTION("OutOfMemory");
+    baton._timeout = timeout_arg(args, 3);
+
+    uv_work_t req;
+    req.data = static_cast<eio_baton_t *>(&baton);
+    baton._queued = gethrtime();
+    uv_ZFileRead(&req);
+    thread_template_clear();
+
+    if (baton._errno != 0) {
+        return v8::ThrowException(node::ErrnoException(baton._errno,
+            baton._syscall, "", baton._path));
+    }
+
+    node::Buffer *buf = node::Buffer::New(baton._data, baton._len,
+                                          buffer_free, NULL);
+    baton._data = NULL;
+    return scope.Close(buf->handle_);
+}
+
+
+/*
+ * Associate zv with the port, as of the file's current times, so that the
+ * next change after now fires.  Called with watch_lock held.  Returns 0, or
+ * -1 with errno set.
+ */
+static int watch_arm(zfile_watch_t *zv) {
+  struct stat st;
+
+  if (stat(zv->zv_name, &st) != 0)
+    return (-1);
+
+  zv->zv_fobj.fo_atime = st.st_atim;
+  zv->zv_fobj.fo_mtime = st.st_mtim;
+  zv->zv_fobj.fo_ctime = st.st_ctim;
+  zv->zv_fobj.fo_name = zv->zv_name;
+  if (port_associate(watch_port, PORT_SOURCE_FILE,
+                     reinterpret_cast<uintptr_t>(&zv->zv_fobj),
+                     FILE_MODIFIED | FILE_TRUNC,
+                     reinterpret_cast<void *>(
+                         static_cast<uintptr_t>(zv->zv_id))) != 0)
+    return (-1);
+
+  zv->zv_armed = 1;
+  return (0);
+}
+
+
+static void *watch_thread(void *arg) {
+  port_event_t pe;
+  zfile_watch_t *zv = NULL;
+  uint32_t id = 0;
+  int events = 0;
+
+  for (;;) {
+    if (port_get(watch_port, &pe, NULL) != 0) {
+      if (errno == EINTR)
+        continue;
+      trace(ZFILE_TRACE_PORT_ERROR, -1, -1, errno, -1);
+      break;
+    }
+    if (pe.portev_source != PORT_SOURCE_FILE)
+      continue;
+
+    events = 0;
+    if (pe.portev_events & FILE_MODIFIED)
+      events |= ZFILE_WATCH_MODIFIED;
+    if (pe.portev_events & FILE_TRUNC)
+      events |= ZFILE_WATCH_TRUNC;
+    if (pe.portev_events & FILE_EXCEPTION)
+      events |= ZFILE_WATCH_GONE;
+    id = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(pe.portev_user));
+
+    pthread_mutex_lock(&watch_lock);
+    for (zv = watch_list; zv != NULL; zv = zv->zv_next) {
+      if (zv->zv_id == id)
+        break;
+    }
+    if (zv != NULL) {
+      zv->zv_armed = 0;
+      if (!(events & ZFILE_WATCH_GONE) && watch_arm(zv) != 0)
+        events |= ZFILE_WATCH_GONE;
+      zv->zv_pending |= events;
+    }
+    pthread_mutex_unlock(&watch_lock);
+
+    if (zv != NULL)
+      uv_async_send(&watch_async);
+  }
+
+  return (NULL);
+}
+
+
+/*
+ * Runs on the loop thread when watches have fired.  watch_lock is dropped
+ * around each callback, which may well remove watches, so the list is
+ * walked again from the top after each one.
+ */
+static void watch_reap(uv_async_t *handle, int status) {
+    v8::HandleScope scope;
+    zfile_watch_t *zv = NULL;
+    int events = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&watch_lock);
+        for (zv = watch_list; zv != NULL; zv = zv->zv_next) {
+            if (zv->zv_pending != 0)
+                break;
+        }
+        if (zv != NULL) {
+            events = zv->zv_pending;
+            zv->zv_pending = 0;
+        }
+        pthread_mutex_unlock(&watch_lock);
+
+        if (zv == NULL)
+            break;
+
+        v8::Local<v8::Value> argv[1] = { v8::Integer::New(events) };
+        v8::TryCatch try_catch;
+
+        zv->zv_callback->Call(v8::Context::GetCurrent()->Global(), 1, argv);
+
+        if (try_catch.HasCaught()) {
+            node::FatalException(try_catch);
+        }
+    }
+}
+
+
+/*
+ * Start the watch thread and its port.  Returns 0, or -1 with errno set.
+ */
+static int watch_init(void) {
+    pthread_attr_t attr;
+    pthread_t tid;
+    int err = 0;
+
+    if (watch_port >= 0)
+        return (0);
+
+    if (!watch_async_ready) {
+        if (uv_async_init(uv_default_loop(), &watch_async, watch_reap) != 0) {
+            errno = EAGAIN;
+            return (-1);
+        }
+        uv_unref(reinterpret_cast<uv_handle_t *>(&watch_async));
+        watch_async_ready = 1;
+    }
+
+    if ((watch_port = port_create()) < 0)
+        return (-1);
+
+    (void) pthread_attr_init(&attr);
+    (void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&tid, &attr, watch_thread, NULL);
+    (void) pthread_attr_destroy(&attr);
+    if (err != 0) {
+        (void) close(watch_port);
+        watch_port = -1;
+        errno = err;
+        return (-1);
+    }
+
+    return (0);
+}
+
+
+/*
+ * zfileWatch(fd, callback): watch the file open as fd, calling
+ * callback(events) with ZFILE_WATCH_* bits as it changes.  Returns the
+ * watch's id for zfileUnwatch().  Once GONE has been seen the watch does
+ * nothing more, but must still be removed.
+ */
+static v8::Handle<v8::Value> ZFileWatch(const v8::Arguments& args) {
+    v8::HandleScope scope;
+
+    REQUIRE_INT_ARG(args, 0, fd);
+    REQUIRE_FUNCTION_ARG(args, 1, callback);
+
+    if (watch_init() != 0)
+        RETURN_ERRNO_EXCEPTION("port_create");
+
+    zfile_watch_t *zv = new zfile_watch_t();
+    zv->zv_id = watch_next_id++;
+    zv->zv_armed = 0;
+    zv->zv_pending = 0;
+    (void) snprintf(zv->zv_name, sizeof(zv->zv_name), "/proc/self/fd/%d", fd);
+    memset(&zv->zv_fobj, 0, sizeof(zv->zv_fobj));
+
+    pthread_mutex_lock(&watch_lock);
+    if (watch_arm(zv) != 0) {
+        int err = errno;
+        pthread_mutex_unlock(&watch_lock);
+        delete zv;
+        errno = err;
+        RETURN_ERRNO_EXCEPTION("port_associate");
+    }
+    zv->zv_callback = v8::Persistent<v8::Function>::New(callback);
+    zv->zv_next = watch_list;
+    watch_list = zv;
+    pthread_mutex_unlock(&watch_lock);
+
+    if (watch_count++ == 0)
+        uv_ref(reinterpret_cast<uv_handle_t *>(&watch_async));
+
+    return scope.Close(v8::Integer::NewFromUnsigned(zv->zv_id));
+}
+
+
+/*
+ * zfileUnwatch(id): stop and remove a watch.  Any events it has pending
+ * are dropped.
+ */
+static v8::Handle<v8::Value> ZFileUnwatch(const v8::Arguments& args) {
+    v8::HandleScope scope;
+    zfile_watch_t **zvp = NULL;
+    zfile_watch_t *zv = NULL;
+
+    REQUIRE_INT_ARG(args, 0, id);
+
+    pthread_mutex_lock(&watch_lock);
+    for (zvp = &watch_list; *zvp != NULL; zvp = &(*zvp)->zv_next) {
+        if ((*zvp)->zv_id == static_cast<uint32_t>(id))
+            break;
+    }
+    if ((zv = *zvp) != NULL) {
+        *zvp = zv->zv_next;
+        if (zv->zv_armed) {
+            (void) port_dissociate(watch_port, PORT_SOURCE_FILE,
+                                   reinterpret_cast<uintptr_t>(&zv->zv_fobj));
+        }
+    }
+    pthread_mutex_unlock(&watch_lock);
+
+    if (zv == NULL)
+        return v8::Undefined();
+
+    zv->zv_callback.Dispose();
+    delete zv;
+    if (--watch_count == 0)
+        uv_unref(reinterpret_cast<uv_handle_t *>(&watch_async));
+
+    return v8::Undefined();
+}
+
+
+/*
+ * Drop every cached fd opened in zoneid.
+ */
+static void fdcache_forget(zoneid_t zoneid) {
+    zfile_fdent_t *zd = NULL;
+    zfile_fdent_t *next = NULL;
+
+    pthread_mutex_lock(&fdcache_lock);
+    fdcache_gen++;
+    for (zd = fdcache_head; zd != NULL; zd = next) {
+        next = zd->zd_next;
+        if (zd->zd_zoneid == zoneid) {
+            fdcache_unlink(zd);
+            fdcache_free(zd);
+        }
+    }
+    pthread_mutex_unlock(&fdcache_lock);
+}
+
+
+/*
+ * Forget everything kept for zone name, last seen as zoneid, on its way
+ * down.  Closing the agent's socket is enough for it to exit, if the zone
+ * hasn't already killed it.  The agent entry comes off the agents list, and
+ * is freed once no request still holds it.
+ */
+static void zone_forget(const char *name, zoneid_t zoneid) {
+  zfile_agent_t **zap = NULL;
+  zfile_agent_t *za = NULL;
+
+  if (strlen(name) < ZONENAME_MAX)
+    zone_cache_set(name, -1, -1);
+
+  pthread_mutex_lock(&agents_lock);
+  for (zap = &agents; (za = *zap) != NULL; zap = &za->za_next) {
+    if (za->za_zoneid == zoneid) {
+      *zap = za->za_next;
+      za->za_next = NULL;
+      za->za_gone = 1;
+      za->za_refs++;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&agents_lock);
+
+  if (za != NULL) {
+    pthread_mutex_lock(&za->za_lock);
+    agent_close(za);
+    pthread_mutex_unlock(&za->za_lock);
+    agent_release(za);
+  }
+
+  fdcache_forget(zoneid);
+}
+
+
+/*
+ * Zone name, last seen as zoneid, has moved from state prev to state: bring
+ * what we keep for it up to date, and queue the change for zone_reap().
+ */
+static void zone_event(const char *name, zoneid_t zoneid, const char *state,
+                       const char *prev) {
+  zfile_zone_event_t *zn = NULL;
+
+  if (strcmp(state, ZONE_EVENT_RUNNING) == 0) {
+    trace(ZFILE_TRACE_ZONE_RUNNING, zoneid, -1, 0, -1);
+    if (strlen(name) < ZONENAME_MAX)
+      zone_cache_set(name, zoneid, -1);
+  } else {
+    trace(ZFILE_TRACE_ZONE_DOWN, zoneid, -1, 0, -1);
+    zone_forget(name, zoneid);
+  }
+
+  if (!zone_async_ready)
+    return;
+  if ((zn = static_cast<zfile_zone_event_t *>(
+           calloc(1, sizeof(*zn)))) != NULL) {
+    (void) strlcpy(zn->zn_name, name, sizeof(zn->zn_name));
+    (void) strlcpy(zn->zn_state, state, sizeof(zn->zn_state));
+    (void) strlcpy(zn->zn_prev, prev, sizeof(zn->zn_prev));
+    zn->zn_zoneid = zoneid;
+    pthread_mutex_lock(&zone_events_lock);
+    zn->zn_next = zone_events;
+    zone_events = zn;
+    pthread_mutex_unlock(&zone_events_lock);
+    uv_async_send(&zone_async);
+  }
+}
+
+
+static int zone_event_handler(sysevent_t *ev, void *cookie) {
+  nvlist_t *nvl = NULL;
+  char *name = NULL;
+  char *state = NULL;
+  char *prev = NULL;
+  int32_t zoneid = -1;
+
+  if (strcmp(sysevent_get_class_name(ev), ZONE_EVENT_STATUS_CLASS) != 0 ||
+      strcmp(sysevent_get_subclass_name(ev),
+             ZONE_EVENT_STATUS_SUBCLASS) != 0 ||
+      sysevent_get_attr_list(ev, &nvl) != 0)
+    return (0);
+
+  if (nvlist_lookup_string(nvl, ZONE_CB_NAME, &name) != 0 ||
+      nvlist_lookup_string(nvl, ZONE_CB_NEWSTATE, &state) != 0 ||
+      nvlist_lookup_string(nvl, ZONE_CB_OLDSTATE, &prev) != 0 ||
+      nvlist_lookup_int32(nvl, ZONE_CB_ZONEID, &zoneid) != 0) {
+    nvlist_free(nvl);
+    return (0);
+  }
+
+  zone_event(name, zoneid, state, prev);
+  nvlist_free(nvl);
+  return (0);
+}
+
+
+/*
+ * Start an agent for a zone that has just booted, so that its first open
+ * finds one waiting.  Failures are left for that open to report.
+ */
+static void uv_ZonePrewarm(uv_work_t *req) {
+  zoneid_t zoneid = static_cast<zoneid_t>(reinterpret_cast<intptr_t>(
+      req->data));
+  zfile_agent_t *za = NULL;
+  int sys = 0;
+
+  if (!agents_enabled || (za = agent_lookup(zoneid)) == NULL)
+    return;
+
+  pthread_mutex_lock(&za->za_lock);
+  if (za->za_sock < 0 && agent_spawn(za, &sys) != 0)
+    trace(ZFILE_TRACE_PREWARM_FAILED, zoneid, -1, errno, -1);
+  pthread_mutex_unlock(&za->za_lock);
+  agent_release(za);
+}
+
+
+static void uv_AfterPrewarm(uv_work_t *req, int status) {
+    delete req;
+}
+
+
+/*
+ * Runs on the loop thread when zones have changed state: pre-warm agents
+ * for zones now running, and call zone_callback(zone, zoneid, state,
+ * previous) for each change, oldest first.
+ */
+static void zone_reap(uv_async_t *handle, int status) {
+    v8::HandleScope scope;
+    zfile_zone_event_t *done = NULL;
+    zfile_zone_event_t *zn = NULL;
+    zfile_zone_event_t *next = NULL;
+
+    pthread_mutex_lock(&zone_events_lock);
+    for (zn = zone_events; zn != NULL; zn = next) {
+        next = zn->zn_next;
+        zn->zn_next = done;
+        done = zn;
+    }
+    zone_events = NULL;
+    pthread_mutex_unlock(&zone_events_lock);
+
+    for (zn = done; zn != NULL; zn = next) {
+        next = zn->zn_next;
+
+        if (agents_enabled && strcmp(zn->zn_state, ZONE_EVENT_RUNNING) == 0) {
+            uv_work_t *req = new uv_work_t;
+            req->data = reinterpret_cast<void *>(
+                static_cast<intptr_t>(zn->zn_zoneid));
+            if (pool_queue(zn->zn_name, req, uv_ZonePrewarm,
+                           uv_AfterPrewarm) != 0)
+                delete req;
+        }
+
+        if (!zone_callback.IsEmpty()) {
+            v8::Local<v8::Value> argv[4] = {
+                v8::String::New(zn->zn_name),
+                v8::Integer::New(zn->zn_zoneid),
+                v8::String::New(zn->zn_state),
+                v8::String::New(zn->zn_prev)
+            };
+            v8::TryCatch try_catch;
+
+            zone_callback->Call(v8::Context::GetCurrent()->Global(), 4, argv);
+
+            if (try_catch.HasCaught()) {
+                node::FatalException(try_catch);
+            }
+        }
+
+        free(zn);
+    }
+}
+
+
+/*
+ * Subscribe to zone state changes.  Returns 0, or -1 with errno set.
+ */
+static int zone_watch_init(void) {
+    char sid[MAX_SUBID_LEN];
+    int err = 0;
+
+    if (zone_evc != NULL)
+        return (0);
+
+    if (!zone_async_ready) {
+        if (uv_async_init(uv_default_loop(), &zone_async, zone_reap) != 0) {
+            errno = EAGAIN;
+            return (-1);
+        }
+        uv_unref(reinterpret_cast<uv_handle_t *>(&zone_async));
+        zone_async_ready = 1;
+    }
+
+    if ((err = sysevent_evc_bind(ZONE_EVENT_CHANNEL, &zone_evc,
+                                 EVCH_CREAT)) != 0) {
+        zone_evc = NULL;
+        errno = err;
+        return (-1);
+    }
+
+    // Subscriber ids are per channel, not per process
+    (void) snprintf(sid, sizeof(sid), "zfile%d", static_cast<int>(getpid()));
+    if ((err = sysevent_evc_subscribe(zone_evc, sid, EC_ALL,
+                                      zone_event_handler, NULL, 0)) != 0) {
+        (void) sysevent_evc_unbind(zone_evc);
+        zone_evc = NULL;
+        errno = err;
+        return (-1);
+    }
+
+    return (0);
+}
+
+
+/*
+ * zfileZoneWatch(callback): start following zone state changes, keeping
+ * zone ids, agents and the fd cache in step with them, and call
+ * callback(zone, zoneid, state, previous) for each.  Calling it again just
+ * replaces the callback.  Following zones never keeps node running.
+ */
+static v8::Handle<v8::Value> ZFileZoneWatch(const v8::Arguments& args) {
+    v8::HandleScope scope;
+
+    REQUIRE_FUNCTION_ARG(args, 0, callback);
+
+    if (zone_watch_init() != 0)
+        RETURN_ERRNO_EXCEPTION("sysevent_evc_subscribe");
+
+    if (!zone_callback.IsEmpty())
+        zone_callback.Dispose();
+    zone_callback = v8::Persistent<v8::Function>::New(callback);
+
+    return v8::Undefined();
+}
+
+
+/*
+ * zfileZoneEvent(zone, zoneid, state, previous): act on a zone state change
+ * as if it had come from the event channel.  For tests.
+ */
+static v8::Handle<v8::Value> ZFileZoneEvent(const v8::Arguments& args) {
+    v8::HandleScope scope;
+
+    REQUIRE_STRING_ARG(args, 0, zone);
+    REQUIRE_INT_ARG(args, 1, zoneid);
+    REQUIRE_STRING_ARG(args, 2, state);
+    REQUIRE_STRING_ARG(args, 3, prev);
+
+    zone_event(*zone, zoneid, *state, *prev);
+    return v8::Undefined();
+}
+
+
+/*
+ * zfileZoneState(zone, zoneid): what is kept for the zone, as {cached,
+ * agent, fds}: whether its id is cached, whether it has a live agent and
+ * how many fds the cache holds for it.  For tests.
+ */
+static v8::Handle<v8::Value> ZFileZoneState(const v8::Arguments& args) {
+    v8::HandleScope scope;
+    zfile_agent_t *za = NULL;
+    zfile_fdent_t *zd = NULL;
+    zoneid_t id = -1;
+    bool cached = false;
+    bool agent = false;
+    uint32_t fds = 0;
+
+    REQUIRE_STRING_ARG(args, 0, zone);
+    REQUIRE_INT_ARG(args, 1, zoneid);
+
+    if (strlen(*zone) < ZONENAME_MAX)
+        cached = zone_cache_get(*zone, &id) == 1 && id == zoneid;
+
+    pthread_mutex_lock(&agents_lock);
+    for (za = agents; za != NULL; za = za->za_next) {
+        if (za->za_zoneid == zoneid) {
+            agent = za->za_sock >= 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&agents_lock);
+
+    pthread_mutex_lock(&fdcache_lock);
+    for (zd = fdcache_head; zd != NULL; zd = zd->zd_next) {
+        if (zd->zd_zoneid == zoneid)
+            fds++;
+    }
+    pthread_mutex_unlock(&fdcache_lock);
+
+    v8::Local<v8::Object> res = v8::Object::New();
+    res->Set(v8::String::NewSymbol("cached"), v8::Boolean::New(cached));
+    res->Set(v8::String::NewSymbol("agent"), v8::Boolean::New(agent));
+    res->Set(v8::String::NewSymbol("fds"),
+             v8::Integer::NewFromUnsigned(fds));
+    return scope.Close(res);
+}
+
+
+/*
+ * zfileQuery(zone, path, op, callback): run ZFILE_OP_STAT (callback(err,
+ * stats)) or ZFILE_OP_READDIR (callback(err, names)) for path in the zone.
+ */
+static v8::Handle<v8::Value> ZFileQuery(const v8::Arguments& args) {
+    v8::HandleScope scope;
+
+    REQUIRE_STRING_ARG(args, 0, zone);
+    REQUIRE_STRING_ARG(args, 1, path);
+    REQUIRE_INT_ARG(args, 2, op);
+    REQUIRE_FUNCTION_ARG(args, 3, callback);
+
+    if (op != ZFILE_OP_STAT && op != ZFILE_OP_READDIR)
+        RETURN_ARGS_EXCEPTION("invalid query");
+
+    eio_query_baton_t *baton = new eio_query_baton_t();
+    baton->_zone = strdup(*zone);
+    baton->_path = strdup(*path);
+    baton->_mode = -1;
+    baton->_op = op;
+    if (baton->_zone == NULL || baton->_path == NULL) {
+        delete baton;
+        RETURN_EXCEPTION("OutOfMemory");
+    }
+
+    baton->_callback = v8::Persistent<v8::Function>::New(callback);
+    baton->_timeout = timeout_arg(args, 4);
+
+    uv_work_t *req = new uv_work_t;
+    req->data = static_cast<eio_baton_t *>(baton);
+    if (ZFILE_REQUEST_QUEUED_ENABLED()) {
+        ZFILE_REQUEST_QUEUED(baton->_zone, baton->_path, baton->_mode);
+    }
+    baton->_queued = gethrtime();
+    uint32_t ticket = 0;
+    if (pool_queue(baton->_zone, req, uv_ZFileQuery, uv_AfterQuery,
+                   &ticket) != 0) {
+        v8::Local<v8::Value> err = node::ErrnoException(errno, "zfile",
+            errno == EAGAIN ? "zfile queue full" : "", baton->_path);
+        delete req;
+        delete baton;
+        return scope.Close(err);
+    }
+
+    return scope.Close(v8::Integer::NewFromUnsigned(ticket));
+}
+
+
+/*
+ * zfileMmap(zone, path, advice, callback): callback(err, buffer) with
+ * buffer backed by a read-only mapping of the file.
+ */
+static v8::Handle<v8::Value> ZFileMmap(const v8::Arguments& args) {
+    v8::HandleScope scope;
+
+    REQUIRE_STRING_ARG(args, 0, zone);
+    REQUIRE_STRING_ARG(args, 1, path);
+    REQUIRE_INT_ARG(args, 2, advice);
+    REQUIRE_FUNCTION_ARG(args, 3, callback);
+
+    if (advice < ZFILE_ADVISE_NORMAL || advice > ZFILE_ADVISE_WILLNEED)
+        RETURN_ARGS_EXCEPTION("invalid advice");
+
+    eio_mmap_baton_t *baton = new eio_mmap_baton_t();
+    baton->_zone = strdup(*zone);
+    baton->_path = strdup(*path);
+    baton->_mode = MODE_R;
+    baton->_advice = advice;
+    if (baton->_zone == NULL || baton->_path == NULL) {
+        delete baton;
+        RETURN_EXCEPTION("OutOfMemory");
+    }
+
+    baton->_callback = v8::Persistent<v8::Function>::New(callback);
+    baton->_timeout = timeout_arg(args, 4);
+
+    uv_work_t *req = new uv_work_t;
+    req->data = static_cast<eio_baton_t *>(baton);
+    if (ZFILE_REQUEST_QUEUED_ENABLED()) {
+        ZFILE_REQUEST_QUEUED(baton->_zone, baton->_path, baton->_mode);
+    }
+    baton->_queued = gethrtime();
+    if (pool_queue(baton->_zone, req, uv_ZFileMmap, uv_AfterMmap) != 0) {
+        v8::Local<v8::Value> err = node::ErrnoException(errno, "zfile",
+            errno == EAGAIN ? "zfile queue full" : "", baton->_path);
+        delete req;
+        delete baton;
+        return scope.Close(err);
+    }
+
+    return v8::Undefined();
+}
+
+
+/*
+ * zfileScan(zone, path, needles, limit, keep, callback): callback(err,
+ * matches, truncated), matches being the offsets of the first limit lines
+ * holding any of the needle strings, or {offset, line} objects if keep.
+ */
+static v8::Handle<v8::Value> ZFileScan(const v8::Arguments& args) {
+    v8::HandleScope scope;
+
+    REQUIRE_STRING_ARG(args, 0, zone);
+    REQUIRE_STRING_ARG(args, 1, path);
+    if (args.Length() <= 2 || !args[2]->IsArray())
+        RETURN_ARGS_EXCEPTION("argument 2 must be an array");
+    REQUIRE_INT_ARG(args, 3, limit);
+    REQUIRE_INT_ARG(args, 4, keep);
+    REQUIRE_FUNCTION_ARG(args, 5, callback);
+
+    v8::Local<v8::Array> needles = v8::Local<v8::Array>::Cast(args[2]);
+    uint32_t count = needles->Length();
+
+    if (count == 0 || count > ZFILE_SCAN_NEEDLES)
+        RETURN_ARGS_EXCEPTION("argument 2 must have 1 to 64 entries");
+    if (limit <= 0)
+        RETURN_ARGS_EXCEPTION("argument 3 must be positive");
+    for (uint32_t i = 0; i < count; i++) {
+        if (!needles->Get(i)->IsString() ||
+            needles->Get(i)->ToString()->Length() == 0)
+            RETURN_ARGS_EXCEPTION("needles must be non-empty strings");
+    }
+
+    eio_scan_baton_t *baton = new eio_scan_baton_t();
+    zfile_scan_t *zc = &baton->_scan;
+    baton->_zone = strdup(*zone);
+    baton->_path = strdup(*path);
+    baton->_mode = MODE_R;
+    zc->zc_limit = limit;
+    zc->zc_keep = keep != 0;
+    zc->zc_needles = static_cast<char **>(calloc(count, sizeof(char *)));
+    zc->zc_nlens = static_cast<size_t *>(calloc(count, sizeof(size_t)));
+    zc->zc_next = static_cast<size_t *>(calloc(count, sizeof(size_t)));
+    if (baton->_zone == NULL || baton->_path == NULL ||
+        zc->zc_needles == NULL || zc->zc_nlens == NULL ||
+        zc->zc_next == NULL) {
+        delete baton;
+        RETURN_EXCEPTION("OutOfMemory");
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        v8::String::Utf8Value needle(needles->Get(i));
+        size_t nlen = needle.length();
+
+        if ((zc->zc_needles[i] = static_cast<char *>(malloc(nlen))) == NULL) {
+            delete baton;
+            RETURN_EXCEPTION("OutOfMemory");
+        }
+        memcpy(zc->zc_needles[i], *needle, nlen);
+        zc->zc_nlens[i] = nlen;
+        zc->zc_nneedles++;
+    }
+
+    baton->_callback = v8::Persistent<v8::Function>::New(callback);
+    baton->_timeout = timeout_arg(args, 6);
+
+    uv_work_t *req = new uv_work_t;
+    req->data = static_cast<eio_baton_t *>(baton);
+    if (ZFILE_REQUEST_QUEUED_ENABLED()) {
+        ZFILE_REQUEST_QUEUED(baton->_zone, baton->_path, baton->_mode);
+    }
+    baton->_queued = gethrtime();
+    if (pool_queue(baton->_zone, req, uv_ZFileScan, uv_AfterScan) != 0) {
+        v8::Local<v8::Value> err = node::ErrnoException(errno, "zfile",
+            errno == EAGAIN ? "zfile queue full" : "", baton->_path);
+        delete req;
+        delete baton;
+        return scope.Close(err);
+    }
+
+    return v8::Undefined();
+}
+
+
+/*
+ * zfileHash(zone, path, algo, callback): callback(err, {digest, size,
+ * mtime}) with the hex digest of the file under algo, a ZFILE_HASH_*.
+ */
+static v8::Handle<v8::Value> ZFileHash(const v8::Arguments& args) {
+    v8::HandleScope scope;
+
+    REQUIRE_STRING_ARG(args, 0, zone);
+    REQUIRE_STRING_ARG(args, 1, path);
+    REQUIRE_INT_ARG(args, 2, algo);
+    REQUIRE_FUNCTION_ARG(args, 3, callback);
+
+    if (algo != ZFILE_HASH_SHA256 && algo != ZFILE_HASH_XXH64)
+        RETURN_ARGS_EXCEPTION("invalid algorithm");
+
+    eio_hash_baton_t *baton = new eio_hash_baton_t();
+    baton->_zone = strdup(*zone);
+    baton->_path = strdup(*path);
+    baton->_mode = MODE_R;
+    baton->_algo = algo;
+    if (baton->_zone == NULL || baton->_path == NULL) {
+        delete baton;
+        RETURN_EXCEPTION("OutOfMemory");
+    }
+
+    baton->_callback = v8::Persistent<v8::Function>::New(callback);
+    baton->_timeout = timeout_arg(args, 4);
+
+    uv_work_t *req = new uv_work_t;
+    req->data = static_cast<eio_baton_t *>(baton);
+    if (ZFILE_REQUEST_QUEUED_ENABLED()) {
+        ZFILE_REQUEST_QUEUED(baton->_zone, baton->_path, baton->_mode);
+    }
+    baton->_queued = gethrtime();
+    if (pool_queue(baton->_zone, req, uv_ZFileHash, uv_AfterHash) != 0) {
+        v8::Local<v8::Value> err = node::ErrnoException(errno, "zfile",
+            errno == EAGAIN ? "zfile queue full" : "", baton->_path);
+        delete req;
+        delete baton;
+        return scope.Close(err);
+    }
+
+    return v8::Undefined();
+}
+
+
+/*
+ * zfileCopy(fromZone, fromPath, toZone, toPath, flags, callback): copy one
+ * file to another, in the same zone or not, with ZFILE_COPY_* flags.  An
+ * empty zone name means the global zone.  callback(err, {bytes}).
+ */
+static v8::Handle<v8::Value> ZFileCopy(const v8::Arguments& args) {
+    v8::HandleScope scope;
+
+    REQUIRE_STRING_ARG(args, 0, from_zone);
+    REQUIRE_STRING_ARG(args, 1, from_path);
+    REQUIRE_STRING_ARG(args, 2, to_zone);
+    REQUIRE_STRING_ARG(args, 3, to_path);
+    REQUIRE_INT_ARG(args, 4, flags);
+    REQUIRE_FUNCTION_ARG(args, 5, callback);
+
+    if ((flags & ~(ZFILE_COPY_ATOMIC | ZFILE_COPY_FSYNC)) != 0)
+        RETURN_ARGS_EXCEPTION("invalid copy flags");
+
+    eio_copy_baton_t *baton = new eio_copy_baton_t();
+    baton->_zone = strdup(*from_zone);
+    baton->_path = strdup(*from_path);
+    baton->_mode = MODE_R;
+    baton->_flags = flags;
+    baton->_target._zone = strdup(*to_zone);
+    baton->_target._path = strdup(*to_path);
+    if (baton->_zone == NULL || baton->_path == NULL ||
+        baton->_target._zone == NULL || baton->_target._path == NULL) {
+        delete baton;
+        RETURN_EXCEPTION("OutOfMemory");
+    }
+
+    baton->_callback = v8::Persistent<v8::Function>::New(callback);
+    baton->_timeout = timeout_arg(args, 6);
+    baton->_target._timeout = baton->_timeout;
+
+    uv_work_t *req = new uv_work_t;
+    req->data = static_cast<eio_baton_t *>(baton);
+    if (ZFILE_REQUEST_QUEUED_ENABLED()) {
+        ZFILE_REQUEST_QUEUED(baton->_zone, baton->_path, baton->_mode);
+    }
+    baton->_queued = gethrtime();
+    baton->_target._queued = baton->_queued;
+    // Queued with whichever end is in a zone, for fairness
+    if (pool_queue(baton->_zone[0] != '\0' ? baton->_zone :
+                   baton->_target._zone, req, uv_ZFileCopy,
+                   uv_AfterCopy) != 0) {
+        v8::Local<v8::Value> err = node::ErrnoException(errno, "zfile",
+            errno == EAGAIN ? "zfile queue full" : "", baton->_path);
+        delete req;
+        delete baton;
+        return scope.Close(err);
+    }
+
+    return v8::Undefined();
+}
+
+
+/*
+ * zfilePread(zone, fd, buffer, length, position, callback): read length
+ * bytes at position from fd into the start of buffer on the zfile pool,
+ * queued with zone's requests.  callback(err, bytesRead), which is short
+ * of length only at end of file.
+ */
+static v8::Handle<v8::Value> ZFilePread(const v8::Arguments& args) {
+    v8::HandleScope scope;
+
+    REQUIRE_STRING_ARG(args, 0, zone);
+    REQUIRE_INT_ARG(args, 1, fd);
+    if (args.Length() <= 2 || !node::Buffer::HasInstance(args[2]))
+        RETURN_ARGS_EXCEPTION("argument 2 must be a Buffer");
+    REQUIRE_INT_ARG(args, 3, length);
+    if (args.Length() <= 4 || !args[4]->IsNumber())
+        RETURN_ARGS_EXCEPTION("argument 4 must be a number");
+    REQUIRE_FUNCTION_ARG(args, 5, callback);
+
+    v8::Local<v8::Object> buffer = args[2]->ToObject();
+    double position = args[4]->NumberValue();
+    if (length < 0 || static_cast<size_t>(length) >
+        node::Buffer::Length(buffer))
+        RETURN_ARGS_EXCEPTION("length must fit in the Buffer");
+    if (position < 0)
+        RETURN_ARGS_EXCEPTION("position must be >= 0");
+
+    eio_pread_baton_t *baton = new eio_pread_baton_t();
+    baton->_zone = strdup(*zone);
+    if (baton->_zone == NULL) {
+        delete baton;
+        RETURN_EXCEPTION("OutOfMemory");
+    }
+    baton->_fd = fd;
+    baton->_buffer = v8::Persistent<v8::Object>::New(buffer);
+    baton->_buf = node::Buffer::Data(buffer);
+    baton->_len = length;
+    baton->_pos = static_cast<off_t>(position);
+    baton->_callback = v8::Persistent<v8::Function>::New(callback);
+
+    uv_work_t *req = new uv_work_t;
+    req->data = static_cast<eio_baton_t *>(baton);
+    baton->_queued = gethrtime();
+    if (pool_queue(baton->_zone, req, uv_ZFilePread, uv_AfterPread) != 0) {
+        v8::Local<v8::Value> err = node::ErrnoException(errno, "zfile",
+            errno == EAGAIN ? "zfile queue full" : "");
+        delete req;
+        delete baton;
+        return scope.Close(err);
+    }
+
+    return v8::Undefined();
+}
+
+
+/*
+ * zfileWrite(zone, path, buffer, flags, callback): atomically replace path
+ * with the contents of buffer; flags are ZFILE_WRITE_*.
+ */
+static v8::Handle<v8::Value> ZFileWrite(const v8::Arguments& args) {
+    v8::HandleScope scope;
+
+    REQUIRE_STRING_ARG(args, 0, zone);
+    REQUIRE_STRING_ARG(args, 1, path);
+    if (args.Length() <= 2 || !node::Buffer::HasInstance(args[2]))
+        RETURN_ARGS_EXCEPTION("argument 2 must be a Buffer");
+    REQUIRE_INT_ARG(args, 3, flags);
+    REQUIRE_FUNCTION_ARG(args, 4, callback);
+
+    size_t len = node::Buffer::Length(args[2]);
+    if (len > ZFILE_WRITE_MAX)
+        RETURN_ARGS_EXCEPTION("buffer is too large");
+
+    eio_write_baton_t *baton = new eio_write_baton_t();
+    baton->_zone = strdup(*zone);
+    baton->_path = strdup(*path);
+    baton->_mode = MODE_W;
+    baton->_flags = flags;
+    baton->_len = len;
+    // The copy keeps the worker clear of the JS heap.
+    baton->_data = static_cast<char *>(malloc(len > 0 ? len : 1));
+    if (baton->_zone == NULL || baton->_path == NULL ||
+        baton->_data == NULL) {
+        delete baton;
+        RETURN_EXCEPTION("OutOfMemory");
+    }
+    memcpy(baton->_data, node::Buffer::Data(args[2]), len);
+
+    baton->_callback = v8::Persistent<v8::Function>::New(callback);
+    baton->_timeout = timeout_arg(args, 5);
+
+    uv_work_t *req = new uv_work_t;
+    req->data = static_cast<eio_baton_t *>(baton);
+    if (ZFILE_REQUEST_QUEUED_ENABLED()) {
+        ZFILE_REQUEST_QUEUED(baton->_zone, baton->_path, baton->_mode);
+    }
+    baton->_queued = gethrtime();
+    if (pool_queue(baton->_zone, req, uv_ZFileWrite, uv_AfterWrite) != 0) {
+        v8::Local<v8::Value> err = node::ErrnoException(errno, "zfile",
+            errno == EAGAIN ? "zfile queue full" : "", baton->_path);
+        delete req;
+        delete baton;
+        return scope.Close(err);
+    }
+
+    return v8::Undefined();
 }
 
 
-static ssize_t write_fd(int fd, void *ptr, size_t nbytes, int sendfd) {
-  struct msghdr msg;
-  struct iovec iov[1];
-  union {
-    struct cmsghdr cm;
-    char control[CMSG_SPACE(sizeof(int))];
-  } control_un;
-  struct cmsghdr *cmptr = NULL;
+static v8::Handle<v8::Value> ZFileMany(const v8::Arguments& args) {
+    v8::HandleScope scope;
 
-  msg.msg_control = control_un.control;
-  msg.msg_controllen = sizeof(control_un.control);
+    REQUIRE_STRING_ARG(args, 0, zone);
+    if (args.Length() <= 1 || !args[1]->IsArray())
+        RETURN_ARGS_EXCEPTION("argument 1 must be an array");
+    REQUIRE_FUNCTION_ARG(args, 2, callback);
 
-  cmptr = CMSG_FIRSTHDR(&msg);
-  cmptr->cmsg_len = CMSG_LEN(sizeof(int));
-  cmptr->cmsg_level = SOL_SOCKET;
-  cmptr->cmsg_type = SCM_RIGHTS;
-  *(reinterpret_cast<int *>(CMSG_DATA(cmptr))) = sendfd;
+    v8::Local<v8::Array> files = v8::Local<v8::Array>::Cast(args[1]);
+    v8::Local<v8::String> path_sym = v8::String::New("path");
+    v8::Local<v8::String> mode_sym = v8::String::New("mode");
+    uint32_t count = files->Length();
+    size_t len = count * sizeof(int32_t);
 
-  msg.msg_name = NULL;
-  msg.msg_namelen = 0;
-  iov[0].iov_base = ptr;
-  iov[0].iov_len = nbytes;
-  msg.msg_iov = iov;
-  msg.msg_iovlen = 1;
+    if (count == 0 || count > ZFILE_BATCH_MAX)
+        RETURN_ARGS_EXCEPTION("argument 1 must have 1 to 1024 entries");
 
-  return (sendmsg(fd, &msg, 0));
-}
+    for (uint32_t i = 0; i < count; i++) {
+        v8::Local<v8::Value> file = files->Get(i);
+        if (!file->IsObject() ||
+            !file->ToObject()->Get(path_sym)->IsString() ||
+            !file->ToObject()->Get(mode_sym)->IsNumber())
+            RETURN_ARGS_EXCEPTION("entries must have a string path "
+                                  "and integer mode");
+        v8::String::Utf8Value path(file->ToObject()->Get(path_sym));
+        len += strlen(*path) + 1;
+    }
 
+    eio_batch_baton_t *baton = new eio_batch_baton_t();
+    zfile_batch_t *zb = &baton->_batch;
+    char *buf = static_cast<char *>(malloc(len));
+    zb->zb_buf = buf;
+    zb->zb_len = len;
+    zb->zb_count = count;
+    zb->zb_fds = static_cast<int *>(calloc(count, sizeof(int)));
+    zb->zb_errs = static_cast<int *>(calloc(count, sizeof(int)));
+    baton->_zone = strdup(*zone);
+    if (buf == NULL || zb->zb_fds == NULL || zb->zb_errs == NULL ||
+        baton->_zone == NULL) {
+        delete baton;
+        RETURN_EXCEPTION("OutOfMemory");
+    }
 
-static int zfile(zoneid_t zoneid, const char *path, int mode) {
-  char c = 0;
-  ctid_t ct = -1;
-  int _errno = 0;
-  int pid = 0;
+    char *p = buf + count * sizeof(int32_t);
+    for (uint32_t i = 0; i < count; i++) {
+        v8::Local<v8::Object> file = files->Get(i)->ToObject();
+        v8::String::Utf8Value path(file->Get(path_sym));
+        int32_t mode = file->Get(mode_sym)->Int32Value();
+        size_t plen = strlen(*path) + 1;
 
-  /* The FD for the file we will open */
-  int file_fd = 0;
+        if (plen > (size_t)(buf + len - p)) {
+            delete baton;
+            RETURN_ARGS_EXCEPTION("entries changed while being read");
+        }
+        memcpy(buf + i * sizeof(int32_t), &mode, sizeof(mode));
+        memcpy(p, *path, plen);
+        p += plen;
+    }
 
-  int sockfd[2] = {0};
-  int stat = 0;
-  int tmpl_fd = 0;
-  int flags;
-  int openmode = 0;
+    baton->_callback = v8::Persistent<v8::Function>::New(callback);
+    baton->_timeout = timeout_arg(args, 3);
 
-  if (zoneid < 0) {
-    return (-1);
-  }
+    uv_work_t *req = new uv_work_t;
+    req->data = baton;
+    if (ZFILE_REQUEST_QUEUED_ENABLED()) {
+        ZFILE_REQUEST_QUEUED(baton->_zone, PROBE_STR(""), -1);
+    }
+    baton->_queued = gethrtime();
+    if (pool_queue(baton->_zone, req, uv_ZFileMany, uv_AfterMany) != 0) {
+        v8::Local<v8::Value> err = node::ErrnoException(errno, "zfile",
+            errno == EAGAIN ? "zfile queue full" : "");
+        delete req;
+        delete baton;
+        return scope.Close(err);
+    }
 
-  if (path == NULL) {
-    return (-1);
-  }
+    return v8::Undefined();
+}
 
-  pthread_mutex_lock(&lock);
 
-  if ((tmpl_fd = init_template()) < 0) {
-    pthread_mutex_unlock(&lock);
-    return (-1);
-  }
+/*
+ * Record the result for zone i of ac, and pass it to the per-zone callback
+ * if there is one.
+ */
+static void across_result(eio_across_t *ac, uint32_t i,
+                          v8::Local<v8::Value> result) {
+    ac->_results->Set(i, result);
+    ac->_done++;
 
-  if (socketpair(AF_LOCAL, SOCK_STREAM, 0, sockfd) != 0) {
-    (void) ct_tmpl_clear(tmpl_fd);
-    pthread_mutex_unlock(&lock);
-    return (-1);
-  }
+    if (ac->_each.IsEmpty())
+        return;
 
-  pid = fork();
-  debug("fork returned: %d\n", pid);
-  if (pid < 0) {
-    _errno = errno;
-    (void) ct_tmpl_clear(tmpl_fd);
-    close(sockfd[0]);
-    close(sockfd[1]);
-    errno = _errno;
-    pthread_mutex_unlock(&lock);
-    return (-1);
-  }
+    v8::Local<v8::Value> argv[3];
+    argv[0] = v8::Integer::NewFromUnsigned(i);
+    if (result->IsNumber()) {
+        argv[1] = v8::Local<v8::Value>::New(v8::Null());
+        argv[2] = result;
+    } else {
+        argv[1] = result;
+        argv[2] = v8::Local<v8::Value>::New(v8::Undefined());
+    }
 
-  if (pid == 0) {
-    (void) ct_tmpl_clear(tmpl_fd);
-    (void) close(tmpl_fd);
-    (void) close(sockfd[0]);
-    int ret;
+    v8::TryCatch try_catch;
 
-    if ((ret = zone_enter(zoneid)) != 0) {
-      debug("CHILD: zone_enter(%d) => %s (%d)\n", zoneid, strerror(errno), ret);
-      if (errno == EINVAL) {
-        _exit(0);
-      }
-      _exit(1);
+    ac->_each->Call(v8::Context::GetCurrent()->Global(), 3, argv);
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
     }
+}
 
-    debug("CHILD: zone_enter(%d) => %d\n", zoneid, 0);
 
-    switch (mode) {
-        case MODE_R:
-            openmode = O_RDONLY;
-            break;
-        case MODE_W:
-            openmode = O_WRONLY | O_CREAT | O_TRUNC;
-            break;
-        case MODE_A:
-            openmode = O_APPEND | O_CREAT;
+/*
+ * Queue opens for the zones of ac not yet started, up to its parallelism.
+ * A zone that cannot be queued waits for a running open to finish; with
+ * none running it fails with the queue error, unless this is the first
+ * call (from ZFileAcross() itself), which returns -1 instead so the whole
+ * request can be refused.
+ */
+static void uv_AfterAcross(uv_work_t *req, int status);
+
+static int across_schedule(eio_across_t *ac, bool first) {
+    while (ac->_next < ac->_nzones && ac->_outstanding < ac->_parallel) {
+        uint32_t i = ac->_next;
+        eio_open_baton_t *baton = baton_get();
+        baton->_mode = ac->_mode;
+        baton->_across = ac;
+        baton->_index = i;
+        baton->_timeout = ac->_timeout;
+
+        if (baton->set(ac->_zones[i], ac->_path) != 0) {
+            errno = ENOMEM;
+        } else {
+            if (ZFILE_REQUEST_QUEUED_ENABLED()) {
+                ZFILE_REQUEST_QUEUED(baton->_zone, baton->_path,
+                                     baton->_mode);
+            }
+            baton->_queued = gethrtime();
+            if (pool_queue(baton->_zone, &baton->_req, uv_ZFile,
+                           uv_AfterAcross) == 0) {
+                ac->_next++;
+                ac->_outstanding++;
+                continue;
+            }
+        }
+
+        int err = errno;
+        baton_put(baton);
+        if (ac->_outstanding > 0)
             break;
-        default:
-            debug("CHILD: invalid open mode (%d)\n", mode);
-            _exit(6);
+        if (first) {
+            errno = err;
+            return (-1);
+        }
+        ac->_next++;
+        across_result(ac, i, node::ErrnoException(err, "zfile",
+            err == EAGAIN ? "zfile queue full" : "", ac->_zones[i]));
     }
 
-    if ((file_fd = open(path, openmode)) < 0) {
-      debug("CHILD: open => %d\n", errno);
-      _exit(2);
+    return (0);
+}
+
+
+static void uv_AfterAcross(uv_work_t *req, int status) {
+    v8::HandleScope scope;
+    eio_open_baton_t *baton = static_cast<eio_open_baton_t *>(
+        static_cast<eio_baton_t *>(req->data));
+    eio_across_t *ac = baton->_across;
+
+    if (baton->_fd < 0) {
+        across_result(ac, baton->_index,
+                      node::ErrnoException(baton->_errno, baton->_syscall,
+                                           "", baton->_path));
+    } else {
+        leak_stats.zl_fds++;
+        across_result(ac, baton->_index, v8::Integer::New(baton->_fd));
+    }
+    if (ZFILE_CALLBACK_FIRED_ENABLED()) {
+        ZFILE_CALLBACK_FIRED(baton->_zone, baton->_path, baton->_fd,
+                             baton->_errno);
     }
+    ac->_outstanding--;
+    baton_put(baton);
 
-    if (write_fd(sockfd[1], (void *)"", 1, file_fd) < 0) {
-      debug("CHILD: write_fd => %d\n", errno);
-      _exit(4);
+    (void) across_schedule(ac, false);
+    if (ac->_done < ac->_nzones)
+        return;
+
+    v8::Local<v8::Value> argv[2];
+    argv[0] = v8::Local<v8::Value>::New(v8::Null());
+    argv[1] = v8::Local<v8::Value>::New(ac->_results);
+
+    v8::TryCatch try_catch;
+
+    ac->_callback->Call(v8::Context::GetCurrent()->Global(), 2, argv);
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
     }
 
-    debug("CHILD: write_fd => %d\n", errno);
-    _exit(0);
-  }
+    delete ac;
+}
 
-  if (contract_latest(&ct) == -1) {
-    ct = -1;
-  }
-  (void) ct_tmpl_clear(tmpl_fd);
-  (void) close(tmpl_fd);
-  (void) contract_abandon_id(ct);
-  (void) close(sockfd[1]);
-  debug("PARENT: waitforpid(%d)\n", pid);
-  while ((waitpid(pid, &stat, 0) != pid) && errno != ECHILD) ;
 
-  if (WIFEXITED(stat) == 0) {
-    debug("PARENT: Child didn't exit\n");
-    _errno = ECHILD;
-    file_fd = -1;
-  } else {
-    stat = WEXITSTATUS(stat);
-    debug("PARENT: Child exit status %d\n", stat);
-    if (stat == 0) {
-      read_fd(sockfd[0], &c, 1, &file_fd);
-    } else {
-      _errno = stat;
-      file_fd = -1;
+/*
+ * zfileAcross(zones, path, mode, parallelism, each, callback): open path in
+ * every zone in zones, at most parallelism at a time.  each (or null) is
+ * called as each(index, err, fd) as every zone finishes; callback gets
+ * (null, results), with results[i] the fd or error for zones[i].
+ */
+static v8::Handle<v8::Value> ZFileAcross(const v8::Arguments& args) {
+    v8::HandleScope scope;
+
+    if (args.Length() == 0 || !args[0]->IsArray())
+        RETURN_ARGS_EXCEPTION("argument 0 must be an array");
+    REQUIRE_STRING_ARG(args, 1, path);
+    REQUIRE_INT_ARG(args, 2, mode);
+    REQUIRE_INT_ARG(args, 3, parallel);
+    if (args.Length() <= 4 ||
+        !(args[4]->IsNull() || args[4]->IsFunction()))
+        RETURN_ARGS_EXCEPTION("argument 4 must be a function or null");
+    REQUIRE_FUNCTION_ARG(args, 5, callback);
+
+    v8::Local<v8::Array> zones = v8::Local<v8::Array>::Cast(args[0]);
+    uint32_t count = zones->Length();
+
+    if (count == 0)
+        RETURN_ARGS_EXCEPTION("argument 0 must not be empty");
+    if (parallel < 1)
+        RETURN_ARGS_EXCEPTION("parallelism must be >= 1");
+    for (uint32_t i = 0; i < count; i++) {
+        if (!zones->Get(i)->IsString())
+            RETURN_ARGS_EXCEPTION("zones must be strings");
     }
-  }
 
-  close(sockfd[0]);
-  pthread_mutex_unlock(&lock);
-  if (file_fd < 0) {
-    errno = _errno;
-  } else {
-    if ((flags = fcntl(file_fd, F_GETFD)) != -1) {
-      flags |= FD_CLOEXEC;
-      (void) fcntl(file_fd, F_SETFD, flags);
+    eio_across_t *ac = new eio_across_t();
+    ac->_zones = static_cast<char **>(calloc(count, sizeof(char *)));
+    ac->_path = strdup(*path);
+    if (ac->_zones == NULL || ac->_path == NULL) {
+        delete ac;
+        RETURN_EXCEPTION("OutOfMemory");
+    }
+    ac->_nzones = count;
+    for (uint32_t i = 0; i < count; i++) {
+        v8::String::Utf8Value zone(zones->Get(i));
+        if ((ac->_zones[i] = strdup(*zone)) == NULL) {
+            delete ac;
+            RETURN_EXCEPTION("OutOfMemory");
+        }
+    }
+    ac->_mode = mode;
+    ac->_parallel = parallel;
+    ac->_results = v8::Persistent<v8::Array>::New(v8::Array::New(count));
+    ac->_callback = v8::Persistent<v8::Function>::New(callback);
+    ac->_timeout = timeout_arg(args, 6);
+    if (args[4]->IsFunction()) {
+        ac->_each = v8::Persistent<v8::Function>::New(
+            v8::Local<v8::Function>::Cast(args[4]));
     }
 
-    errno = 0;
-  }
-  debug("zfile returning fd=%d, errno=%d\n", file_fd, errno);
-  return (file_fd);
+    if (across_schedule(ac, true) != 0) {
+        v8::Local<v8::Value> err = node::ErrnoException(errno, "zfile",
+            errno == EAGAIN ? "zfile queue full" : "", ac->_path);
+        delete ac;
+        return scope.Close(err);
+    }
+
+    return v8::Undefined();
 }
 
 
-static void uv_ZFile(uv_work_t *req) {
-    eio_baton_t *baton = static_cast<eio_baton_t *>(req->data);
+static v8::Handle<v8::Value> GetStats(const v8::Arguments& args) {
+    v8::HandleScope scope;
 
-    zoneid_t zoneid = getzoneidbyname(baton->_zone);
-    if (zoneid < 0) {
-        baton->setErrno("getzoneidbyname", errno);
-        return;
+    zfile_stats_t *sum =
+        static_cast<zfile_stats_t *>(malloc(sizeof(zfile_stats_t)));
+    if (sum == NULL) {
+        errno = ENOMEM;
+        RETURN_ERRNO_EXCEPTION("malloc");
     }
-    int file_fd = -1;
-    int attempts = 1;
-    do {
-        // This call suffers from EINTR, so just retry
-        file_fd = zfile(zoneid, baton->_path, baton->_mode);
-    } while (attempts++ < 3 && file_fd < 0);
-    if (file_fd < 0) {
-        baton->setErrno("zfile", errno);
-        return;
+    stats_sum(sum);
+
+    v8::Local<v8::Object> stats = v8::Object::New();
+    stats->Set(v8::String::NewSymbol("inflight"),
+               v8::Integer::NewFromUnsigned(zfile_inflight));
+    stats->Set(v8::String::NewSymbol("maxInflight"),
+               v8::Integer::NewFromUnsigned(zfile_inflight_max));
+    stats->Set(v8::String::NewSymbol("queued"),
+               v8::Integer::NewFromUnsigned(pool_queued));
+    stats->Set(v8::String::NewSymbol("poolThreads"),
+               v8::Integer::New(pool_threads));
+    stats->Set(v8::String::NewSymbol("count"),
+               v8::Number::New(static_cast<double>(sum->zs_ops)));
+
+    v8::Local<v8::Object> fdcache = v8::Object::New();
+    fdcache->Set(v8::String::NewSymbol("hits"),
+                 v8::Number::New(static_cast<double>(sum->zs_cache_hits)));
+    fdcache->Set(v8::String::NewSymbol("misses"),
+                 v8::Number::New(static_cast<double>(sum->zs_cache_misses)));
+    fdcache->Set(v8::String::NewSymbol("size"),
+                 v8::Integer::NewFromUnsigned(fdcache_count));
+    stats->Set(v8::String::NewSymbol("fdCache"), fdcache);
+
+    v8::Local<v8::Object> batons = v8::Object::New();
+    batons->Set(v8::String::NewSymbol("hits"),
+                v8::Number::New(static_cast<double>(baton_hits)));
+    batons->Set(v8::String::NewSymbol("misses"),
+                v8::Number::New(static_cast<double>(baton_misses)));
+    batons->Set(v8::String::NewSymbol("size"),
+                v8::Integer::NewFromUnsigned(baton_free_count));
+    stats->Set(v8::String::NewSymbol("batonPool"), batons);
+
+    v8::Local<v8::Object> contracts = v8::Object::New();
+    contracts->Set(v8::String::NewSymbol("created"), v8::Number::New(
+        static_cast<double>(leak_stats.zl_contracts)));
+    contracts->Set(v8::String::NewSymbol("abandoned"), v8::Number::New(
+        static_cast<double>(leak_stats.zl_abandoned)));
+    contracts->Set(v8::String::NewSymbol("leaked"), v8::Number::New(
+        static_cast<double>(leak_stats.zl_contract_leaks)));
+    stats->Set(v8::String::NewSymbol("contracts"), contracts);
+
+    v8::Local<v8::Object> children = v8::Object::New();
+    children->Set(v8::String::NewSymbol("reaped"), v8::Number::New(
+        static_cast<double>(leak_stats.zl_reaped)));
+    children->Set(v8::String::NewSymbol("orphaned"),
+                  v8::Integer::New(reap_count));
+    children->Set(v8::String::NewSymbol("lost"), v8::Number::New(
+        static_cast<double>(leak_stats.zl_lost)));
+    stats->Set(v8::String::NewSymbol("children"), children);
+
+    v8::Local<v8::Object> fds = v8::Object::New();
+    fds->Set(v8::String::NewSymbol("handedOut"), v8::Number::New(
+        static_cast<double>(leak_stats.zl_fds)));
+    stats->Set(v8::String::NewSymbol("fds"), fds);
+
+    v8::Local<v8::Object> errors = v8::Object::New();
+    for (int i = 0; i < ZFILE_SYS_MAX; i++) {
+        if (sum->zs_errors[i] == 0)
+            continue;
+        errors->Set(v8::String::New(zfile_syscalls[i]),
+                    v8::Number::New(static_cast<double>(sum->zs_errors[i])));
     }
+    stats->Set(v8::String::NewSymbol("errors"), errors);
 
-    baton->_fd = file_fd;
+    v8::Local<v8::Object> phases = v8::Object::New();
+    for (int i = 0; i < ZFILE_PHASE_MAX; i++) {
+        const zfile_hist_t *zh = &sum->zs_hist[i];
+        v8::Local<v8::Object> p = v8::Object::New();
 
-    return;
+        p->Set(v8::String::NewSymbol("count"),
+               v8::Number::New(static_cast<double>(zh->zh_count)));
+        p->Set(v8::String::NewSymbol("mean"),
+               v8::Number::New(zh->zh_count == 0 ? 0 :
+                               static_cast<double>(zh->zh_sum) /
+                               zh->zh_count));
+        p->Set(v8::String::NewSymbol("max"),
+               v8::Number::New(static_cast<double>(zh->zh_max)));
+        p->Set(v8::String::NewSymbol("p50"),
+               v8::Number::New(static_cast<double>(
+                   hist_percentile(zh, 0.50))));
+        p->Set(v8::String::NewSymbol("p90"),
+               v8::Number::New(static_cast<double>(
+                   hist_percentile(zh, 0.90))));
+        p->Set(v8::String::NewSymbol("p99"),
+               v8::Number::New(static_cast<double>(
+                   hist_percentile(zh, 0.99))));
+        p->Set(v8::String::NewSymbol("p999"),
+               v8::Number::New(static_cast<double>(
+                   hist_percentile(zh, 0.999))));
+        phases->Set(v8::String::New(zfile_phases[i]), p);
+    }
+    stats->Set(v8::String::NewSymbol("phases"), phases);
+
+    free(sum);
+    return scope.Close(stats);
 }
 
 
-static void uv_After(uv_work_t *req, int status) {
+static v8::Handle<v8::Value> ResetStats(const v8::Arguments& args) {
     v8::HandleScope scope;
-    eio_baton_t *baton = static_cast<eio_baton_t *>(req->data);
-    delete (req);
 
-    int argc = 1;
-    v8::Local<v8::Value> argv[2];
+    atomic_inc_32(&stats_gen);
+    zfile_inflight_max = zfile_inflight;
+    baton_hits = 0;
+    baton_misses = 0;
 
-    if (baton->_fd < 0) {
-        argv[0] = node::ErrnoException(baton->_errno, baton->_syscall);
-    } else {
-        argc = 2;
-        argv[0] = v8::Local<v8::Value>::New(v8::Null());
-        argv[1] = v8::Integer::New(baton->_fd);
-    }
+    return v8::Undefined();
+}
 
-    v8::TryCatch try_catch;
 
-    baton->_callback->Call(v8::Context::GetCurrent()->Global(), argc, argv);
+static v8::Handle<v8::Value> SetSpawnMode(const v8::Arguments& args) {
+    v8::HandleScope scope;
 
-    if (try_catch.HasCaught()) {
-        node::FatalException(try_catch);
-    }
+    REQUIRE_INT_ARG(args, 0, mode);
 
-    delete baton;
+    if (mode != ZFILE_SPAWN_FORK && mode != ZFILE_SPAWN_FORKX &&
+        mode != ZFILE_SPAWN_VFORK)
+        RETURN_ARGS_EXCEPTION("invalid spawn mode");
+
+    spawn_mode = mode;
+
+    return v8::Undefined();
 }
 
 
-static v8::Handle<v8::Value> ZFile(const v8::Arguments& args) {
+/*
+ * zfileCancel(ticket): cancel the zfile(), zfileRead() or zfileQuery()
+ * request that returned ticket.  Its callback is never called, and an fd it
+ * opened is closed here rather than handed to JS.  Returns whether the
+ * request was still outstanding.
+ */
+static v8::Handle<v8::Value> ZFileCancel(const v8::Arguments& args) {
     v8::HandleScope scope;
 
-    REQUIRE_STRING_ARG(args, 0, zone);
-    REQUIRE_STRING_ARG(args, 1, path);
-    REQUIRE_INT_ARG(args, 2, mode);
-    REQUIRE_FUNCTION_ARG(args, 3, callback);
+    REQUIRE_ARGS(args);
+    if (!args[0]->IsNumber())
+        RETURN_ARGS_EXCEPTION("argument 0 must be an integer");
 
-    eio_baton_t *baton = new eio_baton_t();
-    baton->_zone = strdup(*zone);
-    if (baton->_zone == NULL) {
-        delete baton;
-        RETURN_EXCEPTION("OutOfMemory");
+    return scope.Close(v8::Boolean::New(
+        pool_cancel(args[0]->Uint32Value()) == 0));
+}
+
+static int trace_compare(const void *a, const void *b) {
+    hrtime_t ta = static_cast<const zfile_trace_t *>(a)->tr_time;
+    hrtime_t tb = static_cast<const zfile_trace_t *>(b)->tr_time;
+
+    return (ta < tb ? -1 : ta > tb ? 1 : 0);
+}
+
+/*
+ * zfileTrace(): every thread's trace records, oldest first, as objects of
+ * { time (a Date), thread, event, zoneid, pid, errno, arg }.
+ */
+static v8::Handle<v8::Value> ZFileTrace(const v8::Arguments& args) {
+    v8::HandleScope scope;
+    zfile_ring_t *head = trace_rings;
+    zfile_ring_t *rg = NULL;
+    zfile_trace_t *recs = NULL;
+    uint32_t nrings = 0;
+    uint32_t n = 0;
+
+    /*
+     * Rings are only ever pushed on at the head and never taken off, so the
+     * list from head down stays as counted.  Rings added since are left for
+     * the next call.
+     */
+    for (rg = head; rg != NULL; rg = rg->rg_link)
+        nrings++;
+    if (nrings > 0 && (recs = static_cast<zfile_trace_t *>(
+        malloc(nrings * sizeof(rg->rg_recs)))) == NULL) {
+        errno = ENOMEM;
+        RETURN_ERRNO_EXCEPTION("malloc");
     }
 
-    baton->_path = strdup(*path);
-    baton->_mode = mode;
-    if (baton->_path == NULL) {
-        delete baton;
-        RETURN_EXCEPTION("OutOfMemory");
+    for (rg = head; rg != NULL; rg = rg->rg_link) {
+        uint32_t end = rg->rg_next;
+        uint32_t first = end > ZFILE_TRACE_RECS ? end - ZFILE_TRACE_RECS : 0;
+        uint32_t start = n;
+        uint32_t i = 0;
+
+        membar_consumer();
+        for (i = first; i < end; i++)
+            recs[n++] = rg->rg_recs[i % ZFILE_TRACE_RECS];
+
+        // Drop the oldest records, which the writer may have been writing
+        // over (up to and including record now) while we copied
+        membar_consumer();
+        uint32_t now = rg->rg_next;
+        uint32_t lost = now + 1 > first + ZFILE_TRACE_RECS ?
+            now + 1 - first - ZFILE_TRACE_RECS : 0;
+        if (lost > 0) {
+            lost = lost > end - first ? end - first : lost;
+            memmove(&recs[start], &recs[start + lost],
+                    (n - start - lost) * sizeof(*recs));
+            n -= lost;
+        }
     }
+    if (n > 0)
+        qsort(recs, n, sizeof(*recs), trace_compare);
 
-    baton->_callback = v8::Persistent<v8::Function>::New(callback);
+    // Records are on the hrtime clock; put them on the wall clock
+    struct timeval tv;
+    (void) gettimeofday(&tv, NULL);
+    double now_ms = tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
+    hrtime_t now_hr = gethrtime();
 
-    uv_work_t *req = new uv_work_t;
-    req->data = baton;
-    uv_queue_work(uv_default_loop(), req, uv_ZFile, uv_After);
+    v8::Local<v8::Array> out = v8::Array::New(n);
+    for (uint32_t i = 0; i < n; i++) {
+        const zfile_trace_t *tr = &recs[i];
+        v8::Local<v8::Object> r = v8::Object::New();
+
+        r->Set(v8::String::NewSymbol("time"), v8::Date::New(
+            now_ms - static_cast<double>(now_hr - tr->tr_time) / 1e6));
+        r->Set(v8::String::NewSymbol("thread"),
+               v8::Integer::NewFromUnsigned(tr->tr_thread));
+        r->Set(v8::String::NewSymbol("event"),
+               v8::String::New(tr->tr_event >= 0 &&
+                               tr->tr_event < ZFILE_TRACE_MAX ?
+                               zfile_trace_events[tr->tr_event] : "unknown"));
+        r->Set(v8::String::NewSymbol("zoneid"),
+               v8::Integer::New(tr->tr_zoneid));
+        r->Set(v8::String::NewSymbol("pid"), v8::Integer::New(tr->tr_pid));
+        r->Set(v8::String::NewSymbol("errno"),
+               v8::Integer::New(tr->tr_errno));
+        r->Set(v8::String::NewSymbol("arg"), v8::Integer::New(tr->tr_arg));
+        out->Set(i, r);
+    }
+
+    free(recs);
+    return scope.Close(out);
+}
+
+
+static v8::Handle<v8::Value> SetTraceOptions(const v8::Arguments& args) {
+    v8::HandleScope scope;
+
+    REQUIRE_ARGS(args);
+    trace_enabled = args[0]->BooleanValue() ? 1 : 0;
+
+    return v8::Undefined();
+}
+
+
+static v8::Handle<v8::Value> SetPoolOptions(const v8::Arguments& args) {
+    v8::HandleScope scope;
+
+    REQUIRE_INT_ARG(args, 0, size);
+    REQUIRE_INT_ARG(args, 1, max_queue);
+
+    if (size < 1)
+        RETURN_ARGS_EXCEPTION("pool size must be >= 1");
+    if (max_queue < 0)
+        RETURN_ARGS_EXCEPTION("queue limit must be >= 0");
+
+    // Surplus workers exit as they finish their current request; a larger
+    // pool is filled out by the next request.
+    pthread_mutex_lock(&pool_lock);
+    pool_size = size;
+    pool_max_queue = max_queue;
+    pthread_cond_broadcast(&pool_cv);
+    pthread_mutex_unlock(&pool_lock);
+
+    return v8::Undefined();
+}
+
+
+/*
+ * setFdCacheOptions(size, ttl): keep up to size read-only fds, each for up
+ * to ttl ms.  A size of 0 turns the cache off and closes what it holds.
+ */
+static v8::Handle<v8::Value> SetFdCacheOptions(const v8::Arguments& args) {
+    v8::HandleScope scope;
+
+    REQUIRE_INT_ARG(args, 0, size);
+    REQUIRE_INT_ARG(args, 1, ttl_ms);
+
+    if (size < 0)
+        RETURN_ARGS_EXCEPTION("cache size must be >= 0");
+    if (ttl_ms < 0)
+        RETURN_ARGS_EXCEPTION("cache ttl must be >= 0");
+
+    pthread_mutex_lock(&fdcache_lock);
+    fdcache_max = size;
+    fdcache_ttl = static_cast<hrtime_t>(ttl_ms) * 1000000;
+    fdcache_trim(fdcache_max);
+    pthread_mutex_unlock(&fdcache_lock);
+
+    return v8::Undefined();
+}
+
+
+static v8::Handle<v8::Value> SetAgentOptions(const v8::Arguments& args) {
+    v8::HandleScope scope;
+
+    REQUIRE_INT_ARG(args, 0, enabled);
+    REQUIRE_INT_ARG(args, 1, idle_ms);
+
+    if (idle_ms < 0)
+        RETURN_ARGS_EXCEPTION("idle timeout must be >= 0");
+
+    (void) atomic_swap_32(&agent_idle_ms, static_cast<uint32_t>(idle_ms));
+    (void) atomic_swap_32(&agents_enabled, enabled != 0);
 
     return v8::Undefined();
 }
@@ -548,11 +7525,98 @@ static v8::Handle<v8::Value> ZFile(const v8::Arguments& args) {
 //     }
 // }
 
+/*
+ * The open(2) flags zfile() takes, and its hints, by name.
+ */
+static v8::Local<v8::Object> open_constants(void) {
+    v8::Local<v8::Object> c = v8::Object::New();
+
+#define ZFILE_CONSTANT(NAME, VALUE)                                     \
+    c->Set(v8::String::NewSymbol(NAME), v8::Integer::New(VALUE))
+    ZFILE_CONSTANT("O_RDONLY", O_RDONLY);
+    ZFILE_CONSTANT("O_WRONLY", O_WRONLY);
+    ZFILE_CONSTANT("O_RDWR", O_RDWR);
+    ZFILE_CONSTANT("O_CREAT", O_CREAT);
+    ZFILE_CONSTANT("O_EXCL", O_EXCL);
+    ZFILE_CONSTANT("O_TRUNC", O_TRUNC);
+    ZFILE_CONSTANT("O_APPEND", O_APPEND);
+    ZFILE_CONSTANT("O_NONBLOCK", O_NONBLOCK);
+    ZFILE_CONSTANT("O_DSYNC", O_DSYNC);
+    ZFILE_CONSTANT("O_SYNC", O_SYNC);
+    ZFILE_CONSTANT("O_RSYNC", O_RSYNC);
+    ZFILE_CONSTANT("O_NOFOLLOW", O_NOFOLLOW);
+    ZFILE_CONSTANT("O_NOCTTY", O_NOCTTY);
+    ZFILE_CONSTANT("HINT_SEQUENTIAL", ZFILE_HINT_SEQUENTIAL);
+    ZFILE_CONSTANT("HINT_WILLNEED", ZFILE_HINT_WILLNEED);
+    ZFILE_CONSTANT("HINT_DIRECTIO", ZFILE_HINT_DIRECTIO);
+#undef ZFILE_CONSTANT
+
+    return (c);
+}
+
+
 void Init(v8::Handle<v8::Object> exports, v8::Handle<v8::Object> module) {
+      const char *trace_env = getenv("ZFILE_TRACE");
+      trace_enabled = trace_env == NULL || strcmp(trace_env, "0") != 0;
+
 //       module->Set(v8::String::NewSymbol("exports"),
 //                     v8::FunctionTemplate::New(ZFile)->GetFunction());
       exports->Set(v8::String::NewSymbol("zfile"),
                     v8::FunctionTemplate::New(ZFile)->GetFunction());
+      exports->Set(v8::String::NewSymbol("constants"), open_constants());
+      exports->Set(v8::String::NewSymbol("zfileCancel"),
+                    v8::FunctionTemplate::New(ZFileCancel)->GetFunction());
+      exports->Set(v8::String::NewSymbol("zfileSync"),
+                    v8::FunctionTemplate::New(ZFileSync)->GetFunction());
+      exports->Set(v8::String::NewSymbol("zfileReadSync"),
+                    v8::FunctionTemplate::New(ZFileReadSync)->GetFunction());
+      exports->Set(v8::String::NewSymbol("zfileTrace"),
+                    v8::FunctionTemplate::New(ZFileTrace)->GetFunction());
+      exports->Set(v8::String::NewSymbol("setTraceOptions"),
+                    v8::FunctionTemplate::New(SetTraceOptions)->GetFunction());
+      exports->Set(v8::String::NewSymbol("zfileMany"),
+                    v8::FunctionTemplate::New(ZFileMany)->GetFunction());
+      exports->Set(v8::String::NewSymbol("zfileRead"),
+                    v8::FunctionTemplate::New(ZFileRead)->GetFunction());
+      exports->Set(v8::String::NewSymbol("zfileQuery"),
+                    v8::FunctionTemplate::New(ZFileQuery)->GetFunction());
+      exports->Set(v8::String::NewSymbol("zfileMmap"),
+                    v8::FunctionTemplate::New(ZFileMmap)->GetFunction());
+      exports->Set(v8::String::NewSymbol("zfileScan"),
+                    v8::FunctionTemplate::New(ZFileScan)->GetFunction());
+      exports->Set(v8::String::NewSymbol("zfileHash"),
+                    v8::FunctionTemplate::New(ZFileHash)->GetFunction());
+      exports->Set(v8::String::NewSymbol("zfileCopy"),
+                    v8::FunctionTemplate::New(ZFileCopy)->GetFunction());
+      exports->Set(v8::String::NewSymbol("zfilePread"),
+                    v8::FunctionTemplate::New(ZFilePread)->GetFunction());
+      exports->Set(v8::String::NewSymbol("zfileWatch"),
+                    v8::FunctionTemplate::New(ZFileWatch)->GetFunction());
+      exports->Set(v8::String::NewSymbol("zfileUnwatch"),
+                    v8::FunctionTemplate::New(ZFileUnwatch)->GetFunction());
+      exports->Set(v8::String::NewSymbol("zfileZoneWatch"),
+                    v8::FunctionTemplate::New(ZFileZoneWatch)->GetFunction());
+      exports->Set(v8::String::NewSymbol("zfileZoneEvent"),
+                    v8::FunctionTemplate::New(ZFileZoneEvent)->GetFunction());
+      exports->Set(v8::String::NewSymbol("zfileZoneState"),
+                    v8::FunctionTemplate::New(ZFileZoneState)->GetFunction());
+      exports->Set(v8::String::NewSymbol("zfileWrite"),
+                    v8::FunctionTemplate::New(ZFileWrite)->GetFunction());
+      exports->Set(v8::String::NewSymbol("zfileAcross"),
+                    v8::FunctionTemplate::New(ZFileAcross)->GetFunction());
+      exports->Set(v8::String::NewSymbol("getStats"),
+                    v8::FunctionTemplate::New(GetStats)->GetFunction());
+      exports->Set(v8::String::NewSymbol("resetStats"),
+                    v8::FunctionTemplate::New(ResetStats)->GetFunction());
+      exports->Set(v8::String::NewSymbol("setSpawnMode"),
+                    v8::FunctionTemplate::New(SetSpawnMode)->GetFunction());
+      exports->Set(v8::String::NewSymbol("setPoolOptions"),
+                    v8::FunctionTemplate::New(SetPoolOptions)->GetFunction());
+      exports->Set(v8::String::NewSymbol("setFdCacheOptions"),
+                    v8::FunctionTemplate::New(
+                        SetFdCacheOptions)->GetFunction());
+      exports->Set(v8::String::NewSymbol("setAgentOptions"),
+                    v8::FunctionTemplate::New(SetAgentOptions)->GetFunction());
 }
 
 NODE_MODULE(zfile, Init)
@@ -8,10 +8,13 @@
  * Copyright (c) 2014, Joyent, Inc.
  */
 
+var EventEmitter = require('events').EventEmitter;
+var exec = require('child_process').exec;
 var fs = require('fs');
 var vasync = require('vasync');
 var testCase = require('nodeunit').testCase;
 
+var bindings = require('../build/Release/zfile');
 var zfile = require('../lib/zfile');
 function setUp(callback) {
     this.zone = process.env.TEST_ZONE;
@@ -210,6 +213,861 @@ function testSuccessWriteStream(test) {
     });
 }
 
+function testInvalidConfigure(test) {
+    test.expect(8);
+    test.throws(function () {
+        zfile.configure();
+    });
+    test.throws(function () {
+        zfile.configure({ agents: 'yes' });
+    });
+    test.throws(function () {
+        zfile.configure({ agentIdleTimeout: -1 });
+    });
+    test.throws(function () {
+        zfile.configure({ poolSize: 0 });
+    });
+    test.throws(function () {
+        zfile.configure({ maxQueue: -1 });
+    });
+    test.throws(function () {
+        zfile.configure({ fdCacheSize: -1 });
+    });
+    test.throws(function () {
+        zfile.configure({ timeout: -1 });
+    });
+    test.throws(function () {
+        zfile.configure({ trace: 'on' });
+    });
+    test.done();
+}
+
+
+function testAgentReadFileDescriptor(test) {
+    var self = this;
+    test.expect(6);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    zfile.configure({ agents: true });
+
+    vasync.forEachPipeline({
+        inputs: [1, 2],
+        func: function (_, next) {
+            zfile.getZoneFileDescriptor(
+                { zone: self.zone, path: self.path, mode: 'r' },
+                function (err, fd) {
+                    test.ok(!err, err + ' (agent open)');
+                    test.ok(fd > 0);
+                    if (fd > 0) {
+                        fs.closeSync(fd);
+                    }
+                    next();
+                });
+        }
+    }, function (err) {
+        test.ifError(err);
+        zfile.configure({ agents: false });
+        test.done();
+    });
+}
+
+function testBatchFileDescriptors(test) {
+    var self = this;
+    test.expect(7);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    zfile.getZoneFileDescriptors({
+        zone: self.zone,
+        files: [
+            { path: self.path, mode: 'r' },
+            { path: '/this/does/not/exist' },
+            { path: self.path }
+        ]
+    }, function (err, results) {
+        test.ifError(err);
+        test.equal(results.length, 3);
+        test.ok(results[0].fd > 0);
+        test.equal(results[1].error.code, 'ENOENT');
+        test.ok(results[2].fd > 0);
+        test.notEqual(results[0].fd, results[2].fd);
+        results.forEach(function (r) {
+            if (r.fd !== undefined) {
+                fs.closeSync(r.fd);
+            }
+        });
+        test.done();
+    });
+}
+
+/*
+ * Whether, going by the trace, an open in one zone started while one in
+ * another was still under way.
+ */
+function crossZoneOverlap(recs) {
+    var open = {};
+    var overlap = false;
+
+    recs.sort(function (x, y) { return (x.time - y.time); });
+    recs.forEach(function (r) {
+        if (r.event === 'open_done') {
+            open[r.zoneid]--;
+            return;
+        }
+        overlap = overlap || Object.keys(open).some(function (z) {
+            return (Number(z) !== r.zoneid && open[z] > 0);
+        });
+        open[r.zoneid] = (open[r.zoneid] || 0) + 1;
+    });
+    return (overlap);
+}
+
+function testConcurrentZoneOpens(test) {
+    var self = this;
+    var n = 8;
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    exec('zoneadm list', function (err, stdout) {
+        var zones = err ? [] : stdout.split('\n').filter(function (z) {
+            return (z && z !== 'global');
+        });
+        if (zones.indexOf(self.zone) === -1) {
+            zones.push(self.zone);
+        }
+        if (zones.length < 2) {
+            console.error('skipping: needs two running non-global zones');
+            test.expect(1);
+            test.done();
+            return;
+        }
+        test.expect(3 + n * 2);
+
+        var inputs = [];
+        for (var i = 0; i < n; i++) {
+            inputs.push(zones[i % 2]);
+        }
+
+        // Forks, so that each open shows up in the trace start and end
+        zfile.configure({ agents: false, fdCacheSize: 0, trace: true });
+        zfile.resetStats();
+        var start = Date.now();
+        vasync.forEachParallel({
+            inputs: inputs,
+            func: function (zone, next) {
+                zfile.getZoneFileDescriptor(
+                    { zone: zone, path: self.path, mode: 'r' },
+                    function (err2, fd) {
+                        test.ok(!err2, err2 + ' (zone ' + zone + ')');
+                        test.ok(fd > 0);
+                        if (fd > 0) {
+                            fs.closeSync(fd);
+                        }
+                        next();
+                    });
+            }
+        }, function () {
+            var recs = zfile.dumpTrace().filter(function (r) {
+                return ((r.event === 'fork' || r.event === 'open_done') &&
+                    r.time.getTime() >= start);
+            });
+            test.ok(zfile.getStats().maxInflight > 1,
+                'opens should overlap');
+            test.ok(crossZoneOverlap(recs),
+                'opens in different zones should overlap');
+            test.done();
+        });
+    });
+}
+
+function testMissingFileErrno(test) {
+    var self = this;
+    test.expect(4);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    zfile.getZoneFileDescriptor(
+        { zone: self.zone, path: '/this/does/not/exist', mode: 'r' },
+        function (err, fd) {
+            test.ok(err);
+            test.equal(err.code, 'ENOENT');
+            test.equal(err.syscall, 'open');
+            test.done();
+        });
+}
+
+function testStats(test) {
+    var self = this;
+    test.expect(6);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    zfile.resetStats();
+    zfile.getZoneFileDescriptor(
+        { zone: self.zone, path: self.path, mode: 'r' },
+        function (err, fd) {
+            test.ifError(err);
+            fs.closeSync(fd);
+
+            var stats = zfile.getStats();
+            test.equal(stats.count, 1);
+            test.equal(stats.phases.total.count, 1);
+            test.ok(stats.phases.total.p50 > 0);
+            test.ok(stats.phases.open.count >= 1);
+            test.done();
+        });
+}
+
+function testQueueFull(test) {
+    var self = this;
+    var n = 5;
+    var opened = 0;
+    var rejected = 0;
+    var codes = [];
+    test.expect(3);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    zfile.configure({ poolSize: 1, maxQueue: 1 });
+    for (var i = 0; i < n; i++) {
+        zfile.getZoneFileDescriptor(
+            { zone: self.zone, path: self.path, mode: 'r' }, onOpen);
+    }
+
+    function onOpen(err, fd) {
+        if (err) {
+            codes.push(err.code);
+            rejected++;
+        } else {
+            fs.closeSync(fd);
+            opened++;
+        }
+        if (opened + rejected < n) {
+            return;
+        }
+        zfile.configure({ poolSize: 4, maxQueue: 1024 });
+        test.ok(opened >= 1 && rejected >= 1,
+            opened + ' opened, ' + rejected + ' rejected');
+        test.ok(codes.every(function (c) { return (c === 'EAGAIN'); }),
+            codes.join(','));
+        test.done();
+    }
+}
+
+function testAcrossZones(test) {
+    var self = this;
+    var zones = [self.zone, 'zfile-no-such-zone', self.zone];
+    var seen = 0;
+    test.expect(9);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    zfile.getZoneFileDescriptorAcross({
+        zones: zones,
+        path: self.path,
+        parallelism: 2,
+        onZone: function (err, r) {
+            test.ok(zones.indexOf(r.zone) !== -1);
+            seen++;
+        }
+    }, function (err, results) {
+        test.ifError(err);
+        test.equal(seen, 3);
+        test.ok(results[0].fd > 0);
+        test.ok(results[1].error);
+        test.ok(results[2].fd > 0);
+        results.forEach(function (r) {
+            if (r.fd !== undefined) {
+                fs.closeSync(r.fd);
+            }
+        });
+        test.done();
+    });
+}
+
+function testReadZoneFile(test) {
+    var self = this;
+    test.expect(5);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    zfile.readZoneFile({ zone: self.zone, path: self.path }, function (err, b) {
+        test.ifError(err);
+        test.ok(Buffer.isBuffer(b));
+        test.ok(b.toString().indexOf('root:') !== -1);
+
+        zfile.readZoneFile({ zone: self.zone, path: self.path, maxSize: 4 },
+            function (err2) {
+                test.equal(err2 && err2.code, 'EFBIG');
+                test.done();
+            });
+    });
+}
+
+function testWriteZoneFileAtomic(test) {
+    var self = this;
+    var path = '/var/tmp/zfile-test-atomic';
+    test.expect(5);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    zfile.writeZoneFileAtomic({ zone: self.zone, path: path }, 'one\n',
+        function (err) {
+            test.ifError(err);
+            zfile.writeZoneFileAtomic({ zone: self.zone, path: path,
+                fsync: true }, new Buffer('two\n'), onSecond);
+        });
+
+    function onSecond(err) {
+        test.ifError(err);
+        zfile.readZoneFile({ zone: self.zone, path: path },
+            function (err2, buf) {
+                test.ifError(err2);
+                test.equal(buf && buf.toString(), 'two\n');
+                exec('zlogin ' + self.zone + ' rm -f ' + path, function () {
+                    test.done();
+                });
+            });
+    }
+}
+
+function testMmapZoneFile(test) {
+    var self = this;
+    test.expect(5);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    zfile.mmapZoneFile({ zone: self.zone, path: self.path,
+        advice: 'sequential' }, function (err, b) {
+        test.ifError(err);
+        test.ok(Buffer.isBuffer(b));
+        test.ok(b.toString().indexOf('root:') !== -1);
+
+        zfile.mmapZoneFile({ zone: self.zone, path: '/etc' },
+            function (err2) {
+                test.equal(err2 && err2.code, 'EISDIR');
+                test.done();
+            });
+    });
+}
+
+function testScanZoneFile(test) {
+    var self = this;
+    test.expect(7);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    zfile.scanZoneFile({ zone: self.zone, path: self.path },
+        ['root:', 'no such needle'], function (err, matches, truncated) {
+        test.ifError(err);
+        test.ok(matches.length >= 1);
+        test.equal(matches[0].line.indexOf('root:'), 0);
+        test.equal(truncated, false);
+
+        zfile.scanZoneFile({ zone: self.zone, path: self.path, offsets: true,
+            maxMatches: 1 }, ':', function (err2, offsets, truncated2) {
+            test.deepEqual(offsets, [0]);
+            test.equal(truncated2, true);
+            test.done();
+        });
+    });
+}
+
+function testHashZoneFile(test) {
+    var self = this;
+    var path = '/var/tmp/zfile-test-hash';
+    test.expect(7);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    zfile.writeZoneFileAtomic({ zone: self.zone, path: path }, 'abc',
+        function (err) {
+            test.ifError(err);
+            zfile.hashZoneFile({ zone: self.zone, path: path }, 'sha256',
+                onSha);
+        });
+
+    function onSha(err, r) {
+        test.ifError(err);
+        test.equal(r.digest, 'ba7816bf8f01cfea414140de5dae2223' +
+            'b00361a396177a9cb410ff61f20015ad');
+        test.equal(r.size, 3);
+        test.ok(r.mtime instanceof Date);
+        zfile.hashZoneFile({ zone: self.zone, path: path }, 'xxh64',
+            function (err2, r2) {
+                test.equal(r2 && r2.digest, '44bc2cf5ad770999');
+                exec('zlogin ' + self.zone + ' rm -f ' + path, function () {
+                    test.done();
+                });
+            });
+    }
+}
+
+function testFollowZoneFile(test) {
+    var self = this;
+    var path = '/var/tmp/zfile-test-follow';
+    var seen = [];
+    test.expect(5);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    zfile.writeZoneFileAtomic({ zone: self.zone, path: path }, 'one\n',
+        function (err) {
+            test.ifError(err);
+            var f = zfile.followZoneFile({ zone: self.zone, path: path,
+                fromStart: true });
+            f.on('error', function (err2) {
+                test.ifError(err2);
+                test.done();
+            });
+            f.on('rotate', function () {
+                seen.push('rotate');
+            });
+            f.on('data', function (buf) {
+                seen.push(buf.toString());
+                if (seen.join('') === 'one\n') {
+                    append();
+                } else if (seen.join('') === 'one\ntwo\n') {
+                    // A rename over the file is a rotation
+                    zfile.writeZoneFileAtomic({ zone: self.zone,
+                        path: path }, 'three\n', function (err3) {
+                        if (err3) {
+                            test.ifError(err3);
+                            test.done();
+                        }
+                    });
+                } else if (buf.toString() === 'three\n') {
+                    f.close();
+                    test.deepEqual(seen,
+                        ['one\n', 'two\n', 'rotate', 'three\n']);
+                    test.ok(f.closed);
+                    exec('zlogin ' + self.zone + ' rm -f ' + path,
+                        function () {
+                            test.done();
+                        });
+                }
+            });
+        });
+
+    function append() {
+        zfile.getZoneFileDescriptor({ zone: self.zone, path: path,
+            mode: 'a' }, function (err, fd) {
+            test.ifError(err);
+            fs.writeSync(fd, new Buffer('two\n'), 0, 4, null);
+            fs.closeSync(fd);
+        });
+    }
+}
+
+function testFdCache(test) {
+    var self = this;
+    var opts = { zone: self.zone, path: self.path, mode: 'r' };
+    test.expect(7);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    zfile.configure({ fdCacheSize: 16, fdCacheTTL: 60000 });
+    zfile.resetStats();
+
+    vasync.forEachPipeline({
+        inputs: [1, 2],
+        func: function (_, next) {
+            zfile.getZoneFileDescriptor(opts, function (err, fd) {
+                if (err) {
+                    return (next(err));
+                }
+                // Each fd has its own offset, even when served from cache
+                var buf = new Buffer(5);
+                fs.readSync(fd, buf, 0, 5, null);
+                fs.closeSync(fd);
+                test.equal(buf.toString(), 'root:');
+                return (next());
+            });
+        }
+    }, function (err) {
+        test.ifError(err);
+        var stats = zfile.getStats();
+        test.equal(stats.fdCache.misses, 1);
+        test.equal(stats.fdCache.hits, 1);
+
+        zfile.configure({ fdCacheSize: 0 });
+        test.equal(zfile.getStats().fdCache.size, 0);
+        test.done();
+    });
+}
+
+function testStatAndReadDir(test) {
+    var self = this;
+    test.expect(8);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    zfile.statZoneFile({ zone: self.zone, path: self.path },
+        function (err, st) {
+        test.ifError(err);
+        test.ok(st.isFile());
+        test.ok(st.size > 0);
+        test.ok(st.mtime instanceof Date);
+
+        zfile.readZoneDir({ zone: self.zone, path: '/etc' },
+            function (err2, names) {
+            test.ifError(err2);
+            test.ok(names.indexOf('passwd') !== -1);
+            test.equal(names.indexOf('.'), -1);
+            test.done();
+        });
+    });
+}
+
+function testTimeout(test) {
+    var self = this;
+    var fifo = '/var/tmp/zfile-test-fifo';
+    test.expect(4);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    // Opening a FIFO with no writer blocks the child until it's killed
+    exec('zlogin ' + self.zone + ' "rm -f ' + fifo + '; mkfifo ' + fifo + '"',
+        function (err) {
+            test.ifError(err);
+            zfile.getZoneFileDescriptor({
+                zone: self.zone,
+                path: fifo,
+                mode: 'r',
+                timeout: 200
+            }, function (err2) {
+                test.equal(err2 && err2.code, 'ETIMEDOUT');
+                zfile.getZoneFileDescriptor({
+                    zone: self.zone,
+                    path: self.path,
+                    mode: 'r'
+                }, function (err3, fd) {
+                    test.ifError(err3);
+                    if (fd !== undefined) {
+                        fs.closeSync(fd);
+                    }
+                    exec('zlogin ' + self.zone + ' rm -f ' + fifo,
+                        function () { test.done(); });
+                });
+            });
+        });
+}
+
+function testWatchZones(test) {
+    var self = this;
+    test.expect(8);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    var events = zfile.watchZones();
+    test.equal(typeof (events.on), 'function');
+    test.strictEqual(zfile.watchZones(), events);
+
+    zfile.configure({ agents: true, fdCacheSize: 16, fdCacheTTL: 60000 });
+    exec('zoneadm -z ' + self.zone + ' list -p', function (err, stdout) {
+        test.ifError(err);
+        var zoneid = parseInt(stdout.split(':')[0], 10);
+        var opts = { zone: self.zone, path: self.path };
+
+        zfile.getZoneFileDescriptor(opts, function (err2, fd) {
+            test.ifError(err2);
+            fs.closeSync(fd);
+
+            var before = bindings.zfileZoneState(self.zone, zoneid);
+            test.ok(before.cached && before.agent && before.fds > 0,
+                JSON.stringify(before));
+
+            events.on('change', function onChange(ev) {
+                if (ev.zone !== self.zone || ev.state !== 'shutting_down') {
+                    return;
+                }
+                events.removeListener('change', onChange);
+                test.equal(ev.zoneid, zoneid);
+                zfile.configure({ agents: false, fdCacheSize: 0 });
+                test.done();
+            });
+            // As if the zone were halting: everything kept for it goes
+            bindings.zfileZoneEvent(self.zone, zoneid, 'shutting_down',
+                'running');
+            test.deepEqual(bindings.zfileZoneState(self.zone, zoneid),
+                { cached: false, agent: false, fds: 0 });
+        });
+    });
+}
+
+function testOpenFlags(test) {
+    var self = this;
+    var c = zfile.constants;
+    var path = '/var/tmp/zfile-test-excl';
+    var opts = {
+        zone: self.zone,
+        path: path,
+        flags: c.O_WRONLY | c.O_CREAT | c.O_EXCL,
+        perms: 384,
+        hints: ['sequential', 'willneed']
+    };
+    test.expect(6);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+    test.throws(function () {
+        zfile.getZoneFileDescriptor({ zone: self.zone, path: path,
+            flags: c.O_RDONLY, hints: ['bogus'] }, function () {});
+    });
+
+    exec('zlogin ' + self.zone + ' rm -f ' + path, function () {
+        zfile.getZoneFileDescriptor(opts, function (err, fd) {
+            test.ifError(err);
+            if (fd !== undefined) {
+                fs.closeSync(fd);
+            }
+            zfile.getZoneFileDescriptor(opts, function (err2) {
+                test.equal(err2 && err2.code, 'EEXIST');
+                zfile.statZoneFile({ zone: self.zone, path: path },
+                    function (err3, st) {
+                        test.ifError(err3);
+                        test.equal(st && (st.mode & 511), 384);
+                        exec('zlogin ' + self.zone + ' rm -f ' + path,
+                            function () { test.done(); });
+                    });
+            });
+        });
+    });
+}
+
+function testCopyZoneFile(test) {
+    var self = this;
+    var path = '/var/tmp/zfile-test-copy';
+    var suid = '/var/tmp/zfile-test-suid';
+    test.expect(9);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    function copySuid() {
+        zfile.copyZoneFile({
+            from: { path: suid },
+            to: { zone: self.zone, path: path }
+        }, function (err) {
+            test.ifError(err);
+            fs.unlinkSync(suid);
+            zfile.statZoneFile({ zone: self.zone, path: path },
+                function (err2, st) {
+                    test.ifError(err2);
+                    test.equal(st && st.mode & parseInt('7777', 8),
+                        parseInt('755', 8));
+                    exec('zlogin ' + self.zone + ' rm -f ' + path,
+                        function () { test.done(); });
+                });
+        });
+    }
+
+    zfile.copyZoneFile({
+        from: { zone: self.zone, path: self.path },
+        to: { zone: self.zone, path: path },
+        atomic: true
+    }, function (err, res) {
+        test.ifError(err);
+        zfile.readZoneFile({ zone: self.zone, path: path },
+            function (err2, copy) {
+                test.ifError(err2);
+                zfile.readZoneFile({ zone: self.zone, path: self.path },
+                    function (err3, orig) {
+                        test.ifError(err3);
+                        test.equal(res && res.bytes, orig && orig.length);
+                        test.equal(copy && copy.toString(),
+                            orig && orig.toString());
+
+                        // A setuid source mustn't make a setuid target
+                        fs.writeFileSync(suid, 'x');
+                        fs.chmodSync(suid, parseInt('4755', 8));
+                        exec('zlogin ' + self.zone + ' rm -f ' + path,
+                            copySuid);
+                    });
+            });
+    });
+}
+
+function testReadAheadStream(test) {
+    var self = this;
+    test.expect(4);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    zfile.createZoneFileStream({
+        zone: self.zone,
+        path: self.path,
+        readAhead: 3,
+        chunkSize: 64
+    }, function (err, stream) {
+        test.ifError(err);
+        var bufs = [];
+        stream.on('data', function (b) { bufs.push(b); });
+        stream.on('end', function () {
+            zfile.readZoneFile({ zone: self.zone, path: self.path },
+                function (err2, whole) {
+                    test.ifError(err2);
+                    test.equal(Buffer.concat(bufs).toString(),
+                        whole && whole.toString());
+                    test.done();
+                });
+        });
+    });
+}
+
+function testAbortQueuedOpens(test) {
+    var self = this;
+    var n = 5;
+    var opts = { zone: self.zone, path: self.path };
+    var handedOut = zfile.getStats().fds.handedOut;
+    var tickets = [];
+    var fired = 0;
+    test.expect(zfile.promises.Promise ? 6 : 5);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    // With one pool thread all but (at most) the first are still queued
+    zfile.configure({ poolSize: 1 });
+    for (var i = 0; i < n; i++) {
+        tickets.push(zfile.getZoneFileDescriptor(opts, function (err, fd) {
+            fired++;
+            if (!err) {
+                fs.closeSync(fd);
+            }
+        }));
+    }
+    test.ok(tickets.every(function (t) {
+        return (bindings.zfileCancel(t));
+    }));
+
+    // Let the open that was already running finish and be dropped
+    setTimeout(function () {
+        test.equal(fired, 0);
+        test.equal(zfile.getStats().fds.handedOut, handedOut);
+        if (zfile.promises.Promise) {
+            abortPromises();
+            return;
+        }
+        // node 0.10: nothing to return without a Promise library
+        test.throws(function () {
+            zfile.promises.getZoneFileDescriptor(opts);
+        });
+        zfile.configure({ poolSize: 4 });
+        test.done();
+    }, 1000);
+
+    function abortPromises() {
+        var signal = new EventEmitter();
+        var names = [];
+        var fds = fs.readdirSync('/proc/self/fd').length;
+
+        signal.aborted = false;
+        for (var j = 0; j < n; j++) {
+            zfile.promises.getZoneFileDescriptor({
+                zone: self.zone,
+                path: self.path,
+                signal: signal
+            }).then(function (fd) {
+                fs.closeSync(fd);
+                settled('opened');
+            }, function (err) {
+                settled(err.name);
+            });
+        }
+        signal.aborted = true;
+        signal.emit('abort');
+
+        function settled(name) {
+            names.push(name);
+            if (names.length < n) {
+                return;
+            }
+            test.ok(names.every(function (m) {
+                return (m === 'AbortError');
+            }), names.join(','));
+            setTimeout(function () {
+                zfile.configure({ poolSize: 4 });
+                test.equal(fs.readdirSync('/proc/self/fd').length, fds);
+                test.done();
+            }, 1000);
+        }
+    }
+}
+
+function testBatonPool(test) {
+    var self = this;
+    test.expect(4);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    var opts = { zone: self.zone, path: self.path, mode: 'r' };
+    zfile.getZoneFileDescriptor(opts, function (err, fd) {
+        test.ifError(err);
+        fs.closeSync(fd);
+        // The first open's baton goes back on the freelist after we return
+        setImmediate(function () {
+            zfile.resetStats();
+            zfile.getZoneFileDescriptor(opts, function (err2, fd2) {
+                test.ifError(err2);
+                fs.closeSync(fd2);
+                var pool = zfile.getStats().batonPool;
+                test.ok(pool.hits === 1 && pool.misses === 0,
+                    pool.hits + ' hits, ' + pool.misses + ' misses');
+                test.done();
+            });
+        });
+    });
+}
+
+function testDumpTrace(test) {
+    var self = this;
+    test.expect(4);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    zfile.configure({ agents: false, fdCacheSize: 0, trace: true });
+    zfile.getZoneFileDescriptor({ zone: self.zone, path: self.path },
+        function (err, fd) {
+            test.ifError(err);
+            fs.closeSync(fd);
+            var recs = zfile.dumpTrace().filter(function (r) {
+                return (r.event === 'open_done' && r.arg === fd);
+            });
+            test.ok(recs.length >= 1, 'no open_done record for fd ' + fd);
+            test.ok(recs[0].time instanceof Date);
+            test.done();
+        });
+}
+
+function testLeakCounters(test) {
+    var self = this;
+    test.expect(5);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    var before = zfile.getStats();
+    zfile.configure({ agents: false, fdCacheSize: 0 });
+    zfile.getZoneFileDescriptor({ zone: self.zone, path: self.path },
+        function (err, fd) {
+            test.ifError(err);
+            test.equal(zfile.getStats().fds.handedOut,
+                before.fds.handedOut + 1);
+            zfile.closeZoneFileDescriptor(fd, function (err2) {
+                test.ifError(err2);
+                var after = zfile.getStats();
+                test.ok(after.fds.open === before.fds.open &&
+                    after.contracts.leaked === before.contracts.leaked &&
+                    after.contracts.created > before.contracts.created,
+                    JSON.stringify(after.contracts));
+                test.done();
+            });
+        });
+}
+
+function testSyncOpens(test) {
+    var self = this;
+    test.expect(5);
+    test.equal(process.getuid(), 0, 'must be root to run this test');
+
+    var fd = zfile.getZoneFileDescriptorSync({
+        zone: self.zone,
+        path: self.path
+    });
+    test.ok(fs.fstatSync(fd).isFile());
+    fs.closeSync(fd);
+
+    var data = zfile.readZoneFileSync({ zone: self.zone, path: self.path });
+    zfile.readZoneFile({ zone: self.zone, path: self.path },
+        function (err, whole) {
+            test.ifError(err);
+            test.equal(data.toString(), whole && whole.toString());
+            try {
+                zfile.readZoneFileSync({
+                    zone: self.zone,
+                    path: '/nonexistent'
+                });
+            } catch (e) {
+                test.equal(e.code, 'ENOENT');
+            }
+            test.done();
+        });
+}
+
 module.exports = {
     setUp: setUp,
     tearDown: tearDown,
@@ -224,5 +1082,31 @@ module.exports = {
         testSuccessWriteFileDescriptor,
     'test invalid modes': testInvalidModes,
     'test successly opening a read stream': testSuccessReadStream,
-    'test success opening a write stream': testSuccessWriteStream
+    'test success opening a write stream': testSuccessWriteStream,
+    'test invalid configure options': testInvalidConfigure,
+    'test opening through a zone agent': testAgentReadFileDescriptor,
+    'test opening a batch of file descriptors': testBatchFileDescriptors,
+    'test concurrent opens to distinct zones overlap': testConcurrentZoneOpens,
+    'test missing file reports the open errno': testMissingFileErrno,
+    'test stats count an open': testStats,
+    'test a full queue rejects with EAGAIN': testQueueFull,
+    'test opening a file across zones': testAcrossZones,
+    'test reading a whole zone file': testReadZoneFile,
+    'test atomically replacing a zone file': testWriteZoneFileAtomic,
+    'test mapping a zone file': testMmapZoneFile,
+    'test searching a zone file': testScanZoneFile,
+    'test hashing a zone file': testHashZoneFile,
+    'test following a zone file': testFollowZoneFile,
+    'test the fd cache serves repeat reads': testFdCache,
+    'test stat and readdir in a zone': testStatAndReadDir,
+    'test a hung open times out': testTimeout,
+    'test watching zone state changes': testWatchZones,
+    'test opening with explicit flags, perms and hints': testOpenFlags,
+    'test copying a file between zones': testCopyZoneFile,
+    'test a read-ahead stream': testReadAheadStream,
+    'test aborting queued promise opens': testAbortQueuedOpens,
+    'test repeat opens reuse pooled batons': testBatonPool,
+    'test the trace records an open': testDumpTrace,
+    'test the leak counters balance': testLeakCounters,
+    'test opening and reading on the calling thread': testSyncOpens
 };